@@ -3,6 +3,25 @@
 
 #include "mathx.h"
 #include "vec3.h"
+#include <cstdint>
+
+// Up to 32 rays from one origin, such as the ambient-occlusion probes of a hit, traced together.
+// Bit i of a ray mask stands for ray i.
+struct rayFan {
+    static constexpr unsigned int maxRays = 32;
+    explicit rayFan(const vec3& origin) : origin(origin), count(0) {}
+    void add(const vec3& direction)
+    {
+        directions[count] = direction;
+        inverseDirections[count] = vec3(1 / direction.x(), 1 / direction.y(), 1 / direction.z());
+        ++count;
+    }
+    uint32_t all() const { return count == maxRays ? ~0u : (1u << count) - 1; }
+    vec3 origin;
+    vec3 directions[maxRays];
+    vec3 inverseDirections[maxRays];
+    unsigned int count;
+};
 
 class aabb
 {
@@ -14,6 +33,11 @@ class aabb
     inline vec3 min() const { return _min; }
     inline vec3 max() const { return _max; }
     inline vec3 extent() const { return _max - _min; }
+    inline float surfaceArea() const
+    {
+        vec3 e = extent();
+        return 2.f * (e.x() * e.y() + e.y() * e.z() + e.z() * e.x());
+    }
 
     bool hit(const ray& r, float tMin, float tMax) const
     {
@@ -29,9 +53,37 @@ class aabb
             if (tMax <= tMin) {
                 return false;
             }
-            return true;
         }
-        return false;
+        return true;
+    }
+    // The rays of `active` whose (tMin, tMax) segment overlaps the box.
+    uint32_t hit(const rayFan& fan, float tMin, float tMax, uint32_t active) const
+    {
+        const vec3 low = min() - fan.origin;
+        const vec3 high = max() - fan.origin;
+        uint32_t result = 0;
+        for (; active != 0; active &= active - 1) {
+            const unsigned int i = __builtin_ctz(active);
+            const vec3& invDirection = fan.inverseDirections[i];
+            float t0 = tMin, t1 = tMax;
+            int a = 0;
+            for (; a < 3; ++a) {
+                float near = low[a] * invDirection[a];
+                float far = high[a] * invDirection[a];
+                if (invDirection[a] < 0.f) {
+                    std::swap(near, far);
+                }
+                t0 = mathx::max(t0, near);
+                t1 = mathx::min(t1, far);
+                if (t1 <= t0) {
+                    break;
+                }
+            }
+            if (a == 3) {
+                result |= 1u << i;
+            }
+        }
+        return result;
     }
     void expandToInclude(const vec3& p)
     {
@@ -72,7 +124,7 @@ class aabb
     {
         vec3 min(mathx::min(b1.min().x(), b2.min().x()), mathx::min(b1.min().y(), b2.min().y()),
                  mathx::min(b1.min().z(), b2.min().z()));
-        vec3 max(mathx::max(b1.max().x(), b2.max().x()), mathx::max(b1.min().y(), b2.max().y()),
+        vec3 max(mathx::max(b1.max().x(), b2.max().x()), mathx::max(b1.max().y(), b2.max().y()),
                  mathx::max(b1.max().z(), b2.max().z()));
         return aabb(min, max);
     }
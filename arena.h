@@ -0,0 +1,87 @@
+#ifndef ARENA_H
+#define ARENA_H
+
+#include <cstddef>
+#include <cstdint>
+#include <new>
+#include <utility>
+#include <vector>
+
+// Bump allocator for everything a scene owns: primitives, materials, BVH nodes and their arrays.
+// Objects are placed back to back in build order and are never destroyed individually;
+// release() drops whole blocks, so teardown costs one free per block. Objects created here must
+// not be deleted and their destructors are not run.
+class sceneArena
+{
+  public:
+    sceneArena(size_t blockSize = 1u << 20)
+        : blockSize(blockSize), current(nullptr), remaining(0), allocationCount(0), bytesUsed(0),
+          bytesReserved(0)
+    {
+    }
+    ~sceneArena() { release(); }
+    sceneArena(const sceneArena&) = delete;
+    sceneArena& operator=(const sceneArena&) = delete;
+
+    void* allocate(size_t size, size_t alignment)
+    {
+        size_t padding = (alignment - ((uintptr_t)current % alignment)) % alignment;
+        if (current == nullptr || padding + size > remaining) {
+            const size_t blockBytes = size + alignment > blockSize ? size + alignment : blockSize;
+            current = (unsigned char*)::operator new(blockBytes);
+            blocks.push_back(current);
+            remaining = blockBytes;
+            bytesReserved += blockBytes;
+            padding = (alignment - ((uintptr_t)current % alignment)) % alignment;
+        }
+        void* p = current + padding;
+        current += padding + size;
+        remaining -= padding + size;
+        allocationCount++;
+        bytesUsed += size;
+        return p;
+    }
+
+    template <typename T, typename... Args> T* create(Args&&... args)
+    {
+        return new (allocate(sizeof(T), alignof(T))) T(std::forward<Args>(args)...);
+    }
+
+    template <typename T> T* createArray(size_t count)
+    {
+        T* p = (T*)allocate(sizeof(T) * count, alignof(T));
+        for (size_t i = 0; i < count; ++i) {
+            new (p + i) T();
+        }
+        return p;
+    }
+
+    void release()
+    {
+        for (unsigned char* block : blocks) {
+            ::operator delete(block);
+        }
+        blocks.clear();
+        current = nullptr;
+        remaining = 0;
+        allocationCount = 0;
+        bytesUsed = 0;
+        bytesReserved = 0;
+    }
+
+    inline size_t blockCount() const { return blocks.size(); }
+
+    const size_t blockSize;
+
+  private:
+    std::vector<unsigned char*> blocks;
+    unsigned char* current;
+    size_t remaining;
+
+  public:
+    size_t allocationCount;
+    size_t bytesUsed;
+    size_t bytesReserved;
+};
+
+#endif
@@ -4,9 +4,25 @@
 #include "myRandom.h"
 #include "vec3.h"
 
+// Everything needed to construct a camera, kept as plain data so it can be sent to other
+// processes (see distributed.h).
+struct cameraParameters {
+    vec3 lookFrom;
+    vec3 lookAt;
+    vec3 up;
+    float fov;
+    float aspectRatio;
+    float aperture;
+    float focusDistance;
+};
+
 class camera
 {
   public:
+    camera(const cameraParameters& p)
+        : camera(p.lookFrom, p.lookAt, p.up, p.fov, p.aspectRatio, p.aperture, p.focusDistance)
+    {
+    }
     camera(const vec3& lookFrom, const vec3& lookAt, const vec3& up, float fov, float aspectRatio,
            float aperture, float focusDistance)
     {
@@ -0,0 +1,56 @@
+#ifndef CONTENTHASH_H
+#define CONTENTHASH_H
+
+#include "camera.h"
+#include "scene.h"
+#include <cstdint>
+#include <type_traits>
+
+// FNV-1a over the bytes of scalars, for keys of files rendered from a scene (cached tiles and
+// references). Structures are added field by field so padding and unused vector lanes never
+// reach the hash.
+struct contentHash {
+    uint64_t value = 0xCBF29CE484222325ull;
+    template <typename T> void add(const T& scalar)
+    {
+        static_assert(std::is_arithmetic<T>::value, "add structures field by field");
+        const unsigned char* bytes = (const unsigned char*)&scalar;
+        for (size_t i = 0; i < sizeof(T); ++i) {
+            value = (value ^ bytes[i]) * 0x100000001B3ull;
+        }
+    }
+    void add(const vec3& v)
+    {
+        add(v.x());
+        add(v.y());
+        add(v.z());
+    }
+    void add(const cameraParameters& p)
+    {
+        add(p.lookFrom);
+        add(p.lookAt);
+        add(p.up);
+        add(p.fov);
+        add(p.aspectRatio);
+        add(p.aperture);
+        add(p.focusDistance);
+    }
+    void add(const sphereDescription& s)
+    {
+        add(s.center);
+        add(s.radius);
+        add((unsigned int)s.mat.type);
+        add(s.mat.color);
+        add(s.mat.parameter);
+    }
+    // Every object in order.
+    void add(const sceneDescription& d)
+    {
+        add((uint64_t)d.spheres.size());
+        for (const sphereDescription& s : d.spheres) {
+            add(s);
+        }
+    }
+};
+
+#endif
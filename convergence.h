@@ -0,0 +1,157 @@
+#ifndef CONVERGENCE_H
+#define CONVERGENCE_H
+
+#include "camera.h"
+#include "hitable.h"
+#include "render.h"
+#include "trace.h"
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <string>
+#include <thread>
+#include <vector>
+
+// Quality per time: a configuration renders independent 1 sample per pixel passes that are
+// averaged progressively, and the error against a high sample count reference is recorded at a
+// series of wall-clock budgets. Comparing configurations at the same budget folds speed and
+// variance into one number.
+namespace convergence
+{
+struct errorMetrics {
+    double rmse;
+    double relMse; // squared error relative to reference luminance, robust to bright pixels
+};
+
+struct budgetResult {
+    double budgetMilliseconds;
+    double elapsedMilliseconds; // time of the last pass that finished within the budget
+    unsigned int samples;
+    errorMetrics error;
+};
+
+// Over the rgb channels of `channels`-float pixels.
+inline errorMetrics measure(const float* image, const float* reference, size_t pixelCount,
+                            unsigned int channels)
+{
+    double squared = 0., relative = 0.;
+    for (size_t p = 0; p < pixelCount; ++p) {
+        const float* x = image + p * channels;
+        const float* r = reference + p * channels;
+        const double luminance = 0.2126 * r[0] + 0.7152 * r[1] + 0.0722 * r[2];
+        for (unsigned int c = 0; c < 3; ++c) {
+            const double d = (double)x[c] - r[c];
+            squared += d * d;
+            relative += d * d / (luminance * luminance + 1e-2);
+        }
+    }
+    const double n = (double)pixelCount * 3;
+    return errorMetrics{std::sqrt(squared / n), relative / n};
+}
+
+// Part of the key of cached references: raise it whenever renderPass() or the integrator
+// changes what an image converges to, so references rendered by older code are not reused.
+constexpr uint32_t referenceVersion = 1;
+
+// One 1 sample per pixel pass of the recursive integrator (color()) into `out`, rows spread
+// over `threadCount` threads.
+inline void renderPass(const float minDistance, const float maxDistance,
+                       const unsigned int maxDepth, const unsigned int width,
+                       const unsigned int height, const unsigned int channels,
+                       const hitable* world, const camera& cam, float* out,
+                       unsigned int threadCount)
+{
+    trace::scope span("convergence pass");
+    std::vector<std::thread> workers;
+    std::atomic_uint heightIndex(0u);
+    for (unsigned int t = 0; t < threadCount; ++t) {
+        workers.push_back(std::thread([=, &cam, &heightIndex]() {
+            while (true) {
+                unsigned int j = heightIndex++;
+                if (j >= height) {
+                    break;
+                }
+                for (unsigned int i = 0; i < width; ++i) {
+                    float u = float(i + myRandom::next()) / float(width);
+                    float v = float(j + myRandom::next()) / float(height);
+                    vec3 col = color(cam.getRay(u, v), world, minDistance, maxDistance,
+                                     /* depth */ 0, maxDepth);
+                    float* p = out + ((size_t)j * width + i) * channels;
+                    p[0] = col.x();
+                    p[1] = col.y();
+                    p[2] = col.z();
+                    p[3] = 1.f;
+                }
+            }
+        }));
+    }
+    for (auto& w : workers) {
+        w.join();
+    }
+}
+
+// Runs `pass(float* out)` (one independent 1 spp image) until the largest budget is spent and
+// reports the error of the running mean at each budget (ascending, in milliseconds).
+template <typename Pass>
+std::vector<budgetResult> run(Pass pass, const float* reference, unsigned int width,
+                              unsigned int height, unsigned int channels,
+                              const std::vector<double>& budgets)
+{
+    const size_t pixelCount = (size_t)width * height;
+    std::vector<float> sum(pixelCount * channels, 0.f), passImage(pixelCount * channels),
+        mean(pixelCount * channels, 0.f);
+    std::vector<budgetResult> results;
+    budgetResult last{0., 0., 0u, measure(mean.data(), reference, pixelCount, channels)};
+    auto t1 = std::chrono::high_resolution_clock::now();
+    while (results.size() < budgets.size()) {
+        pass(passImage.data());
+        auto t2 = std::chrono::high_resolution_clock::now();
+        const double elapsed =
+            std::chrono::duration_cast<std::chrono::microseconds>(t2 - t1).count() / 1000.0;
+        // Budgets that ran out during this pass get the state from before it.
+        while (results.size() < budgets.size() && elapsed > budgets[results.size()]) {
+            last.budgetMilliseconds = budgets[results.size()];
+            results.push_back(last);
+        }
+        const unsigned int samples = last.samples + 1;
+        for (size_t k = 0; k < sum.size(); ++k) {
+            sum[k] += passImage[k];
+            mean[k] = sum[k] / samples;
+        }
+        last = budgetResult{0., elapsed, samples,
+                            measure(mean.data(), reference, pixelCount, channels)};
+        // Measuring is not part of the configuration's time.
+        t1 += std::chrono::high_resolution_clock::now() - t2;
+    }
+    return results;
+}
+
+// Appends rows of `name,budget_ms,elapsed_ms,spp,rmse,relmse`; the header is written when the
+// file is new.
+inline bool appendCsv(const char* path, const std::string& name,
+                      const std::vector<budgetResult>& results)
+{
+    std::FILE* existing = std::fopen(path, "rb");
+    const bool isNew = existing == nullptr;
+    if (existing != nullptr) {
+        std::fclose(existing);
+    }
+    std::FILE* file = std::fopen(path, "ab");
+    if (file == nullptr) {
+        return false;
+    }
+    if (isNew) {
+        std::fprintf(file, "config,budget_ms,elapsed_ms,spp,rmse,relmse\n");
+    }
+    for (const budgetResult& r : results) {
+        std::fprintf(file, "%s,%.1f,%.3f,%u,%.6g,%.6g\n", name.c_str(), r.budgetMilliseconds,
+                     r.elapsedMilliseconds, r.samples, r.error.rmse, r.error.relMse);
+    }
+    return std::fclose(file) == 0;
+}
+} // namespace convergence
+
+#endif
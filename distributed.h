@@ -0,0 +1,354 @@
+#ifndef DISTRIBUTED_H
+#define DISTRIBUTED_H
+
+#include "camera.h"
+#include "net.h"
+#include "render.h"
+#include "scene.h"
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdio>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <type_traits>
+#include <vector>
+
+// Distributed tile rendering. Workers listen on a TCP port; the coordinator connects to each of
+// them, sends the render settings, camera and scene description once, then hands out tiles one
+// at a time. A tile whose worker fails (connection lost or receive timeout) goes back into the
+// queue for the remaining workers.
+namespace distributed
+{
+enum messageType : uint32_t { job = 1, tile = 2, tileResult = 3, done = 4 };
+
+struct renderSettings {
+    float minDistance;
+    float maxDistance;
+    unsigned int maxDepth;
+    unsigned int sampling;
+    unsigned int width;
+    unsigned int height;
+};
+
+struct tileRect {
+    unsigned int startWidth;
+    unsigned int endWidth;
+    unsigned int startHeight;
+    unsigned int endHeight;
+    inline unsigned int pixels() const
+    {
+        return (endWidth - startWidth) * (endHeight - startHeight);
+    }
+};
+
+struct workerStats {
+    std::string endpoint;
+    bool isAlive;
+    unsigned int tiles;
+    unsigned long long pixels;
+    double setupSeconds;     // connect + job upload + remote scene build
+    double renderSeconds;    // as measured by the worker
+    double roundTripSeconds; // tile sent until result received
+    size_t bytesSent;
+    size_t bytesReceived;
+};
+
+// Settings, camera and spheres go over the wire as raw bytes, so the coordinator and its workers
+// must be built with the same vec3 backend (see vec3.h).
+static_assert(std::is_trivially_copyable<cameraParameters>::value &&
+                  std::is_trivially_copyable<sphereDescription>::value,
+              "job data is sent as raw bytes");
+
+inline std::vector<unsigned char> serializeJob(const renderSettings& settings,
+                                               const cameraParameters& cam,
+                                               const sceneDescription& scene)
+{
+    net::byteWriter w;
+    w.put(settings);
+    w.put(cam);
+    w.put((uint32_t)scene.spheres.size());
+    w.putBytes(scene.spheres.data(), scene.spheres.size() * sizeof(sphereDescription));
+    return w.bytes;
+}
+
+// Limits a worker accepts in a job, so a bad message can not make it allocate or recurse without
+// bounds.
+constexpr unsigned int maxImageSide = 1u << 15;
+constexpr unsigned int maxJobDepth = 1024u;
+
+// False when the bytes are not a job, the scene is empty or the settings are out of the limits
+// above.
+inline bool deserializeJob(const std::vector<unsigned char>& bytes, renderSettings& settings,
+                           cameraParameters& cam, sceneDescription& scene)
+{
+    net::byteReader r(bytes);
+    settings = r.get<renderSettings>();
+    cam = r.get<cameraParameters>();
+    const uint32_t count = r.get<uint32_t>();
+    if (!r.ok || count == 0 || count > r.remaining() / sizeof(sphereDescription)) {
+        return false;
+    }
+    scene.spheres.resize(count);
+    r.getBytes(scene.spheres.data(), scene.spheres.size() * sizeof(sphereDescription));
+    return r.ok && r.remaining() == 0 && settings.width > 0 && settings.width <= maxImageSide &&
+           settings.height > 0 && settings.height <= maxImageSide && settings.sampling > 0 &&
+           settings.maxDepth <= maxJobDepth;
+}
+
+// True when `t` is a non-empty rectangle inside the image of `settings`.
+inline bool isInside(const tileRect& t, const renderSettings& settings)
+{
+    return t.startWidth < t.endWidth && t.endWidth <= settings.width &&
+           t.startHeight < t.endHeight && t.endHeight <= settings.height;
+}
+
+// Renders `t` with `threadCount` threads and packs it as rgb floats.
+inline std::vector<float> renderTile(const renderSettings& settings, const tileRect& t,
+                                     const hitable* world, const camera& cam,
+                                     unsigned int threadCount)
+{
+    const unsigned int channels = 4;
+    const unsigned int rows = t.endHeight - t.startHeight;
+    std::vector<float> buffer((size_t)rows * settings.width * channels);
+    std::atomic_uint rowIndex(t.startHeight);
+    auto work = [&]() {
+        while (true) {
+            unsigned int j = rowIndex++;
+            if (j >= t.endHeight) {
+                break;
+            }
+            const raycastWorldParameters parameters{.minDistance = settings.minDistance,
+                                                    .maxDistance = settings.maxDistance,
+                                                    .maxDepth = settings.maxDepth,
+                                                    .sampling = settings.sampling,
+                                                    .width = settings.width,
+                                                    .height = settings.height,
+                                                    .startWidth = t.startWidth,
+                                                    .endWidth = t.endWidth,
+                                                    .startHeight = j,
+                                                    .endHeight = j + 1,
+                                                    .channels = channels,
+                                                    .outStartHeight = t.startHeight};
+            raycastWorld(parameters, world, cam, buffer.data());
+        }
+    };
+    trace::scope span("tile", t.startHeight * settings.width + t.startWidth);
+    std::vector<std::thread> workers;
+    for (unsigned int i = 1; i < threadCount; ++i) {
+        workers.push_back(std::thread(work));
+    }
+    work();
+    for (auto& w : workers) {
+        w.join();
+    }
+
+    std::vector<float> rgb;
+    rgb.reserve(t.pixels() * 3);
+    for (unsigned int j = 0; j < rows; ++j) {
+        for (unsigned int i = t.startWidth; i < t.endWidth; ++i) {
+            const float* p = buffer.data() + ((size_t)j * settings.width + i) * channels;
+            rgb.insert(rgb.end(), p, p + 3);
+        }
+    }
+    return rgb;
+}
+
+// Serves coordinators one at a time, forever.
+inline int runWorker(unsigned short port, unsigned int threadCount)
+{
+    net::startup();
+    socketHandle listener = net::listenOn(port);
+    if (listener == invalidSocket) {
+        std::printf("worker: cannot listen on port %u\n", port);
+        return 1;
+    }
+    std::printf("worker: listening on port %u with %u threads\n", port, threadCount);
+    while (true) {
+        socketHandle s = net::acceptFrom(listener);
+        if (s == invalidSocket) {
+            continue;
+        }
+        net::setOptions(s, 0);
+        renderSettings settings;
+        cameraParameters camParams;
+        sceneDescription scene;
+        hitable* world = nullptr;
+        camera* cam = nullptr;
+        uint32_t type;
+        std::vector<unsigned char> payload;
+        while (net::receiveMessage(s, type, payload)) {
+            if (type == messageType::job) {
+                if (!deserializeJob(payload, settings, camParams, scene)) {
+                    break;
+                }
+                delete world;
+                delete cam;
+                world = scene::buildBvh(scene, /* arena */ nullptr, /* isRoot */ false);
+                cam = new camera(camParams);
+                std::printf("worker: job %ux%u, %zu spheres\n", settings.width, settings.height,
+                            scene.spheres.size());
+                if (!net::sendMessage(s, messageType::job, {})) {
+                    break;
+                }
+            } else if (type == messageType::tile && world != nullptr) {
+                net::byteReader r(payload);
+                tileRect t = r.get<tileRect>();
+                if (!r.ok || r.remaining() != 0 || !isInside(t, settings)) {
+                    std::printf("worker: invalid tile\n");
+                    break;
+                }
+                auto t1 = std::chrono::high_resolution_clock::now();
+                std::vector<float> rgb = renderTile(settings, t, world, *cam, threadCount);
+                auto t2 = std::chrono::high_resolution_clock::now();
+                net::byteWriter w;
+                w.put(t);
+                w.put(std::chrono::duration<double>(t2 - t1).count());
+                w.putBytes(rgb.data(), rgb.size() * sizeof(float));
+                if (!net::sendMessage(s, messageType::tileResult, w.bytes)) {
+                    break;
+                }
+            } else {
+                break;
+            }
+        }
+        delete world;
+        delete cam;
+        net::closeSocket(s);
+    }
+    return 0;
+}
+
+// Renders the whole image into `data` (rgba floats) on the given workers. Returns false when
+// every worker was lost before all tiles were done.
+inline bool raycast(const std::vector<std::string>& endpoints, const renderSettings& settings,
+                    const cameraParameters& camParams, const sceneDescription& scene,
+                    unsigned int tileSize, unsigned int receiveTimeoutSeconds, float* data,
+                    unsigned int channels, std::vector<workerStats>& stats)
+{
+    net::startup();
+    std::deque<tileRect> queue;
+    for (unsigned int j = 0; j < settings.height; j += tileSize) {
+        for (unsigned int i = 0; i < settings.width; i += tileSize) {
+            queue.push_back(tileRect{i, std::min(settings.width, i + tileSize), j,
+                                     std::min(settings.height, j + tileSize)});
+        }
+    }
+    const size_t tileCount = queue.size();
+    size_t completed = 0;
+    std::mutex mutex;
+    std::condition_variable changed;
+    const std::vector<unsigned char> jobPayload = serializeJob(settings, camParams, scene);
+
+    stats.assign(endpoints.size(), workerStats{"", true, 0, 0, 0., 0., 0., 0, 0});
+    auto serve = [&](size_t index) {
+        workerStats& st = stats[index];
+        st.endpoint = endpoints[index];
+        auto t1 = std::chrono::high_resolution_clock::now();
+        socketHandle s = net::connectTo(endpoints[index]);
+        uint32_t type;
+        std::vector<unsigned char> payload;
+        bool ok = s != invalidSocket;
+        if (ok) {
+            net::setOptions(s, receiveTimeoutSeconds);
+            ok = net::sendMessage(s, messageType::job, jobPayload) &&
+                 net::receiveMessage(s, type, payload) && type == messageType::job;
+            st.bytesSent += 8 + jobPayload.size();
+            st.bytesReceived += 8;
+        }
+        auto t2 = std::chrono::high_resolution_clock::now();
+        st.setupSeconds = std::chrono::duration<double>(t2 - t1).count();
+
+        while (ok) {
+            tileRect t;
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                changed.wait(lock, [&]() { return !queue.empty() || completed == tileCount; });
+                if (completed == tileCount) {
+                    net::sendMessage(s, messageType::done, {});
+                    break;
+                }
+                t = queue.front();
+                queue.pop_front();
+            }
+            net::byteWriter w;
+            w.put(t);
+            auto t3 = std::chrono::high_resolution_clock::now();
+            const size_t resultBytes =
+                sizeof(tileRect) + sizeof(double) + (size_t)t.pixels() * 3 * sizeof(float);
+            ok = net::sendMessage(s, messageType::tile, w.bytes) &&
+                 net::receiveMessage(s, type, payload, (uint32_t)resultBytes) &&
+                 type == messageType::tileResult && payload.size() == resultBytes;
+            auto t4 = std::chrono::high_resolution_clock::now();
+            if (!ok) {
+                std::lock_guard<std::mutex> lock(mutex);
+                queue.push_front(t);
+                changed.notify_all();
+                break;
+            }
+            net::byteReader r(payload);
+            r.get<tileRect>();
+            st.renderSeconds += r.get<double>();
+            st.roundTripSeconds += std::chrono::duration<double>(t4 - t3).count();
+            st.bytesSent += 8 + w.bytes.size();
+            st.bytesReceived += 8 + payload.size();
+            st.tiles++;
+            st.pixels += t.pixels();
+            const float* rgb = (const float*)(payload.data() + r.offset);
+            for (unsigned int j = t.startHeight; j < t.endHeight; ++j) {
+                for (unsigned int i = t.startWidth; i < t.endWidth; ++i) {
+                    float* p = data + (j * settings.width + i) * channels;
+                    p[0] = *rgb++;
+                    p[1] = *rgb++;
+                    p[2] = *rgb++;
+                    p[3] = 1.f;
+                }
+            }
+            std::lock_guard<std::mutex> lock(mutex);
+            if (++completed == tileCount) {
+                changed.notify_all();
+            }
+        }
+        if (!ok) {
+            std::lock_guard<std::mutex> lock(mutex);
+            st.isAlive = false;
+            std::printf("coordinator: lost worker %s\n", st.endpoint.c_str());
+            changed.notify_all();
+        }
+        net::closeSocket(s);
+    };
+
+    std::vector<std::thread> threads;
+    for (size_t i = 0; i < endpoints.size(); ++i) {
+        threads.push_back(std::thread(serve, i));
+    }
+    for (auto& t : threads) {
+        t.join();
+    }
+    return completed == tileCount;
+}
+
+inline void printStats(const std::vector<workerStats>& stats, unsigned int sampling)
+{
+    std::printf("---------------------\n"
+                "Distributed render per worker:\n");
+    for (const workerStats& st : stats) {
+        const double network = st.roundTripSeconds - st.renderSeconds;
+        std::printf(" %s%s\n"
+                    "  tiles: %u, pixels: %llu\n"
+                    "  setup: %.3f s, render: %.3f s, round trip: %.3f s\n"
+                    "  throughput: %.1f kpixels/s, %.1f ksamples/s\n"
+                    "  network: %zu bytes sent, %zu bytes received, overhead %.3f s (%.1f%%)\n",
+                    st.endpoint.c_str(), st.isAlive ? "" : " (lost)", st.tiles, st.pixels,
+                    st.setupSeconds, st.renderSeconds, st.roundTripSeconds,
+                    st.renderSeconds > 0 ? st.pixels / st.renderSeconds / 1000. : 0.,
+                    st.renderSeconds > 0 ? st.pixels * sampling / st.renderSeconds / 1000. : 0.,
+                    st.bytesSent, st.bytesReceived, network,
+                    st.roundTripSeconds > 0 ? 100. * network / st.roundTripSeconds : 0.);
+    }
+}
+} // namespace distributed
+
+#endif
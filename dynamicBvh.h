@@ -0,0 +1,168 @@
+#ifndef DYNAMICBVH_H
+#define DYNAMICBVH_H
+
+#include "arena.h"
+#include "hitable.h"
+#include "lbvh.h"
+#include <chrono>
+#include <memory>
+#include <vector>
+
+// BVH over primitives that move between frames. update() refits the bounds in place and then
+// checks the SAH cost: subtrees at `subtreeDepth` whose cost grew past `partialThreshold` times
+// their cost at build time are rebuilt on their own, and the whole tree is rebuilt when the root
+// cost grows past `fullThreshold` or more than half of the subtrees degraded.
+class dynamicBvh
+{
+  public:
+    struct updateStats {
+        double refitMilliseconds;
+        double rebuildMilliseconds;
+        float costRatio; // root SAH cost relative to the last full build, after the update
+        unsigned int rebuiltSubtrees;
+        bool isFullRebuild;
+    };
+
+    dynamicBvh(hitable** list, unsigned int count, unsigned int threadCount,
+               float partialThreshold = 1.25f, float fullThreshold = 1.6f,
+               unsigned int subtreeDepth = 3)
+        : list(list), count(count), threadCount(threadCount), partialThreshold(partialThreshold),
+          fullThreshold(fullThreshold), subtreeDepth(subtreeDepth), root(nullptr), baseCost(0)
+    {
+        rebuild();
+    }
+
+    inline hitable* world() const { return root; }
+
+    // SAH cost normalized to the root area, comparable across frames.
+    inline float cost() const
+    {
+        const bvhNode* node = dynamic_cast<const bvhNode*>(root);
+        return node != nullptr ? node->sahCost(node->box.surfaceArea()) : 0.f;
+    }
+
+    void rebuild()
+    {
+        nodes.reset(new sceneArena(std::max<size_t>(1u << 20, count * sizeof(bvhNode))));
+        root = lbvh::build(list, count, *nodes, threadCount);
+        baseCost = cost();
+        subtrees.clear();
+        collectSubtrees(dynamic_cast<bvhNode*>(root), 0);
+    }
+
+    updateStats update()
+    {
+        updateStats stats{0., 0., 0.f, 0u, false};
+        auto t1 = std::chrono::high_resolution_clock::now();
+        // Threads are started per refit, so each one needs enough primitives to pay for its
+        // start (about 25 ns of refit per primitive against 10-20 us per thread); small scenes
+        // refit serially.
+        unsigned int parallelDepth = 0;
+        while ((1u << parallelDepth) < threadCount &&
+               (count >> (parallelDepth + 1)) >= parallelRefitPrimitives) {
+            ++parallelDepth;
+        }
+        root->refit(parallelDepth);
+        auto t2 = std::chrono::high_resolution_clock::now();
+        stats.refitMilliseconds = milliseconds(t1, t2);
+
+        std::vector<subtree*> degraded;
+        for (subtree& s : subtrees) {
+            if (subtreeCost((bvhNode*)*s.slot) > partialThreshold * s.baseCost) {
+                degraded.push_back(&s);
+            }
+        }
+        // One large primitive (the ground sphere) can dominate the root cost, so a majority of
+        // degraded subtrees also counts as a degraded tree.
+        if (cost() > fullThreshold * baseCost || degraded.size() * 2 > subtrees.size()) {
+            rebuild();
+            stats.isFullRebuild = true;
+        } else {
+            for (subtree* d : degraded) {
+                subtree& s = *d;
+                bvhNode* node = (bvhNode*)*s.slot;
+                std::vector<hitable*> primitives;
+                collectPrimitives(node, primitives);
+                *s.slot = lbvh::build(primitives.data(), (unsigned int)primitives.size(),
+                                      *nodes, threadCount);
+                s.baseCost = subtreeCost((bvhNode*)*s.slot);
+                stats.rebuiltSubtrees++;
+            }
+            if (stats.rebuiltSubtrees > 0) {
+                root->refit(parallelDepth);
+            }
+        }
+        auto t3 = std::chrono::high_resolution_clock::now();
+        stats.rebuildMilliseconds = milliseconds(t2, t3);
+        stats.costRatio = baseCost > 0 ? cost() / baseCost : 1.f;
+        return stats;
+    }
+
+    // Primitives each refit thread gets at least.
+    static constexpr unsigned int parallelRefitPrimitives = 1u << 14;
+
+    // Bytes held by BVH nodes, including subtrees replaced by partial rebuilds.
+    inline size_t nodeBytes() const { return nodes->bytesUsed; }
+
+  private:
+    struct subtree {
+        hitable** slot; // child pointer in the parent that holds the subtree root
+        float baseCost;
+    };
+
+    static double milliseconds(std::chrono::high_resolution_clock::time_point a,
+                               std::chrono::high_resolution_clock::time_point b)
+    {
+        return std::chrono::duration_cast<std::chrono::microseconds>(b - a).count() / 1000.0;
+    }
+
+    static float subtreeCost(const bvhNode* node)
+    {
+        return node->sahCost(node->box.surfaceArea());
+    }
+
+    void collectSubtrees(bvhNode* node, unsigned int depth)
+    {
+        if (node == nullptr) {
+            return;
+        }
+        hitable** slots[2] = {&node->left, &node->right};
+        for (hitable** slot : slots) {
+            bvhNode* child = dynamic_cast<bvhNode*>(*slot);
+            if (child == nullptr) {
+                continue;
+            }
+            if (depth + 1 == subtreeDepth) {
+                subtrees.push_back(subtree{slot, subtreeCost(child)});
+            } else {
+                collectSubtrees(child, depth + 1);
+            }
+        }
+    }
+
+    static void collectPrimitives(hitable* h, std::vector<hitable*>& out)
+    {
+        if (h == nullptr) {
+            return;
+        }
+        if (bvhNode* node = dynamic_cast<bvhNode*>(h)) {
+            collectPrimitives(node->left, out);
+            collectPrimitives(node->right, out);
+        } else {
+            out.push_back(h);
+        }
+    }
+
+    hitable** list;
+    const unsigned int count;
+    const unsigned int threadCount;
+    const float partialThreshold;
+    const float fullThreshold;
+    const unsigned int subtreeDepth;
+    std::unique_ptr<sceneArena> nodes;
+    hitable* root;
+    float baseCost;
+    std::vector<subtree> subtrees;
+};
+
+#endif
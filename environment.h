@@ -0,0 +1,181 @@
+#ifndef ENVIRONMENT_H
+#define ENVIRONMENT_H
+
+#include "external\stb_image.h"
+#include "hitable.h"
+#include "myRandom.h"
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <vector>
+
+enum class environmentSampling { uniform, importance };
+
+// HDR lat-long environment map lighting the scene from infinitely far away. Rays that escape
+// read it, and diffuse hits sample it explicitly (directLight). Importance sampling picks pixels
+// in proportion to their luminance times the solid angle they cover through an alias table
+// (Walker, Vose) built at load time, so a small bright sun is found in O(1) per sample instead of
+// once in thousands of uniform directions.
+//
+// u goes around the y axis and v from the top (+y) down, the same mapping as sphere uvs.
+class environmentMap
+{
+  public:
+    // `pixels` are `width * height` linear rgb floats, row 0 at the top.
+    environmentMap(const float* pixels, unsigned int width, unsigned int height,
+                   environmentSampling sampling = environmentSampling::importance)
+        : width(width), height(height), sampling(sampling),
+          pixels(pixels, pixels + (size_t)width * height * 3)
+    {
+        buildAliasTable();
+        contentKey = hashContent();
+    }
+
+    // Loads any image stb_image reads as floats (.hdr as is, 8-bit formats linearized).
+    // Returns nullptr when it can not be read.
+    static environmentMap* load(const char* path,
+                                environmentSampling sampling = environmentSampling::importance)
+    {
+        int w, h, n;
+        float* data = stbi_loadf(path, &w, &h, &n, 3);
+        if (data == nullptr) {
+            return nullptr;
+        }
+        environmentMap* map = new environmentMap(data, w, h, sampling);
+        stbi_image_free(data);
+        return map;
+    }
+
+    // Radiance arriving from direction `d` (any length), nearest pixel.
+    vec3 radiance(const vec3& d) const
+    {
+        const vec3 n = d.normalized();
+        const float u = (atan2f(-n.z(), n.x()) + mathx::pi) / (2 * mathx::pi);
+        const float v = acosf(std::min(1.f, std::max(-1.f, n.y()))) / mathx::pi;
+        const unsigned int x = std::min(width - 1, (unsigned int)(u * width));
+        const unsigned int y = std::min(height - 1, (unsigned int)(v * height));
+        const float* p = pixels.data() + ((size_t)y * width + x) * 3;
+        return vec3(p[0], p[1], p[2]);
+    }
+
+    // Picks a direction towards the environment with `sampling`; returns its solid angle pdf.
+    float sample(vec3& direction) const
+    {
+        if (sampling == environmentSampling::uniform) {
+            const float y = myRandom::nextCostheta();
+            const float phi = myRandom::nextPhi();
+            const float r = sqrtf(std::max(0.f, 1 - y * y));
+            direction = vec3(r * cosf(phi), y, r * sinf(phi));
+            return 1.f / (4 * mathx::pi);
+        }
+        const size_t count = probability.size();
+        size_t i = std::min(count - 1, (size_t)(myRandom::next() * count));
+        if (myRandom::next() >= probability[i]) {
+            i = alias[i];
+        }
+        const float u = ((i % width) + myRandom::next()) / width;
+        const float v = ((i / width) + myRandom::next()) / height;
+        const float theta = v * mathx::pi, phi = u * 2 * mathx::pi - mathx::pi;
+        const float sinTheta = sinf(theta);
+        direction = vec3(sinTheta * cosf(phi), cosf(theta), -sinTheta * sinf(phi));
+        // Pixel probability over its uv area, then over the solid angle of that area.
+        const float uvPdf = pixelProbability[i] * count;
+        return sinTheta > 0 ? uvPdf / (2 * mathx::pi * mathx::pi * sinTheta) : 0.f;
+    }
+
+    // Light reaching a Lambertian surface of `albedo` at `rec` from one environment sample,
+    // shadowed through occluded().
+    vec3 directLight(const hitRecord& rec, const vec3& albedo, const hitable* world,
+                     const float minDistance, const float maxDistance) const
+    {
+        vec3 direction;
+        const float pdf = sample(direction);
+        const float cosine = vec3::dot(direction, rec.normal);
+        if (pdf <= 0 || cosine <= 0) {
+            return vec3(0, 0, 0);
+        }
+        ++tracedShadowRays;
+        if (world->occluded(ray(rec.point, direction), minDistance, maxDistance)) {
+            return vec3(0, 0, 0);
+        }
+        return albedo * radiance(direction) * (cosine / (mathx::pi * pdf));
+    }
+
+    const unsigned int width;
+    const unsigned int height;
+    environmentSampling sampling;
+    // Hash of the size and pixels, computed once: identifies the map in cache keys
+    // (tileRenderCache.h) without rehashing it every frame. Sampling only changes the noise.
+    uint64_t contentKey;
+
+    // Lights the scene when set: escaped rays read it and diffuse hits sample it.
+    static inline const environmentMap* active = nullptr;
+    // Shadow rays cast by directLight on the calling thread.
+    static inline thread_local unsigned long long tracedShadowRays = 0;
+
+  private:
+    // FNV-1a, as contentHash.h.
+    uint64_t hashContent() const
+    {
+        uint64_t value = 0xCBF29CE484222325ull;
+        auto add = [&value](const void* data, size_t size) {
+            const unsigned char* bytes = (const unsigned char*)data;
+            for (size_t i = 0; i < size; ++i) {
+                value = (value ^ bytes[i]) * 0x100000001B3ull;
+            }
+        };
+        const uint32_t header[2] = {width, height};
+        add(header, sizeof(header));
+        add(pixels.data(), pixels.size() * sizeof(float));
+        return value;
+    }
+    void buildAliasTable()
+    {
+        const size_t count = (size_t)width * height;
+        pixelProbability.resize(count);
+        double total = 0.;
+        for (unsigned int y = 0; y < height; ++y) {
+            const float sinTheta = sinf((y + 0.5f) * mathx::pi / height);
+            for (unsigned int x = 0; x < width; ++x) {
+                const float* p = pixels.data() + ((size_t)y * width + x) * 3;
+                // A small floor keeps every direction reachable, so the estimate stays unbiased
+                // for pixels that are dark but not black in some channel.
+                const float luminance = 0.2126f * p[0] + 0.7152f * p[1] + 0.0722f * p[2];
+                pixelProbability[(size_t)y * width + x] = (luminance + 1e-4f) * sinTheta;
+                total += pixelProbability[(size_t)y * width + x];
+            }
+        }
+        probability.resize(count);
+        alias.resize(count);
+        std::vector<uint32_t> small, large;
+        for (size_t i = 0; i < count; ++i) {
+            pixelProbability[i] = (float)(pixelProbability[i] / total);
+            probability[i] = pixelProbability[i] * count;
+            (probability[i] < 1.f ? small : large).push_back((uint32_t)i);
+        }
+        while (!small.empty() && !large.empty()) {
+            const uint32_t s = small.back(), l = large.back();
+            small.pop_back();
+            alias[s] = l;
+            probability[l] -= 1.f - probability[s];
+            if (probability[l] < 1.f) {
+                large.pop_back();
+                small.push_back(l);
+            }
+        }
+        // Leftovers are 1 up to rounding.
+        for (uint32_t i : small) {
+            probability[i] = 1.f;
+        }
+        for (uint32_t i : large) {
+            probability[i] = 1.f;
+        }
+    }
+
+    std::vector<float> pixels;
+    std::vector<float> pixelProbability;
+    std::vector<float> probability; // of keeping bin i rather than taking alias[i]
+    std::vector<uint32_t> alias;
+};
+
+#endif
@@ -720,7 +720,7 @@ static int stbi_write_hdr_core(stbi__write_context *s, int x, int y, int comp, f
         for (i = 0; i < y; i++)
             stbiw__write_hdr_scanline(
                 s, x, comp, scratch,
-                data + comp * x * (stbi__flip_vertically_on_write ? y - 1 - i : i) * x);
+                data + comp * x * (stbi__flip_vertically_on_write ? y - 1 - i : i));
         STBIW_FREE(scratch);
         return 1;
     }
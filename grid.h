@@ -0,0 +1,295 @@
+#ifndef GRID_H
+#define GRID_H
+
+#include "aabb.h"
+#include "arena.h"
+#include "hitable.h"
+#include <algorithm>
+#include <cfloat>
+#include <cmath>
+#include <cstdint>
+#include <vector>
+
+// Uniform grid over the primitives, traversed cell by cell with a 3D-DDA (Amanatides & Woo,
+// "A Fast Voxel Traversal Algorithm for Ray Tracing"). Cheap to build and well suited to many
+// similar sized primitives spread evenly. Primitives much larger than the typical one (such as
+// the ground sphere) would land in most cells, so they are kept in a separate list that every ray
+// tests first. Cells store indices into the primitive array, compressed row style: the
+// primitives of cell c are cellPrimitives[cellStart[c] .. cellStart[c + 1]).
+class uniformGrid : public hitable
+{
+  public:
+    // `density` is the target number of cells per primitive; a primitive is big when the largest
+    // side of its box exceeds `bigObjectFactor` times the median one. Arrays come from `arena`
+    // when one is given, otherwise from the heap; a heap-built grid owns `list` and the
+    // primitives in it, like bvhNode and hitableList.
+    uniformGrid(hitable** list, unsigned int count, sceneArena* arena = nullptr,
+                float density = 2.f, float bigObjectFactor = 16.f)
+        : primitiveCount(0), bigObjectCount(0), cellPrimitiveCount(0), primitives(nullptr),
+          bigObjects(nullptr), cellStart(nullptr), cellPrimitives(nullptr), list(list),
+          count(count), isArena(arena != nullptr)
+    {
+        std::vector<aabb> boxes(count);
+        std::vector<float> sizes(count);
+        for (unsigned int i = 0; i < count; ++i) {
+            boxes[i] = list[i]->boundingBox();
+            vec3 e = boxes[i].extent();
+            sizes[i] = std::max(e.x(), std::max(e.y(), e.z()));
+        }
+        std::vector<float> sorted(sizes);
+        std::nth_element(sorted.begin(), sorted.begin() + count / 2, sorted.end());
+        const float bigSize = count > 0 ? sorted[count / 2] * bigObjectFactor : 0.f;
+
+        std::vector<unsigned int> small, big;
+        for (unsigned int i = 0; i < count; ++i) {
+            (sizes[i] > bigSize ? big : small).push_back(i);
+        }
+        primitiveCount = (unsigned int)small.size();
+        bigObjectCount = (unsigned int)big.size();
+        primitives = allocate<hitable*>(arena, primitiveCount);
+        bigObjects = allocate<hitable*>(arena, bigObjectCount);
+        for (unsigned int i = 0; i < primitiveCount; ++i) {
+            primitives[i] = list[small[i]];
+        }
+        for (unsigned int i = 0; i < bigObjectCount; ++i) {
+            bigObjects[i] = list[big[i]];
+        }
+
+        bounds = aabb(vec3(FLT_MAX, FLT_MAX, FLT_MAX), vec3(-FLT_MAX, -FLT_MAX, -FLT_MAX));
+        for (unsigned int i : small) {
+            bounds.expandToInclude(boxes[i]);
+        }
+        if (primitiveCount == 0) {
+            bounds = aabb(vec3(0, 0, 0), vec3(0, 0, 0));
+        }
+        // Cleary & Wyvill: cells per axis proportional to the extent, about `density` cells per
+        // primitive overall. Flat scenes get a single cell along the thin axis.
+        vec3 extent = bounds.extent();
+        const float volume = std::max(extent.x(), 1e-4f) * std::max(extent.y(), 1e-4f) *
+                             std::max(extent.z(), 1e-4f);
+        const float cellsPerUnit = cbrtf(density * std::max(1u, primitiveCount) / volume);
+        for (int a = 0; a < 3; ++a) {
+            resolution[a] = (int)std::min(512.f, std::max(1.f, floorf(extent[a] * cellsPerUnit)));
+            cellSize[a] = extent[a] > 0 ? extent[a] / resolution[a] : 1.f;
+            inverseCellSize[a] = 1.f / cellSize[a];
+        }
+        const size_t cellCount = (size_t)resolution[0] * resolution[1] * resolution[2];
+
+        // Two passes: count the cells overlapped by each primitive, then fill.
+        cellStart = allocate<uint32_t>(arena, cellCount + 1);
+        std::fill(cellStart, cellStart + cellCount + 1, 0u);
+        for (int pass = 0; pass < 2; ++pass) {
+            for (unsigned int p = 0; p < primitiveCount; ++p) {
+                const aabb& b = boxes[small[p]];
+                int lo[3], hi[3];
+                for (int a = 0; a < 3; ++a) {
+                    lo[a] = cellCoordinate(b.min()[a], a);
+                    hi[a] = cellCoordinate(b.max()[a], a);
+                }
+                for (int z = lo[2]; z <= hi[2]; ++z) {
+                    for (int y = lo[1]; y <= hi[1]; ++y) {
+                        for (int x = lo[0]; x <= hi[0]; ++x) {
+                            const size_t c = cellIndex(x, y, z);
+                            if (pass == 0) {
+                                cellStart[c + 1]++;
+                            } else {
+                                cellPrimitives[cellStart[c]++] = p;
+                            }
+                        }
+                    }
+                }
+            }
+            if (pass == 0) {
+                for (size_t c = 0; c < cellCount; ++c) {
+                    cellStart[c + 1] += cellStart[c];
+                }
+                cellPrimitiveCount = cellStart[cellCount];
+                cellPrimitives = allocate<uint32_t>(arena, cellPrimitiveCount);
+            }
+        }
+        // The fill pass advanced every start to the start of the next cell.
+        for (size_t c = cellCount; c > 0; --c) {
+            cellStart[c] = cellStart[c - 1];
+        }
+        cellStart[0] = 0;
+    }
+    ~uniformGrid()
+    {
+        if (!isArena) {
+            for (unsigned int i = 0; i < count; ++i) {
+                delete list[i];
+            }
+            delete[] list;
+            delete[] primitives;
+            delete[] bigObjects;
+            delete[] cellStart;
+            delete[] cellPrimitives;
+        }
+    }
+    uniformGrid(const uniformGrid&) = delete;
+    uniformGrid& operator=(const uniformGrid&) = delete;
+
+    virtual bool intersect(const ray& r, float tMin, float tMax, hitCandidate& candidate) const
+    {
+        bool isHit = false;
+        for (unsigned int i = 0; i < bigObjectCount; ++i) {
+            if (bigObjects[i]->intersect(r, tMin, tMax, candidate)) {
+                tMax = candidate.distance;
+                isHit = true;
+            }
+        }
+        // A primitive spanning several cells is only accepted in a cell that contains the hit,
+        // so the first cell with a hit has the closest one.
+        traverse(r, tMin, tMax, [&](const uint32_t* begin, const uint32_t* end, float cellExit) {
+            bool cellHit = false;
+            for (const uint32_t* p = begin; p < end; ++p) {
+                if (primitives[*p]->intersect(r, tMin, tMax, candidate)) {
+                    tMax = candidate.distance;
+                    isHit = true;
+                    cellHit = candidate.distance <= cellExit || cellHit;
+                }
+            }
+            return cellHit;
+        });
+        return isHit;
+    }
+    virtual bool occluded(const ray& r, float tMin, float tMax) const
+    {
+        for (unsigned int i = 0; i < bigObjectCount; ++i) {
+            if (bigObjects[i]->occluded(r, tMin, tMax)) {
+                return true;
+            }
+        }
+        bool isOccluded = false;
+        traverse(r, tMin, tMax, [&](const uint32_t* begin, const uint32_t* end, float) {
+            for (const uint32_t* p = begin; p < end; ++p) {
+                if (primitives[*p]->occluded(r, tMin, tMax)) {
+                    isOccluded = true;
+                    return true;
+                }
+            }
+            return false;
+        });
+        return isOccluded;
+    }
+    virtual aabb boundingBox() const
+    {
+        aabb box = bounds;
+        for (unsigned int i = 0; i < bigObjectCount; ++i) {
+            box.expandToInclude(bigObjects[i]->boundingBox());
+        }
+        return box;
+    }
+    virtual vec3 centeroid() const { return (bounds.min() + bounds.max()) / 2.f; }
+
+    inline size_t cellCount() const
+    {
+        return (size_t)resolution[0] * resolution[1] * resolution[2];
+    }
+    // Bytes held by the grid itself, primitives excluded.
+    inline size_t memoryBytes() const
+    {
+        return sizeof(*this) + (primitiveCount + bigObjectCount) * sizeof(hitable*) +
+               (cellCount() + 1 + cellPrimitiveCount) * sizeof(uint32_t);
+    }
+
+    int resolution[3];
+    unsigned int primitiveCount;
+    unsigned int bigObjectCount;
+    size_t cellPrimitiveCount; // cell references; above primitiveCount when primitives straddle
+
+  private:
+    template <typename T> static T* allocate(sceneArena* arena, size_t count)
+    {
+        return arena != nullptr ? arena->createArray<T>(count) : new T[count];
+    }
+    inline int cellCoordinate(float p, int axis) const
+    {
+        int c = (int)((p - bounds.min()[axis]) * inverseCellSize[axis]);
+        return std::min(std::max(c, 0), resolution[axis] - 1);
+    }
+    inline size_t cellIndex(int x, int y, int z) const
+    {
+        return ((size_t)z * resolution[1] + y) * resolution[0] + x;
+    }
+
+    // Calls visit(begin, end, cellExit) for the non-empty cells along the ray in front-to-back
+    // order, until it returns true or the ray leaves the grid or passes tMax.
+    template <typename Visit>
+    void traverse(const ray& r, float tMin, float& tMax, Visit visit) const
+    {
+        if (primitiveCount == 0) {
+            return;
+        }
+        // Clip the ray to the grid bounds.
+        float t0 = tMin, t1 = tMax;
+        for (int a = 0; a < 3; ++a) {
+            float invDirection = 1 / r.direction[a];
+            float tNear = (bounds.min()[a] - r.origin[a]) * invDirection;
+            float tFar = (bounds.max()[a] - r.origin[a]) * invDirection;
+            if (tNear > tFar) {
+                std::swap(tNear, tFar);
+            }
+            t0 = std::max(t0, tNear);
+            t1 = std::min(t1, tFar);
+            if (t1 < t0) {
+                return;
+            }
+        }
+        const vec3 entry = r.getPoint(t0);
+        int cell[3], step[3], end[3];
+        float tNext[3], tDelta[3];
+        for (int a = 0; a < 3; ++a) {
+            cell[a] = cellCoordinate(entry[a], a);
+            const float d = r.direction[a];
+            if (d > 0) {
+                step[a] = 1;
+                end[a] = resolution[a];
+                tNext[a] = t0 + (bounds.min()[a] + (cell[a] + 1) * cellSize[a] - entry[a]) / d;
+                tDelta[a] = cellSize[a] / d;
+            } else if (d < 0) {
+                step[a] = -1;
+                end[a] = -1;
+                tNext[a] = t0 + (bounds.min()[a] + cell[a] * cellSize[a] - entry[a]) / d;
+                tDelta[a] = -cellSize[a] / d;
+            } else {
+                step[a] = 0;
+                end[a] = -1;
+                tNext[a] = FLT_MAX;
+                tDelta[a] = FLT_MAX;
+            }
+        }
+        while (true) {
+            countNodeVisit();
+            const int axis = tNext[0] < tNext[1] ? (tNext[0] < tNext[2] ? 0 : 2)
+                                                 : (tNext[1] < tNext[2] ? 1 : 2);
+            const size_t c = cellIndex(cell[0], cell[1], cell[2]);
+            const uint32_t* begin = cellPrimitives + cellStart[c];
+            const uint32_t* finish = cellPrimitives + cellStart[c + 1];
+            if (begin != finish && visit(begin, finish, tNext[axis])) {
+                return;
+            }
+            if (tNext[axis] > tMax) {
+                return;
+            }
+            cell[axis] += step[axis];
+            if (cell[axis] == end[axis]) {
+                return;
+            }
+            tNext[axis] += tDelta[axis];
+        }
+    }
+
+    hitable** primitives;
+    hitable** bigObjects;
+    uint32_t* cellStart;
+    uint32_t* cellPrimitives;
+    hitable** list;
+    unsigned int count;
+    aabb bounds;
+    float cellSize[3];
+    float inverseCellSize[3];
+    const bool isArena;
+};
+
+#endif
@@ -0,0 +1,114 @@
+#ifndef HEATMAP_H
+#define HEATMAP_H
+
+#include "camera.h"
+#include "hitable.h"
+#include "render.h"
+#include "trace.h"
+#include <algorithm>
+#include <vector>
+
+// Per-pixel traversal cost: BVH nodes visited, box tests and primitive tests, for the primary ray
+// alone and for the whole path, averaged over the samples of the pixel. Rendered as false-colour
+// images to show which parts of the scene (and which BVH builder) make traversal expensive.
+namespace heatmap
+{
+enum metric : unsigned int { nodesVisited = 0, boxTests = 1, primitiveTests = 2, metricCount = 3 };
+
+struct pixelCost {
+    float primary[metricCount];
+    float total[metricCount];
+};
+
+inline void add(float* sum, const traversalCounters& c)
+{
+    sum[nodesVisited] += c.nodesVisited;
+    sum[boxTests] += c.boxTests;
+    sum[primitiveTests] += c.primitiveTests;
+}
+
+// Traces like raycastWorld but records traversal counters instead of colour, which are only
+// counted with RT_TRAVERSAL_STATS defined (see hitable.h). `out` holds one pixelCost per pixel of
+// the full image.
+inline void raycastTraversalCost(const raycastWorldParameters& params, const hitable* world,
+                                 const camera& cam, pixelCost* out)
+{
+    trace::scope span("traversal heatmap", params.startHeight);
+    for (unsigned int j = params.startHeight; j < params.endHeight; ++j) {
+        for (unsigned int i = params.startWidth; i < params.endWidth; ++i) {
+            pixelCost cost = {};
+            for (unsigned int s = 0; s < params.sampling; ++s) {
+                float u = float(i + myRandom::next()) / float(params.width);
+                float v = float(j + myRandom::next()) / float(params.height);
+                ray r = cam.getRay(u, v);
+                // The primary ray is traced twice, alone and as the start of the path.
+                hitRecord rec;
+                traversal = traversalCounters{0, 0, 0};
+                world->hit(r, params.minDistance, params.maxDistance, rec);
+                add(cost.primary, traversal);
+                traversal = traversalCounters{0, 0, 0};
+                color(r, world, params.minDistance, params.maxDistance, /* depth */ 0,
+                      params.maxDepth);
+                add(cost.total, traversal);
+            }
+            for (unsigned int m = 0; m < metricCount; ++m) {
+                cost.primary[m] /= params.sampling;
+                cost.total[m] /= params.sampling;
+            }
+            out[(j - params.outStartHeight) * params.width + i] = cost;
+        }
+    }
+}
+
+// Blue (cheap) through cyan, green and yellow to red (expensive) for t in [0, 1].
+inline vec3 falseColor(float t)
+{
+    static const vec3 stops[5] = {vec3(0.f, 0.f, 0.5f), vec3(0.f, 0.6f, 1.f), vec3(0.f, 0.8f, 0.f),
+                                  vec3(1.f, 0.9f, 0.f), vec3(0.9f, 0.f, 0.f)};
+    t = std::min(std::max(t, 0.f), 1.f) * 4.f;
+    const int k = std::min((int)t, 3);
+    const float f = t - k;
+    return stops[k] * (1.f - f) + stops[k + 1] * f;
+}
+
+struct summary {
+    float mean;
+    float max;
+};
+
+// Maps `metric` of the primary or total cost to rgba8 pixels, scaled so that `scaleMax` is red.
+inline std::vector<unsigned char> colorize(const std::vector<pixelCost>& costs, unsigned int m,
+                                           bool primary, float scaleMax)
+{
+    std::vector<unsigned char> pixels(costs.size() * 4);
+    for (size_t p = 0; p < costs.size(); ++p) {
+        const float value = primary ? costs[p].primary[m] : costs[p].total[m];
+        const vec3 c = falseColor(scaleMax > 0 ? value / scaleMax : 0.f);
+        pixels[p * 4 + 0] = (unsigned char)(c.x() * 255.99f);
+        pixels[p * 4 + 1] = (unsigned char)(c.y() * 255.99f);
+        pixels[p * 4 + 2] = (unsigned char)(c.z() * 255.99f);
+        pixels[p * 4 + 3] = 255;
+    }
+    return pixels;
+}
+
+inline summary summarize(const std::vector<pixelCost>& costs, unsigned int m, bool primary)
+{
+    summary s{0.f, 0.f};
+    for (const pixelCost& c : costs) {
+        const float value = primary ? c.primary[m] : c.total[m];
+        s.mean += value;
+        s.max = std::max(s.max, value);
+    }
+    s.mean /= std::max<size_t>(1, costs.size());
+    return s;
+}
+
+inline const char* metricName(unsigned int m)
+{
+    static const char* names[metricCount] = {"nodes", "boxes", "primitives"};
+    return names[m];
+}
+} // namespace heatmap
+
+#endif
@@ -2,23 +2,157 @@
 #define HITABLE_H
 
 #include "aabb.h"
+#include "arena.h"
 #include "material.h"
+#include "vec2.h"
 #include "vec3.h"
+#include <algorithm>
 #include <chrono>
+#include <cmath>
+#include <thread>
+
+// Traversal work done by the calling thread, for cost heatmaps (see heatmap.h). A bvhNode counts
+// one box test when reached and as visited when the ray enters its box; sphere and triangle
+// tests count as primitive tests. Only counted in builds with RT_TRAVERSAL_STATS defined, the
+// counters stay zero otherwise so other renders do not pay for them.
+struct traversalCounters {
+    unsigned long long nodesVisited;
+    unsigned long long boxTests;
+    unsigned long long primitiveTests;
+};
+inline thread_local traversalCounters traversal = {0, 0, 0};
+
+#ifdef RT_TRAVERSAL_STATS
+constexpr bool traversalStats = true;
+#else
+constexpr bool traversalStats = false;
+#endif
+
+inline void countNodeVisit()
+{
+    if (traversalStats) {
+        traversal.nodesVisited++;
+    }
+}
+inline void countBoxTest()
+{
+    if (traversalStats) {
+        traversal.boxTests++;
+    }
+}
+inline void countPrimitiveTest()
+{
+    if (traversalStats) {
+        traversal.primitiveTests++;
+    }
+}
 
 struct hitRecord {
     float distance;
     vec3 point;
     vec3 normal;
     material* mat;
+    // Texture coordinates, and world units per uv unit around the hit for texture filtering.
+    float u;
+    float v;
+    float uvScale;
+};
+
+class hitable;
+
+// What traversal keeps of the closest hit so far: the surface point, normal and material are
+// only computed for the final one, by its primitive's surface().
+struct hitCandidate {
+    float distance;
+    const hitable* primitive;
+    // Barycentric weights of p2 and p3 for a triangle, unused by spheres.
+    float b1;
+    float b2;
 };
 
+// Hit candidates and records written by the calling thread, and their bytes, to measure what
+// closest-hit queries move around. Counted under the same RT_TRAVERSAL_STATS switch as the
+// traversal counters.
+struct hitCopyCounters {
+    unsigned long long candidates;
+    unsigned long long records;
+    unsigned long long bytes;
+};
+inline thread_local hitCopyCounters hitCopies = {0, 0, 0};
+
+inline void countCopy(const hitCandidate&)
+{
+    if (traversalStats) {
+        hitCopies.candidates++;
+        hitCopies.bytes += sizeof(hitCandidate);
+    }
+}
+inline void countCopy(const hitRecord&)
+{
+    if (traversalStats) {
+        hitCopies.records++;
+        hitCopies.bytes += sizeof(hitRecord);
+    }
+}
+
+// Closest-hit queries come in two steps: intersect() finds the closest hit within (tMin, tMax)
+// as a candidate, narrowing the interval as it goes, and surface() fills the record of that one.
+// hit() does both. A hitable overrides hit() or intersect() and surface(); the defaults of
+// either are written in terms of the other.
 class hitable
 {
   public:
-    virtual bool hit(const ray& r, float tMin, float tMax, hitRecord& rec) const = 0;
+    virtual ~hitable() {}
+    virtual bool hit(const ray& r, float tMin, float tMax, hitRecord& rec) const
+    {
+        hitCandidate candidate;
+        if (!intersect(r, tMin, tMax, candidate)) {
+            return false;
+        }
+        candidate.primitive->surface(r, candidate, rec);
+        return true;
+    }
+    // Leaves `candidate` untouched when there is no hit within (tMin, tMax).
+    virtual bool intersect(const ray& r, float tMin, float tMax, hitCandidate& candidate) const
+    {
+        hitRecord rec;
+        if (!hit(r, tMin, tMax, rec)) {
+            return false;
+        }
+        candidate = hitCandidate{rec.distance, this, 0.f, 0.f};
+        countCopy(candidate);
+        return true;
+    }
+    // Record of a candidate this hitable returned from intersect(). The default finds the hit
+    // again, at exactly the same distance.
+    virtual void surface(const ray& r, const hitCandidate& candidate, hitRecord& rec) const
+    {
+        hit(r, std::nextafter(candidate.distance, -INFINITY),
+            std::nextafter(candidate.distance, INFINITY), rec);
+    }
+    // Any-hit query: true as soon as anything lies within (tMin, tMax), no record is filled.
+    virtual bool occluded(const ray& r, float tMin, float tMax) const
+    {
+        hitRecord rec;
+        return hit(r, tMin, tMax, rec);
+    }
+    // occluded() for the rays of `fan` in `active`; returns the ones that are blocked. The
+    // default queries them one by one, a bvhNode traverses once for all of them.
+    virtual uint32_t occludedFan(const rayFan& fan, float tMin, float tMax, uint32_t active) const
+    {
+        uint32_t blocked = 0;
+        for (; active != 0; active &= active - 1) {
+            const unsigned int i = __builtin_ctz(active);
+            if (occluded(ray(fan.origin, fan.directions[i]), tMin, tMax)) {
+                blocked |= 1u << i;
+            }
+        }
+        return blocked;
+    }
     virtual aabb boundingBox() const = 0;
     virtual vec3 centeroid() const = 0;
+    // Recomputes cached bounds after primitives moved. Only acceleration structures cache any.
+    virtual aabb refit(unsigned int /* parallelDepth */ = 0) { return boundingBox(); }
 };
 
 class sphere : public hitable
@@ -27,8 +161,9 @@ class sphere : public hitable
     sphere(){};
     ~sphere() { delete mat; };
     sphere(vec3 center, float radius, material* mat) : center(center), radius(radius), mat(mat){};
-    virtual bool hit(const ray& r, float tMin, float tMax, hitRecord& rec) const
+    virtual bool intersect(const ray& r, float tMin, float tMax, hitCandidate& candidate) const
     {
+        countPrimitiveTest();
         vec3 oc = r.origin - center;
         float a = vec3::dot(r.direction, r.direction);
         float b = vec3::dot(oc, r.direction);
@@ -36,29 +171,76 @@ class sphere : public hitable
         float discriminant = b * b - a * c;
         if (discriminant > 0) {
             float t = (-b - sqrtf(b * b - a * c)) / a;
-            if (t < tMax && t > tMin) {
-                rec.distance = t;
-                rec.point = r.getPoint(rec.distance);
-                rec.normal = (rec.point - center) / radius;
-                rec.mat = mat;
-                return true;
+            if (!(t < tMax && t > tMin)) {
+                t = (-b + sqrtf(b * b - a * c)) / a;
             }
-            t = (-b + sqrtf(b * b - a * c) / a);
             if (t < tMax && t > tMin) {
-                rec.distance = t;
-                rec.point = r.getPoint(rec.distance);
-                rec.normal = (rec.point - center) / radius;
-                rec.mat = mat;
+                candidate = hitCandidate{t, this, 0.f, 0.f};
+                countCopy(candidate);
                 return true;
             }
         }
         return false;
     };
+    virtual void surface(const ray& r, const hitCandidate& candidate, hitRecord& rec) const
+    {
+        rec.distance = candidate.distance;
+        rec.point = r.getPoint(rec.distance);
+        rec.normal = (rec.point - center) / radius;
+        rec.mat = mat;
+        setUv(rec, radius);
+        countCopy(rec);
+    }
+    virtual bool occluded(const ray& r, float tMin, float tMax) const
+    {
+        vec3 oc = r.origin - center;
+        return blocks(oc, vec3::dot(oc, oc) - radius * radius, r.direction, tMin, tMax);
+    }
+    // The rays share the origin, so does the part of the test that only depends on it.
+    virtual uint32_t occludedFan(const rayFan& fan, float tMin, float tMax, uint32_t active) const
+    {
+        vec3 oc = fan.origin - center;
+        float c = vec3::dot(oc, oc) - radius * radius;
+        uint32_t blocked = 0;
+        for (; active != 0; active &= active - 1) {
+            const unsigned int i = __builtin_ctz(active);
+            if (blocks(oc, c, fan.directions[i], tMin, tMax)) {
+                blocked |= 1u << i;
+            }
+        }
+        return blocked;
+    }
     virtual aabb boundingBox() const
     {
         return aabb(center - vec3(radius, radius, radius), center + vec3(radius, radius, radius));
     };
     virtual vec3 centeroid() const { return center; }
+    // Longitude/latitude mapping, u around the y axis and v from the bottom pole.
+    static inline void setUv(hitRecord& rec, float radius)
+    {
+        rec.u = (atan2f(-rec.normal.z(), rec.normal.x()) + mathx::pi) / (2 * mathx::pi);
+        rec.v = acosf(std::min(1.f, std::max(-1.f, -rec.normal.y()))) / mathx::pi;
+        rec.uvScale = 2 * mathx::pi * radius;
+    }
+    // Any-hit test of one direction, given origin - center and |origin - center|^2 - radius^2.
+    static inline bool blocks(const vec3& oc, float c, const vec3& direction, float tMin,
+                              float tMax)
+    {
+        countPrimitiveTest();
+        float a = vec3::dot(direction, direction);
+        float b = vec3::dot(oc, direction);
+        float discriminant = b * b - a * c;
+        if (discriminant <= 0) {
+            return false;
+        }
+        float root = sqrtf(discriminant);
+        float t = (-b - root) / a;
+        if (t < tMax && t > tMin) {
+            return true;
+        }
+        t = (-b + root) / a;
+        return t < tMax && t > tMin;
+    }
     vec3 center;
     float radius;
     material* mat;
@@ -69,9 +251,13 @@ class triangle : public hitable
   public:
     triangle(){};
     ~triangle() { delete mat; };
-    triangle(vec3 p1, vec3 p2, vec3 p3, material* mat) : p1(p1), p2(p2), p3(p3), mat(mat){};
-    virtual bool hit(const ray& r, float tMin, float tMax, hitRecord& rec) const
+    triangle(vec3 p1, vec3 p2, vec3 p3, material* mat)
+        : p1(p1), p2(p2), p3(p3), uv1(0, 0), uv2(1, 0), uv3(0, 1), mat(mat){};
+    triangle(vec3 p1, vec3 p2, vec3 p3, vec2 uv1, vec2 uv2, vec2 uv3, material* mat)
+        : p1(p1), p2(p2), p3(p3), uv1(uv1), uv2(uv2), uv3(uv3), mat(mat){};
+    virtual bool intersect(const ray& r, float tMin, float tMax, hitCandidate& candidate) const
     {
+        countPrimitiveTest();
         vec3 p1p2 = p2 - p1;
         vec3 p1p3 = p3 - p1;
         vec3 pvec = vec3::cross(r.direction, p1p3);
@@ -98,19 +284,60 @@ class triangle : public hitable
             return false;
         }
         float t = vec3::dot(p1p3, qvec) * invDet;
-        if (t > tMax || t < tMin) {
+        if (!(t < tMax && t > tMin)) {
             return false;
         }
-
-        rec.distance = t;
+        // u and v are the barycentric weights of p2 and p3.
+        candidate = hitCandidate{t, this, u, v};
+        countCopy(candidate);
+        return true;
+    };
+    virtual void surface(const ray& r, const hitCandidate& candidate, hitRecord& rec) const
+    {
+        vec3 p1p2 = p2 - p1;
+        vec3 p1p3 = p3 - p1;
+        vec3 cross = vec3::cross(p1p2, p1p3);
+        rec.distance = candidate.distance;
         rec.point = r.getPoint(rec.distance);
-        rec.normal = vec3::cross(p1p2, p1p3).normalized();
+        rec.normal = cross.normalized();
         if (vec3::dot(r.direction, rec.normal) > 0) {
             rec.normal = -rec.normal;
         }
         rec.mat = mat;
-        return true;
-    };
+        const float u = candidate.b1, v = candidate.b2;
+        vec2 uv = uv1 * (1 - u - v) + uv2 * u + uv3 * v;
+        rec.u = uv.x();
+        rec.v = uv.y();
+        vec2 e1 = uv2 - uv1, e2 = uv3 - uv1;
+        float uvArea = fabs(vec2::cross(e1, e2));
+        rec.uvScale = uvArea > 0 ? sqrtf(cross.length() / uvArea) : 1.f;
+        countCopy(rec);
+    }
+    virtual bool occluded(const ray& r, float tMin, float tMax) const
+    {
+        countPrimitiveTest();
+        vec3 p1p2 = p2 - p1;
+        vec3 p1p3 = p3 - p1;
+        vec3 pvec = vec3::cross(r.direction, p1p3);
+        float det = vec3::dot(p1p2, pvec);
+        // Same backface culling as hit()
+        if (det < mathx::epsilon) {
+            return false;
+        }
+        float invDet = 1 / det;
+        vec3 tvec = r.origin - p1;
+        float u = vec3::dot(tvec, pvec) * invDet;
+        if (u < 0 || u > 1) {
+            return false;
+        }
+        vec3 qvec = vec3::cross(tvec, p1p2);
+        float v = vec3::dot(r.direction, qvec) * invDet;
+        if (v < 0 || u + v > 1) {
+            return false;
+        }
+        float t = vec3::dot(p1p3, qvec) * invDet;
+        return t < tMax && t > tMin;
+    }
     virtual aabb boundingBox() const
     {
         vec3 min(mathx::min(mathx::min(p1.x(), p2.x()), p3.x()),
@@ -126,6 +353,9 @@ class triangle : public hitable
     vec3 p1;
     vec3 p2;
     vec3 p3;
+    vec2 uv1;
+    vec2 uv2;
+    vec2 uv3;
     material* mat;
 };
 
@@ -144,23 +374,32 @@ class hitableList : public hitable
     virtual bool hit(const ray& r, float tMin, float tMax, hitRecord& rec) const
     {
         auto t1 = std::chrono::high_resolution_clock::now();
-        hitRecord temp;
+        bool hitAnything = hitable::hit(r, tMin, tMax, rec);
+        auto t2 = std::chrono::high_resolution_clock::now();
+        auto duration = std::chrono::duration_cast<std::chrono::microseconds>(t2 - t1).count();
+        std::printf("Inside: Hit duration: %u. IsHit: %u.\n", duration, hitAnything);
+        return hitAnything;
+    }
+    virtual bool intersect(const ray& r, float tMin, float tMax, hitCandidate& candidate) const
+    {
         bool hitAnything = false;
-        float closest = tMax;
-        for (int i = 0; i < count; ++i) {
-            hitable* h = list[i];
-            bool isHit = h->hit(r, tMin, closest, temp);
-            if (isHit) {
-                closest = temp.distance;
-                rec = temp;
+        for (unsigned int i = 0; i < count; ++i) {
+            if (list[i]->intersect(r, tMin, tMax, candidate)) {
+                tMax = candidate.distance;
                 hitAnything = true;
             }
         }
-        auto t2 = std::chrono::high_resolution_clock::now();
-        auto duration = std::chrono::duration_cast<std::chrono::microseconds>(t2 - t1).count();
-        std::printf("Inside: Hit duration: %u. IsHit: %u.\n", duration, hitAnything);
         return hitAnything;
     }
+    virtual bool occluded(const ray& r, float tMin, float tMax) const
+    {
+        for (unsigned int i = 0; i < count; ++i) {
+            if (list[i]->occluded(r, tMin, tMax)) {
+                return true;
+            }
+        }
+        return false;
+    }
     virtual aabb boundingBox() const
     {
         if (count == 0) {
@@ -193,7 +432,9 @@ class bvhNode : public hitable
 {
   public:
     bvhNode(bool isRoot = false) : left(nullptr), right(nullptr), box(), isRoot(isRoot){};
-    bvhNode(hitable** list, int count, bool isRoot = false) : isRoot(isRoot)
+    // Child nodes come from `arena` when one is given, otherwise from the heap.
+    bvhNode(hitable** list, int count, bool isRoot = false, sceneArena* arena = nullptr)
+        : isRoot(isRoot)
     {
         int axis(myRandom::next() * 3);
         switch (axis) {
@@ -219,8 +460,14 @@ class bvhNode : public hitable
             right = list[1];
             box = aabb::surroundingBox(left->boundingBox(), right->boundingBox());
         } else {
-            left = new bvhNode(list, (count / 2));
-            right = new bvhNode(list + (count / 2), count - (count / 2));
+            if (arena != nullptr) {
+                left = arena->create<bvhNode>(list, (count / 2), false, arena);
+                right = arena->create<bvhNode>(list + (count / 2), count - (count / 2), false,
+                                               arena);
+            } else {
+                left = new bvhNode(list, (count / 2));
+                right = new bvhNode(list + (count / 2), count - (count / 2));
+            }
             box = aabb::surroundingBox(left->boundingBox(), right->boundingBox());
         }
     }
@@ -235,26 +482,11 @@ class bvhNode : public hitable
     }
     virtual bool hit(const ray& r, float tMin, float tMax, hitRecord& rec) const
     {
-        bool isHit = false;
         std::chrono::time_point<std::chrono::high_resolution_clock> t1, t2;
         if (isRoot) {
             t1 = std::chrono::high_resolution_clock::now();
         }
-        if (box.hit(r, tMin, tMax)) {
-            hitRecord lRecord, rRecord;
-            bool lHit = left != nullptr && left->hit(r, tMin, tMax, lRecord);
-            bool rHit = right != nullptr && right->hit(r, tMin, tMax, rRecord);
-            if (lHit && rHit) {
-                rec = lRecord.distance < rRecord.distance ? lRecord : rRecord;
-                isHit = true;
-            } else if (lHit) {
-                rec = lRecord;
-                isHit = true;
-            } else if (rHit) {
-                rec = rRecord;
-                isHit = true;
-            }
-        }
+        bool isHit = hitable::hit(r, tMin, tMax, rec);
         if (isRoot) {
             t2 = std::chrono::high_resolution_clock::now();
             auto duration = std::chrono::duration_cast<std::chrono::microseconds>(t2 - t1).count();
@@ -262,8 +494,91 @@ class bvhNode : public hitable
         }
         return isHit;
     }
+    // The right child only looks for hits closer than the left one's.
+    virtual bool intersect(const ray& r, float tMin, float tMax, hitCandidate& candidate) const
+    {
+        countBoxTest();
+        if (!box.hit(r, tMin, tMax)) {
+            return false;
+        }
+        countNodeVisit();
+        bool isHit = left != nullptr && left->intersect(r, tMin, tMax, candidate);
+        if (right != nullptr &&
+            right->intersect(r, tMin, isHit ? candidate.distance : tMax, candidate)) {
+            isHit = true;
+        }
+        return isHit;
+    }
+    virtual bool occluded(const ray& r, float tMin, float tMax) const
+    {
+        countBoxTest();
+        if (!box.hit(r, tMin, tMax)) {
+            return false;
+        }
+        countNodeVisit();
+        return (left != nullptr && left->occluded(r, tMin, tMax)) ||
+               (right != nullptr && right->occluded(r, tMin, tMax));
+    }
+    // One traversal for the whole fan; the right child only sees the rays the left one left open.
+    virtual uint32_t occludedFan(const rayFan& fan, float tMin, float tMax, uint32_t active) const
+    {
+        countBoxTest();
+        active = box.hit(fan, tMin, tMax, active);
+        if (active == 0) {
+            return 0;
+        }
+        countNodeVisit();
+        uint32_t blocked = left != nullptr ? left->occludedFan(fan, tMin, tMax, active) : 0;
+        if (right != nullptr && (active & ~blocked) != 0) {
+            blocked |= right->occludedFan(fan, tMin, tMax, active & ~blocked);
+        }
+        return blocked;
+    }
     virtual aabb boundingBox() const { return box; }
     virtual vec3 centeroid() const { return (box.max() + box.min()) / 2.f; }
+    // Bottom-up bounds update with the topology unchanged. The two subtrees of the top
+    // `parallelDepth` levels are refit on separate threads.
+    virtual aabb refit(unsigned int parallelDepth = 0)
+    {
+        aabb leftBox, rightBox;
+        if (parallelDepth > 0 && left != nullptr && right != nullptr) {
+            std::thread leftTask([this, &leftBox, parallelDepth]() {
+                leftBox = left->refit(parallelDepth - 1);
+            });
+            rightBox = right->refit(parallelDepth - 1);
+            leftTask.join();
+        } else {
+            leftBox = left != nullptr ? left->refit() : aabb();
+            rightBox = right != nullptr ? right->refit() : aabb();
+        }
+        box = leftBox;
+        if (left == nullptr) {
+            box = rightBox;
+        } else if (right != nullptr) {
+            box.expandToInclude(rightBox);
+        }
+        return box;
+    }
+    // Surface area heuristic cost of this subtree for rays hitting a box of area `rootArea`: one
+    // unit per node visit, `intersectionCost` per primitive test. Primitive children are tested
+    // whenever this node is visited.
+    float sahCost(float rootArea, float intersectionCost = 1.f) const
+    {
+        const float visitProbability = box.surfaceArea() / rootArea;
+        float cost = visitProbability;
+        const hitable* children[2] = {left, right};
+        for (const hitable* child : children) {
+            if (child == nullptr) {
+                continue;
+            }
+            if (const bvhNode* node = dynamic_cast<const bvhNode*>(child)) {
+                cost += node->sahCost(rootArea, intersectionCost);
+            } else {
+                cost += intersectionCost * visitProbability;
+            }
+        }
+        return cost;
+    }
 
     static int aabbXCompare(const void* a, const void* b)
     {
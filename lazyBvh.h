@@ -0,0 +1,180 @@
+#ifndef LAZYBVH_H
+#define LAZYBVH_H
+
+#include "aabb.h"
+#include "arena.h"
+#include "hitable.h"
+#include "trace.h"
+#include <algorithm>
+#include <atomic>
+#include <cfloat>
+#include <mutex>
+#include <thread>
+
+// BVH built on demand. Construction only bounds the whole primitive range; a node is split (at
+// the centroid median of its widest axis) the first time a ray enters it, so a preview that only
+// sees part of a large scene never pays for the rest of the tree. Several render threads may
+// reach the same unbuilt node: one of them expands it, the others wait for its children to be
+// published and continue. Primitives are reordered within their node's range while it is
+// expanded, which no other thread reads before the expansion is published.
+class lazyBvh : public hitable
+{
+  public:
+    struct node {
+        aabb box;
+        hitable** first;
+        unsigned int count;
+        std::atomic<node*> children; // two nodes once expanded, nullptr before and for leaves
+        std::atomic_bool expanding;
+    };
+
+    lazyBvh(hitable** list, unsigned int count, sceneArena& arena, unsigned int leafSize = 2)
+        : leafSize(std::max(1u, leafSize)), expandedNodes(0), arena(arena)
+    {
+        trace::scope span("lazy bvh root", count);
+        root = arena.create<node>();
+        initNode(*root, list, count);
+    }
+    lazyBvh(const lazyBvh&) = delete;
+    lazyBvh& operator=(const lazyBvh&) = delete;
+
+    virtual bool intersect(const ray& r, float tMin, float tMax, hitCandidate& candidate) const
+    {
+        bool isHit = false;
+        traverse(r, tMin, tMax, [&](hitable* p) {
+            if (p->intersect(r, tMin, tMax, candidate)) {
+                tMax = candidate.distance;
+                isHit = true;
+            }
+            return false;
+        });
+        return isHit;
+    }
+    virtual bool occluded(const ray& r, float tMin, float tMax) const
+    {
+        bool isOccluded = false;
+        traverse(r, tMin, tMax, [&](hitable* p) {
+            isOccluded = p->occluded(r, tMin, tMax);
+            return isOccluded;
+        });
+        return isOccluded;
+    }
+    virtual aabb boundingBox() const { return root != nullptr ? root->box : aabb(); }
+    virtual vec3 centeroid() const
+    {
+        aabb box = boundingBox();
+        return (box.min() + box.max()) / 2.f;
+    }
+
+    // Expands every node now, for an eager build with the same splits.
+    void expandAll() { expandSubtree(root); }
+
+    const unsigned int leafSize;
+    // Nodes split so far; a complete tree has about count / leafSize.
+    std::atomic<unsigned int> expandedNodes;
+
+  private:
+    static void initNode(node& n, hitable** first, unsigned int count)
+    {
+        n.first = first;
+        n.count = count;
+        n.children.store(nullptr, std::memory_order_relaxed);
+        n.expanding.store(false, std::memory_order_relaxed);
+        if (count > 0) {
+            n.box = first[0]->boundingBox();
+            for (unsigned int i = 1; i < count; ++i) {
+                n.box.expandToInclude(first[i]->boundingBox());
+            }
+        }
+    }
+
+    // Children of an inner node, splitting it first when no thread has yet.
+    node* expand(node* n) const
+    {
+        node* children = n->children.load(std::memory_order_acquire);
+        if (children != nullptr) {
+            return children;
+        }
+        if (n->expanding.exchange(true, std::memory_order_acq_rel)) {
+            while ((children = n->children.load(std::memory_order_acquire)) == nullptr) {
+                std::this_thread::yield();
+            }
+            return children;
+        }
+        return const_cast<lazyBvh*>(this)->split(n);
+    }
+
+    node* split(node* n)
+    {
+        trace::scope span("lazy bvh expand", n->count);
+        aabb centroids(n->first[0]->centeroid());
+        for (unsigned int i = 1; i < n->count; ++i) {
+            centroids.expandToInclude(n->first[i]->centeroid());
+        }
+        const unsigned int axis = centroids.maxDimension();
+        const unsigned int half = n->count / 2;
+        std::nth_element(n->first, n->first + half, n->first + n->count,
+                         [axis](const hitable* a, const hitable* b) {
+                             return a->centeroid()[axis] < b->centeroid()[axis];
+                         });
+        node* children;
+        {
+            // The arena is shared by every expanding thread.
+            std::lock_guard<std::mutex> lock(arenaMutex);
+            children = arena.createArray<node>(2);
+        }
+        initNode(children[0], n->first, half);
+        initNode(children[1], n->first + half, n->count - half);
+        expandedNodes++;
+        n->children.store(children, std::memory_order_release);
+        return children;
+    }
+
+    void expandSubtree(node* n)
+    {
+        if (n == nullptr || n->count <= leafSize) {
+            return;
+        }
+        node* children = expand(n);
+        expandSubtree(&children[0]);
+        expandSubtree(&children[1]);
+    }
+
+    // Calls visit(primitive) for the primitives of the leaves whose boxes the ray enters, until
+    // it returns true. tMax may be lowered by visit.
+    template <typename Visit>
+    void traverse(const ray& r, float tMin, float& tMax, Visit visit) const
+    {
+        if (root == nullptr || root->count == 0) {
+            return;
+        }
+        node* stack[64];
+        int top = 0;
+        stack[top++] = root;
+        while (top > 0) {
+            node* n = stack[--top];
+            countBoxTest();
+            if (!n->box.hit(r, tMin, tMax)) {
+                continue;
+            }
+            countNodeVisit();
+            if (n->count <= leafSize) {
+                for (unsigned int i = 0; i < n->count; ++i) {
+                    if (visit(n->first[i])) {
+                        return;
+                    }
+                }
+                continue;
+            }
+            node* children = expand(n);
+            stack[top++] = &children[1];
+            stack[top++] = &children[0];
+        }
+    }
+
+    sceneArena& arena;
+    std::mutex arenaMutex;
+    node* root;
+};
+
+#endif
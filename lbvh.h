@@ -0,0 +1,246 @@
+#ifndef LBVH_H
+#define LBVH_H
+
+#include "aabb.h"
+#include "arena.h"
+#include "hitable.h"
+#include "trace.h"
+#include <algorithm>
+#include <atomic>
+#include <cfloat>
+#include <chrono>
+#include <cstdint>
+#include <thread>
+#include <vector>
+
+// Parallel linear BVH builder (Karras 2012, "Maximizing Parallelism in the Construction of BVHs,
+// Octrees, and k-d Trees"). Primitives are sorted along a 30-bit Morton curve of their centroids
+// with a parallel LSD radix sort, every internal node then finds its key range and split
+// independently, and bounds are filled bottom-up by whichever thread reaches a node second.
+// Produces ordinary bvhNode objects, allocated as one contiguous array from the scene arena.
+namespace lbvh
+{
+struct buildStats {
+    double boundsMilliseconds;
+    double sortMilliseconds;
+    double hierarchyMilliseconds;
+    double refitMilliseconds;
+    double totalMilliseconds;
+};
+
+// Runs fn(begin, end, threadIndex) over [0, count) split into `threadCount` contiguous chunks.
+template <typename Fn> void parallelFor(size_t count, unsigned int threadCount, Fn fn)
+{
+    threadCount = (unsigned int)std::max<size_t>(1, std::min<size_t>(threadCount, count));
+    const size_t step = (count + threadCount - 1) / threadCount;
+    std::vector<std::thread> workers;
+    for (unsigned int t = 1; t < threadCount; ++t) {
+        const size_t begin = std::min(count, t * step);
+        const size_t end = std::min(count, begin + step);
+        workers.push_back(std::thread(fn, begin, end, t));
+    }
+    fn(0, std::min(count, step), 0u);
+    for (auto& w : workers) {
+        w.join();
+    }
+}
+
+// Spreads the lower 10 bits of v so there are two zero bits between each.
+inline uint32_t expandBits(uint32_t v)
+{
+    v = (v * 0x00010001u) & 0xFF0000FFu;
+    v = (v * 0x00000101u) & 0x0F00F00Fu;
+    v = (v * 0x00000011u) & 0xC30C30C3u;
+    v = (v * 0x00000005u) & 0x49249249u;
+    return v;
+}
+
+// `p` normalized to the unit cube.
+inline uint32_t morton3D(const vec3& p)
+{
+    float x = std::min(std::max(p.x() * 1024.f, 0.f), 1023.f);
+    float y = std::min(std::max(p.y() * 1024.f, 0.f), 1023.f);
+    float z = std::min(std::max(p.z() * 1024.f, 0.f), 1023.f);
+    return (expandBits((uint32_t)x) << 2) | (expandBits((uint32_t)y) << 1) |
+           expandBits((uint32_t)z);
+}
+
+// Stable LSD radix sort of (key, value) pairs, 8 bits per pass.
+inline void radixSort(std::vector<uint32_t>& keys, std::vector<uint32_t>& values,
+                      unsigned int threadCount)
+{
+    const size_t count = keys.size();
+    threadCount = (unsigned int)std::max<size_t>(1, std::min<size_t>(threadCount, count));
+    std::vector<uint32_t> keysOut(count), valuesOut(count);
+    std::vector<size_t> histograms(threadCount * 256);
+    for (int shift = 0; shift < 32; shift += 8) {
+        std::fill(histograms.begin(), histograms.end(), 0);
+        parallelFor(count, threadCount, [&](size_t begin, size_t end, unsigned int t) {
+            size_t* h = histograms.data() + t * 256;
+            for (size_t i = begin; i < end; ++i) {
+                h[(keys[i] >> shift) & 0xFF]++;
+            }
+        });
+        // Exclusive prefix in digit-major, thread-minor order keeps the sort stable.
+        size_t sum = 0;
+        for (int d = 0; d < 256; ++d) {
+            for (unsigned int t = 0; t < threadCount; ++t) {
+                size_t c = histograms[t * 256 + d];
+                histograms[t * 256 + d] = sum;
+                sum += c;
+            }
+        }
+        parallelFor(count, threadCount, [&](size_t begin, size_t end, unsigned int t) {
+            size_t* offsets = histograms.data() + t * 256;
+            for (size_t i = begin; i < end; ++i) {
+                size_t o = offsets[(keys[i] >> shift) & 0xFF]++;
+                keysOut[o] = keys[i];
+                valuesOut[o] = values[i];
+            }
+        });
+        keys.swap(keysOut);
+        values.swap(valuesOut);
+    }
+}
+
+// Length of the common prefix of keys i and j; ties are broken by the index so every key is
+// unique. -1 for j outside the array.
+inline int delta(const std::vector<uint32_t>& keys, int i, int j)
+{
+    if (j < 0 || j >= (int)keys.size()) {
+        return -1;
+    }
+    if (keys[i] == keys[j]) {
+        return 32 + (i == j ? 32 : __builtin_clz((uint32_t)(i ^ j)));
+    }
+    return __builtin_clz(keys[i] ^ keys[j]);
+}
+
+inline hitable* build(hitable** list, unsigned int count, sceneArena& arena,
+                      unsigned int threadCount, buildStats* stats = nullptr)
+{
+    trace::scope span("lbvh build", count);
+    auto t1 = std::chrono::high_resolution_clock::now();
+    if (count == 0) {
+        return nullptr;
+    }
+    if (count == 1) {
+        bvhNode* node = arena.create<bvhNode>();
+        node->left = list[0];
+        node->box = list[0]->boundingBox();
+        return node;
+    }
+
+    // Primitive bounds and the bounds of their centroids.
+    std::vector<aabb> boxes(count);
+    const aabb empty(vec3(FLT_MAX, FLT_MAX, FLT_MAX), vec3(-FLT_MAX, -FLT_MAX, -FLT_MAX));
+    std::vector<aabb> centroidBounds(threadCount, empty);
+    parallelFor(count, threadCount, [&](size_t begin, size_t end, unsigned int t) {
+        for (size_t i = begin; i < end; ++i) {
+            boxes[i] = list[i]->boundingBox();
+            centroidBounds[t].expandToInclude((boxes[i].min() + boxes[i].max()) * 0.5f);
+        }
+    });
+    aabb bounds = empty;
+    for (const aabb& b : centroidBounds) {
+        bounds.expandToInclude(b);
+    }
+    vec3 extent = bounds.extent();
+    vec3 inverseExtent(extent.x() > 0 ? 1 / extent.x() : 0, extent.y() > 0 ? 1 / extent.y() : 0,
+                       extent.z() > 0 ? 1 / extent.z() : 0);
+
+    std::vector<uint32_t> keys(count), order(count);
+    parallelFor(count, threadCount, [&](size_t begin, size_t end, unsigned int) {
+        for (size_t i = begin; i < end; ++i) {
+            vec3 c = (boxes[i].min() + boxes[i].max()) * 0.5f;
+            keys[i] = morton3D((c - bounds.min()) * inverseExtent);
+            order[i] = (uint32_t)i;
+        }
+    });
+    auto t2 = std::chrono::high_resolution_clock::now();
+    radixSort(keys, order, threadCount);
+    auto t3 = std::chrono::high_resolution_clock::now();
+
+    // Internal nodes 0..count-2, node 0 is the root. A child index with the high bit set refers
+    // to a leaf (sorted primitive).
+    const uint32_t leafBit = 0x80000000u;
+    bvhNode* nodes = arena.createArray<bvhNode>(count - 1);
+    std::vector<uint32_t> children((count - 1) * 2);
+    std::vector<uint32_t> parents(2 * count - 1); // internal nodes first, then leaves
+    parents[0] = ~0u;
+    parallelFor(count - 1, threadCount, [&](size_t begin, size_t end, unsigned int) {
+        for (int i = (int)begin; i < (int)end; ++i) {
+            // Direction of the range and its other end.
+            int d = delta(keys, i, i + 1) - delta(keys, i, i - 1) >= 0 ? 1 : -1;
+            int deltaMin = delta(keys, i, i - d);
+            int lMax = 2;
+            while (delta(keys, i, i + lMax * d) > deltaMin) {
+                lMax *= 2;
+            }
+            int l = 0;
+            for (int t = lMax / 2; t >= 1; t /= 2) {
+                if (delta(keys, i, i + (l + t) * d) > deltaMin) {
+                    l += t;
+                }
+            }
+            int j = i + l * d;
+            // Highest differing bit splits the range.
+            int deltaNode = delta(keys, i, j);
+            int s = 0;
+            for (int t = (l + 1) / 2;; t = (t + 1) / 2) {
+                if (delta(keys, i, i + (s + t) * d) > deltaNode) {
+                    s += t;
+                }
+                if (t == 1) {
+                    break;
+                }
+            }
+            int split = i + s * d + std::min(d, 0);
+            int first = std::min(i, j), last = std::max(i, j);
+            uint32_t left = first == split ? leafBit | split : (uint32_t)split;
+            uint32_t right = last == split + 1 ? leafBit | (split + 1) : (uint32_t)(split + 1);
+            children[i * 2 + 0] = left;
+            children[i * 2 + 1] = right;
+            parents[(left & leafBit) ? (count - 1) + (left & ~leafBit) : left] = i;
+            parents[(right & leafBit) ? (count - 1) + (right & ~leafBit) : right] = i;
+            nodes[i].left = (left & leafBit) ? list[order[left & ~leafBit]] : &nodes[left];
+            nodes[i].right = (right & leafBit) ? list[order[right & ~leafBit]] : &nodes[right];
+        }
+    });
+    auto t4 = std::chrono::high_resolution_clock::now();
+
+    // Bottom-up bounds: the second thread to arrive at a node has both children ready.
+    std::vector<std::atomic_uint> visits(count - 1);
+    parallelFor(count, threadCount, [&](size_t begin, size_t end, unsigned int) {
+        for (size_t leaf = begin; leaf < end; ++leaf) {
+            uint32_t node = parents[(count - 1) + leaf];
+            while (node != ~0u) {
+                if (visits[node].fetch_add(1, std::memory_order_acq_rel) == 0) {
+                    break;
+                }
+                uint32_t l = children[node * 2 + 0], r = children[node * 2 + 1];
+                aabb box = (l & leafBit) ? boxes[order[l & ~leafBit]] : nodes[l].box;
+                box.expandToInclude((r & leafBit) ? boxes[order[r & ~leafBit]] : nodes[r].box);
+                nodes[node].box = box;
+                node = parents[node];
+            }
+        }
+    });
+    auto t5 = std::chrono::high_resolution_clock::now();
+
+    if (stats != nullptr) {
+        auto ms = [](std::chrono::high_resolution_clock::time_point a,
+                     std::chrono::high_resolution_clock::time_point b) {
+            return std::chrono::duration_cast<std::chrono::microseconds>(b - a).count() / 1000.0;
+        };
+        stats->boundsMilliseconds = ms(t1, t2);
+        stats->sortMilliseconds = ms(t2, t3);
+        stats->hierarchyMilliseconds = ms(t3, t4);
+        stats->refitMilliseconds = ms(t4, t5);
+        stats->totalMilliseconds = ms(t1, t5);
+    }
+    return &nodes[0];
+}
+} // namespace lbvh
+
+#endif
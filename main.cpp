@@ -1,113 +1,90 @@
 #define STB_IMAGE_WRITE_IMPLEMENTATION
+#define STB_IMAGE_IMPLEMENTATION
+#include "external\stb_image.h"
+// Other headers include stb_image.h for the declarations only.
+#undef STB_IMAGE_IMPLEMENTATION
 
 #include "camera.h"
+#include "contentHash.h"
+#include "convergence.h"
+#include "distributed.h"
+#include "dynamicBvh.h"
+#include "heatmap.h"
 // #include "external\Fast-BVH\BVH.h"
 #include "external\OBJ_Loader.h"
 #include "external\stb_image_write.h"
 #include "hitable.h"
+#include "lazyBvh.h"
 #include "materials.h"
+#include "numa.h"
+#include "packedBvh.h"
+#include "pfm.h"
+#include "perfCounters.h"
+#include "pngEncoder.h"
+#include "radianceCache.h"
+#include "render.h"
+#include "renderJob.h"
+#include "resolve.h"
+#include "scene.h"
+#include "sphereStore.h"
+#include "streamingImage.h"
+#include "textureCache.h"
+#include "tileRenderCache.h"
+#include "trace.h"
+#include "wavefront.h"
 #include <algorithm>
 #include <atomic>
 #include <chrono>
 #include <cstdint>
+#include <cstdio>
+#include <functional>
 #include <iostream>
+#include <string>
 #include <thread>
+#include <type_traits>
 #include <vector>
 
-vec3 backgroundColor(const ray& r)
+sceneDescription randomSceneDescription()
 {
-    vec3 unit = r.direction;
-    float t1 = 0.5f - (0.5f * unit.y());
-    float t2 = 0.5f + (0.5f * unit.y());
-    return t1 * vec3(0.5f, 1.f, 1.f) + t2 * vec3(0.5f, 0.7f, 1.f);
-}
-vec3 color(const ray& r, const hitable* hitable, const float minDistance, const float maxDistance,
-           const unsigned int depth, const unsigned int maxDepth)
-{
-    hitRecord rec;
-    // auto t1 = std::chrono::high_resolution_clock::now();
-    bool isHit = hitable->hit(r, minDistance, maxDistance, rec);
-    // auto t2 = std::chrono::high_resolution_clock::now();
-    // auto duration = std::chrono::duration_cast<std::chrono::microseconds>(t2 - t1).count();
-    // std::printf("Hit duration: %u. IsHit: %u.\n", duration, isHit);
-    if (isHit) {
-        ray scattered;
-        vec3 attenuation;
-        if (depth < maxDepth && rec.mat->scatter(r, rec, attenuation, scattered)) {
-            return attenuation *
-                   color(scattered, hitable, minDistance, maxDistance, depth + 1, maxDepth);
-        }
-        return vec3(0, 0, 0);
-    }
-    return backgroundColor(r);
-}
-hitable* randomScene()
-{
-    // std::vector<hitable*>* list = new std::vector<hitable*>();
-    std::vector<hitable*> list;
-
-    // // OBJ
-    // vec3 objTranslate(0, 0, 1);
-    // float objScale = 0.75;
-    // objl::Loader loader;
-    // bool isLoaded = loader.LoadFile("resources\\teapot.obj");
-    // if (isLoaded) {
-    //     const auto indices = loader.LoadedIndices;
-    //     const auto vertices = loader.LoadedVertices;
-    //     for (int i = 0; i < indices.size(); i += 3) {
-    //         auto p1 = vertices[indices[i]].Position;
-    //         auto p2 = vertices[indices[i + 1]].Position;
-    //         auto p3 = vertices[indices[i + 2]].Position;
-    //         vec3 pp1 = vec3(p1.X, p1.Y, p1.Z) * objScale + objTranslate;
-    //         vec3 pp2 = vec3(p2.X, p2.Y, p2.Z) * objScale + objTranslate;
-    //         vec3 pp3 = vec3(p3.X, p3.Y, p3.Z) * objScale + objTranslate;
-    //         list->push_back(new triangle(pp1, pp2, pp3, new metal(vec3(0.7f, 0.6f, 0.2f),
-    //         0.4f)));
-    //     }
-    // }
+    sceneDescription desc;
+    std::vector<sphereDescription>& list = desc.spheres;
 
     // Sphere-world
-    list.push_back(new sphere(vec3(0, -1000, 0), 1000, new lambertian(vec3(0.5f, 0.5f, 0.5f))));
+    list.push_back({vec3(0, -1000, 0), 1000,
+                    {materialType::lambertian, vec3(0.5f, 0.5f, 0.5f), 0.f}});
     for (int a = -22; a < 22; a++) {
         for (int b = -22; b < 22; b++) {
             float chooseMat = myRandom::next();
             vec3 center(a + 0.9 * myRandom::next(), 0.2f, b + 0.9f * myRandom::next());
-            sphere* sph = nullptr;
             if ((center - vec3(4, 0.2f, 0)).length() > 0.9f) {
                 if (chooseMat < 0.8f) { // diffuse
-                    sph = new sphere(center, 0.2f,
-                                     new lambertian(vec3(myRandom::next() * myRandom::next(),
-                                                         myRandom::next() * myRandom::next(),
-                                                         myRandom::next() * myRandom::next())));
+                    list.push_back({center, 0.2f,
+                                    {materialType::lambertian,
+                                     vec3(myRandom::next() * myRandom::next(),
+                                          myRandom::next() * myRandom::next(),
+                                          myRandom::next() * myRandom::next()),
+                                     0.f}});
                 } else if (chooseMat < 0.95f) { // metal
-                    sph = new sphere(
-                        center, 0.2f,
-                        new metal(vec3(0.5f * (1 + myRandom::next()), 0.5f * (1 + myRandom::next()),
-                                       0.5f * (1 + myRandom::next())),
-                                  0.5f * myRandom::next()));
+                    list.push_back({center, 0.2f,
+                                    {materialType::metal,
+                                     vec3(0.5f * (1 + myRandom::next()),
+                                          0.5f * (1 + myRandom::next()),
+                                          0.5f * (1 + myRandom::next())),
+                                     0.5f * myRandom::next()}});
                 } else { // glass
-                    sph = new sphere(center, 0.2, new dielectric(vec3(1.f, 1.f, 1.f), 1.5f));
+                    list.push_back(
+                        {center, 0.2f, {materialType::dielectric, vec3(1.f, 1.f, 1.f), 1.5f}});
                 }
             }
-            if (sph != nullptr) {
-                list.push_back(sph);
-            }
         }
     }
-    list.push_back(new sphere(vec3(-6, 1.5f, -4), 1.5f, new lambertian(vec3(0.4, 0.2, 0.1))));
-    list.push_back(new sphere(vec3(-2, 1.5f, -4), 1.5f, new dielectric(vec3(1.f, 1.f, 1.f), 1.5)));
-    list.push_back(new sphere(vec3(2, 1.5f, -4), 1.5f, new metal(vec3(0.7, 0.6, 0.5), 0.0)));
-
-    // return new BVH(list);
-    hitable** listArr = new hitable*[list.size()];
-    std::copy(list.begin(), list.end(), listArr);
-    // return new hitableList(listArr, list.size());
-    return new bvhNode(listArr, list.size(), /* isRoot */ true);
+    list.push_back({vec3(-6, 1.5f, -4), 1.5f, {materialType::lambertian, vec3(0.4, 0.2, 0.1), 0.f}});
+    list.push_back({vec3(-2, 1.5f, -4), 1.5f, {materialType::dielectric, vec3(1.f, 1.f, 1.f), 1.5}});
+    list.push_back({vec3(2, 1.5f, -4), 1.5f, {materialType::metal, vec3(0.7, 0.6, 0.5), 0.0}});
+    return desc;
 }
-hitable* randomSceneList()
+hitable* randomScene(const sceneDescription& desc, sceneArena* arena = nullptr)
 {
-    std::vector<hitable*> list;
-
     // // OBJ
     // vec3 objTranslate(0, 0, 1);
     // float objScale = 0.75;
@@ -127,105 +104,33 @@ hitable* randomSceneList()
     //     }
     // }
 
-    // Sphere-world
-    list.push_back(new sphere(vec3(0, -1000, 0), 1000, new lambertian(vec3(0.5f, 0.5f, 0.5f))));
-    for (int a = -22; a < 22; a++) {
-        for (int b = -22; b < 22; b++) {
-            float chooseMat = myRandom::next();
-            vec3 center(a + 0.9 * myRandom::next(), 0.2f, b + 0.9f * myRandom::next());
-            if ((center - vec3(4, 0.2f, 0)).length() > 0.9f) {
-                if (chooseMat < 0.8f) { // diffuse
-                    list.push_back(
-                        new sphere(center, 0.2f,
-                                   new lambertian(vec3(myRandom::next() * myRandom::next(),
-                                                       myRandom::next() * myRandom::next(),
-                                                       myRandom::next() * myRandom::next()))));
-                } else if (chooseMat < 0.95f) { // metal
-                    list.push_back(new sphere(
-                        center, 0.2f,
-                        new metal(vec3(0.5f * (1 + myRandom::next()), 0.5f * (1 + myRandom::next()),
-                                       0.5f * (1 + myRandom::next())),
-                                  0.5f * myRandom::next())));
-                } else { // glass
-                    list.push_back(
-                        new sphere(center, 0.2, new dielectric(vec3(1.f, 1.f, 1.f), 1.5f)));
-                }
-            }
-        }
-    }
-    list.push_back(new sphere(vec3(-6, 1.5f, -4), 1.5f, new lambertian(vec3(0.4, 0.2, 0.1))));
-    list.push_back(new sphere(vec3(-2, 1.5f, -4), 1.5f, new dielectric(vec3(1.f, 1.f, 1.f), 1.5)));
-    list.push_back(new sphere(vec3(2, 1.5f, -4), 1.5f, new metal(vec3(0.7, 0.6, 0.5), 0.0)));
-
-    hitable** listArr = new hitable*[list.size()];
-    std::copy(list.begin(), list.end(), listArr);
-    return new hitableList(listArr, list.size());
+    // return new BVH(list);
+    // return scene::buildList(desc, arena);
+    return scene::buildBvh(desc, arena);
 }
-struct raycastWorldParameters {
-    const float minDistance;
-    const float maxDistance;
-    const unsigned int maxDepth;
-    const unsigned int sampling;
-    const unsigned int width;
-    const unsigned int height;
-    const unsigned int startWidth;
-    const unsigned int endWidth;
-    const unsigned int startHeight;
-    const unsigned int endHeight;
-    const unsigned int channels;
-};
-void raycastWorld(const raycastWorldParameters& params, const hitable* world, const camera& cam,
-                  unsigned char* out)
+hitable* randomSceneList(const sceneDescription& desc, sceneArena* arena = nullptr)
 {
+    return scene::buildList(desc, arena);
+}
+// Frees the scene: one release for an arena-built scene, a recursive delete otherwise.
+void releaseScene(hitable* world, sceneArena& arena)
+{
+    trace::scope span("scene teardown");
     auto t1 = std::chrono::high_resolution_clock::now();
-    std::thread::id threadId = std::this_thread::get_id();
-
-    for (unsigned int j = params.startHeight; j < params.endHeight; ++j) {
-        std::printf("- threadId: %u %u/%u\n", threadId, j, params.height);
-        for (unsigned int i = params.startWidth; i < params.endWidth; ++i) {
-            vec3 col(0.f, 0.f, 0.f);
-            for (unsigned int s = 0; s < params.sampling; ++s) {
-                float u = float(i + myRandom::next()) / float(params.width);
-                float v = float(j + myRandom::next()) / float(params.height);
-                ray r = cam.getRay(u, v);
-                col += color(r, world, params.minDistance, params.maxDistance,
-                             /* depth */ 0, params.maxDepth);
-            }
-            col /= params.sampling;
-
-            // Gamma correction
-            int r = sqrtf(col.x()) * 255.99f;
-            int g = sqrtf(col.y()) * 255.99f;
-            int b = sqrtf(col.z()) * 255.99f;
-
-            int index = ((j * params.width) + i) * params.channels;
-
-            out[index + 0] = (unsigned char)(r);
-            out[index + 1] = (unsigned char)(g);
-            out[index + 2] = (unsigned char)(b);
-            out[index + 3] = (unsigned char)255;
-        }
+    if (arena.blockCount() > 0) {
+        arena.release();
+    } else {
+        delete world;
     }
     auto t2 = std::chrono::high_resolution_clock::now();
-    auto duration = std::chrono::duration_cast<std::chrono::seconds>(t2 - t1).count();
-    std::printf("--------------------------\n"
-                "raycastWorld duration for:\n"
-                " startWidth: %u\n"
-                " endWidth: %u\n"
-                " startHeight: %u\n"
-                " endHeight: %u\n"
-                " maxDepth: %u\n"
-                " sampling: %u\n"
-                " threadId: %u\n"
-                "duration: %u seconds.\n",
-                params.startWidth, params.endWidth, params.startHeight, params.endHeight,
-                params.maxDepth, params.sampling, threadId, duration);
+    std::printf("Scene teardown: %.3f ms.\n",
+                std::chrono::duration_cast<std::chrono::microseconds>(t2 - t1).count() / 1000.0);
 }
 void singlethreadRaycast(const float minDistance, const float maxDistance,
                          const unsigned int maxDepth, const unsigned int sampling,
                          const unsigned int width, const unsigned int height,
                          const unsigned int channels, const hitable* world, const camera& cam,
-                         unsigned char* const data)
+                         float* const data)
 {
     const raycastWorldParameters parameters{.minDistance = minDistance,
                                             .maxDistance = maxDistance,
@@ -237,20 +142,229 @@ void singlethreadRaycast(const float minDistance, const float maxDistance,
                                             .endWidth = width,
                                             .startHeight = 0,
                                             .endHeight = height,
-                                            .channels = channels};
+                                            .channels = channels,
+                                            .outStartHeight = 0};
     raycastWorld(parameters, world, cam, data);
 }
+// Calls renderRow(row) for every row of the image from `threadCount` threads, each taking the
+// next row not started yet.
+template <typename RenderRow>
+void forEachRow(const unsigned int height, unsigned int threadCount, const RenderRow& renderRow)
+{
+    std::vector<std::thread> workers;
+    std::atomic_uint heightIndex(0u);
+    for (unsigned int i = 0; i < threadCount; i++) {
+        workers.push_back(std::thread([height, &renderRow, &heightIndex]() {
+            trace::setThreadName("render worker");
+            while (true) {
+                unsigned int hi = heightIndex++;
+                if (hi >= height) {
+                    break;
+                }
+                renderRow(hi);
+            }
+        }));
+    }
+    for (auto& worker : workers) {
+        worker.join();
+    }
+}
 void multithreadRaycast(const float minDistance, const float maxDistance,
                         const unsigned int maxDepth, const unsigned int sampling,
                         const unsigned int width, const unsigned int height,
                         const unsigned int channels, const hitable* world, const camera& cam,
-                        unsigned char* const data, unsigned int threadCount)
+                        float* const data, unsigned int threadCount)
+{
+    forEachRow(height, threadCount, [&](unsigned int hi) {
+        const raycastWorldParameters parameters{.minDistance = minDistance,
+                                                .maxDistance = maxDistance,
+                                                .maxDepth = maxDepth,
+                                                .sampling = sampling,
+                                                .width = width,
+                                                .height = height,
+                                                .startWidth = 0,
+                                                .endWidth = width,
+                                                .startHeight = hi,
+                                                .endHeight = hi + 1,
+                                                .channels = channels,
+                                                .outStartHeight = 0};
+        raycastWorld(parameters, world, cam, data);
+    });
+}
+void streamingRaycast(const float minDistance, const float maxDistance, const unsigned int maxDepth,
+                      const unsigned int sampling, const unsigned int width,
+                      const unsigned int height, const unsigned int channels,
+                      const hitable* world, const camera& cam, streamingFramebuffer& framebuffer,
+                      unsigned int threadCount)
+{
+    forEachRow(height, threadCount, [&](unsigned int hi) {
+        float* row = framebuffer.acquireRow(hi);
+        const raycastWorldParameters parameters{.minDistance = minDistance,
+                                                .maxDistance = maxDistance,
+                                                .maxDepth = maxDepth,
+                                                .sampling = sampling,
+                                                .width = width,
+                                                .height = height,
+                                                .startWidth = 0,
+                                                .endWidth = width,
+                                                .startHeight = hi,
+                                                .endHeight = hi + 1,
+                                                .channels = channels,
+                                                .outStartHeight = hi};
+        raycastWorld(parameters, world, cam, row);
+        framebuffer.commitRow(hi);
+    });
+}
+// Breadth-first tracing (see wavefront.h). Rows are split into one contiguous band per thread so
+// every wave is large enough for sorting to pay off. Per-thread results are summed into `stats`.
+void wavefrontRaycast(const float minDistance, const float maxDistance, const unsigned int maxDepth,
+                      const unsigned int sampling, const unsigned int width,
+                      const unsigned int height, const unsigned int channels,
+                      const hitable* world, const camera& cam, float* const data,
+                      unsigned int threadCount, bool sortSecondary, unsigned int batchSize,
+                      wavefront::traceStats& stats)
+{
+    std::vector<std::thread> workers;
+    std::vector<wavefront::traceStats> threadStats(threadCount, wavefront::traceStats{0, 0., 0.});
+    const unsigned int rowsPerThread = (height + threadCount - 1) / threadCount;
+    for (unsigned int i = 0; i < threadCount; i++) {
+        const unsigned int startHeight = std::min(height, i * rowsPerThread);
+        const unsigned int endHeight = std::min(height, startHeight + rowsPerThread);
+        workers.push_back(std::thread([=, &cam, &threadStats]() {
+            const raycastWorldParameters parameters{.minDistance = minDistance,
+                                                    .maxDistance = maxDistance,
+                                                    .maxDepth = maxDepth,
+                                                    .sampling = sampling,
+                                                    .width = width,
+                                                    .height = height,
+                                                    .startWidth = 0,
+                                                    .endWidth = width,
+                                                    .startHeight = startHeight,
+                                                    .endHeight = endHeight,
+                                                    .channels = channels,
+                                                    .outStartHeight = 0};
+            wavefront::raycast(parameters, world, cam, data, sortSecondary, batchSize,
+                               threadStats[i]);
+        }));
+    }
+    for (unsigned int i = 0; i < threadCount; i++) {
+        workers[i].join();
+        stats.rays += threadStats[i].rays;
+        stats.sortMilliseconds += threadStats[i].sortMilliseconds;
+        stats.traceMilliseconds += threadStats[i].traceMilliseconds;
+    }
+}
+// Both stages of the ambient-occlusion preview, each over all threads: the probes, then the
+// filter, which needs the rows around its own. The filter's plane tolerance is a tenth of the
+// probe length.
+void aoRaycast(const float minDistance, const float maxDistance, const unsigned int sampling,
+               const unsigned int width, const unsigned int height, const unsigned int channels,
+               const hitable* world, const camera& cam, float* const data,
+               unsigned int threadCount, const unsigned int aoSamples, const float aoRadius)
+{
+    std::vector<aoPixel> pixels(width * height);
+    for (int stage = 0; stage < 2; ++stage) {
+        forEachRow(height, threadCount, [&](unsigned int hi) {
+            const raycastWorldParameters parameters{.minDistance = minDistance,
+                                                    .maxDistance = maxDistance,
+                                                    .maxDepth = 0,
+                                                    .sampling = sampling,
+                                                    .width = width,
+                                                    .height = height,
+                                                    .startWidth = 0,
+                                                    .endWidth = width,
+                                                    .startHeight = hi,
+                                                    .endHeight = hi + 1,
+                                                    .channels = channels,
+                                                    .outStartHeight = 0};
+            if (stage == 0) {
+                raycastAmbientOcclusion(parameters, world, cam, aoSamples, aoRadius,
+                                        pixels.data());
+            } else {
+                filterAmbientOcclusion(parameters, pixels.data(), 0.1f * aoRadius, data);
+            }
+        });
+    }
+}
+// Renders the per-pixel traversal cost of `world` and writes one false-colour PNG per metric,
+// for the primary ray and the whole path: <prefix>_nodes_primary.png and so on. Each image is
+// scaled to its own maximum, which is printed alongside the mean to compare builders. Needs a
+// build with -DRT_TRAVERSAL_STATS, the counters stay zero otherwise.
+void writeTraversalHeatmaps(const char* prefix, const float minDistance, const float maxDistance,
+                            const unsigned int maxDepth, const unsigned int sampling,
+                            const unsigned int width, const unsigned int height,
+                            const hitable* world, const camera& cam, unsigned int threadCount,
+                            unsigned int encodeThreadCount)
+{
+    if (!traversalStats) {
+        std::printf("Traversal heatmaps need a build with -DRT_TRAVERSAL_STATS\n");
+        return;
+    }
+    std::vector<heatmap::pixelCost> costs(width * height);
+    forEachRow(height, threadCount, [&](unsigned int hi) {
+        const raycastWorldParameters parameters{.minDistance = minDistance,
+                                                .maxDistance = maxDistance,
+                                                .maxDepth = maxDepth,
+                                                .sampling = sampling,
+                                                .width = width,
+                                                .height = height,
+                                                .startWidth = 0,
+                                                .endWidth = width,
+                                                .startHeight = hi,
+                                                .endHeight = hi + 1,
+                                                .channels = 4,
+                                                .outStartHeight = 0};
+        heatmap::raycastTraversalCost(parameters, world, cam, costs.data());
+    });
+
+    std::printf("---------------------\n"
+                "Traversal cost per pixel (mean / max):\n");
+    for (int primary = 1; primary >= 0; --primary) {
+        for (unsigned int m = 0; m < heatmap::metricCount; ++m) {
+            const heatmap::summary s = heatmap::summarize(costs, m, primary != 0);
+            std::vector<unsigned char> pixels = heatmap::colorize(costs, m, primary != 0, s.max);
+            png::encodeResult result = png::encode(pixels.data(), width, height, 4,
+                                                   encodeThreadCount);
+            const std::string path = std::string(prefix) + "_" + heatmap::metricName(m) +
+                                     (primary ? "_primary.png" : "_total.png");
+            if (!png::writeFile(path.c_str(), result)) {
+                std::cout << "problem at png::writeFile" << std::endl;
+            }
+            std::printf(" %-10s %-7s %10.1f / %10.1f  -> %s\n", heatmap::metricName(m),
+                        primary ? "primary" : "path", s.mean, s.max, path.c_str());
+        }
+    }
+}
+// Per NUMA node results of numaRaycast.
+struct numaNodeReport {
+    unsigned int threadCount;
+    std::atomic_uint unpinnedThreads; // pinning failed, they ran wherever the scheduler put them
+    std::atomic_ullong rays;
+    std::atomic_llong busyMicroseconds;
+};
+// Like multithreadRaycast, but every worker is pinned to a core and traces against the replica
+// of the scene that lives on its own node. Workers are spread round-robin over the nodes.
+void numaRaycast(const float minDistance, const float maxDistance, const unsigned int maxDepth,
+                 const unsigned int sampling, const unsigned int width, const unsigned int height,
+                 const unsigned int channels, const std::vector<numa::node>& nodes,
+                 const std::vector<hitable*>& replicas, const camera& cam, float* const data,
+                 unsigned int threadCount, std::vector<numaNodeReport>& reports)
 {
     std::vector<std::thread> workers;
     std::atomic_uint heightIndex(0u);
-    for (int i = 0; i < threadCount; i++) {
+    for (unsigned int i = 0; i < threadCount; i++) {
+        const size_t n = i % nodes.size();
+        const unsigned int cpu = nodes[n].cpus[(i / nodes.size()) % nodes[n].cpus.size()];
+        const hitable* world = replicas[n];
+        numaNodeReport* report = &reports[n];
+        report->threadCount++;
         workers.push_back(std::thread([minDistance, maxDistance, maxDepth, sampling, width, height,
-                                       channels, world, cam, data, &heightIndex]() {
+                                       channels, world, cam, data, cpu, report, &heightIndex]() {
+            if (!numa::pinCurrentThread(cpu)) {
+                report->unpinnedThreads++;
+            }
+            auto t1 = std::chrono::high_resolution_clock::now();
+            const unsigned long long raysBefore = tracedRays;
             while (true) {
                 unsigned int hi = heightIndex++;
                 if (hi >= height) {
@@ -266,17 +380,1179 @@ void multithreadRaycast(const float minDistance, const float maxDistance,
                                                         .endWidth = width,
                                                         .startHeight = hi,
                                                         .endHeight = hi + 1,
-                                                        .channels = channels};
+                                                        .channels = channels,
+                                                        .outStartHeight = 0};
                 raycastWorld(parameters, world, cam, data);
             }
+            auto t2 = std::chrono::high_resolution_clock::now();
+            report->rays += tracedRays - raysBefore;
+            report->busyMicroseconds +=
+                std::chrono::duration_cast<std::chrono::microseconds>(t2 - t1).count();
         }));
     }
-    for (int i = 0; i < threadCount; i++) {
-        workers[i].join();
+    for (auto& worker : workers) {
+        worker.join();
+    }
+}
+// Times BVH construction over `count` random small spheres: the recursive bvhNode builder (up to
+// 2M primitives, it gets very slow beyond) and the parallel LBVH builder at 1, 2, 4, ... threads.
+void benchmarkBvhBuild(const std::vector<unsigned int>& counts)
+{
+    const unsigned int maxThreads = std::max(1u, std::thread::hardware_concurrency());
+    for (unsigned int count : counts) {
+        sceneArena arena(64u << 20);
+        material* mat = arena.create<lambertian>(vec3(0.5f, 0.5f, 0.5f));
+        hitable** list = arena.createArray<hitable*>(count);
+        const float extent = cbrtf((float)count) * 2.f;
+        for (unsigned int i = 0; i < count; ++i) {
+            vec3 center((myRandom::next() - 0.5f) * extent, (myRandom::next() - 0.5f) * extent,
+                        (myRandom::next() - 0.5f) * extent);
+            list[i] = arena.create<sphere>(center, 0.2f, mat);
+        }
+        std::printf("---------------------\n"
+                    "BVH build for %u primitives:\n",
+                    count);
+        if (count <= 2000000u) {
+            sceneArena nodes(64u << 20);
+            auto t1 = std::chrono::high_resolution_clock::now();
+            nodes.create<bvhNode>(list, (int)count, false, &nodes);
+            auto t2 = std::chrono::high_resolution_clock::now();
+            std::printf(" recursive, 1 thread: %.3f ms\n",
+                        std::chrono::duration_cast<std::chrono::microseconds>(t2 - t1).count() /
+                            1000.0);
+        } else {
+            std::printf(" recursive: skipped\n");
+        }
+        for (unsigned int threads = 1;; threads = std::min(threads * 2, maxThreads)) {
+            sceneArena nodes(64u << 20);
+            lbvh::buildStats stats{};
+            lbvh::build(list, count, nodes, threads, &stats);
+            std::printf(" lbvh, %u threads: %.3f ms (bounds+morton %.3f, sort %.3f, hierarchy "
+                        "%.3f, refit %.3f)\n",
+                        threads, stats.totalMilliseconds, stats.boundsMilliseconds,
+                        stats.sortMilliseconds, stats.hierarchyMilliseconds,
+                        stats.refitMilliseconds);
+            if (threads == maxThreads) {
+                break;
+            }
+        }
     }
 }
-int main()
+// Bounces the small spheres of the scene for `frames` frames. The BVH is refit every frame and
+// only rebuilt (partially or fully) once its SAH cost has degraded; a full rebuild is timed
+// alongside for comparison. Each frame is encoded to frame_NNN.png while the next is traced.
+void animateScene(const sceneDescription& description, unsigned int frames,
+                  const float minDistance, const float maxDistance, const unsigned int maxDepth,
+                  const unsigned int sampling, const unsigned int width, const unsigned int height,
+                  const unsigned int channels, const camera& cam, unsigned int threadCount,
+                  const resolveParameters& resolveParams, unsigned int encodeThreadCount)
 {
+    sceneArena arena;
+    const unsigned int count = (unsigned int)description.spheres.size();
+    hitable** list = scene::buildHitables(description, &arena);
+    const unsigned int buildThreadCount = std::max(1u, std::thread::hardware_concurrency());
+    dynamicBvh bvh(list, count, buildThreadCount);
+
+    const float bounceHeight = 0.6f;
+    const float frameTime = 1.f / 24.f;
+    std::vector<float> data(width * height * channels);
+    std::future<png::encodeResult> encoding;
+    std::string encodingPath;
+    for (unsigned int frame = 0; frame < frames; ++frame) {
+        const float time = frame * frameTime;
+        auto t1 = std::chrono::high_resolution_clock::now();
+        lbvh::parallelFor(count, buildThreadCount, [&](size_t begin, size_t end, unsigned int) {
+            for (size_t i = begin; i < end; ++i) {
+                const sphereDescription& d = description.spheres[i];
+                if (d.radius > 0.5f) {
+                    continue; // ground and the three big spheres stay put
+                }
+                const float phase = (i * 0.61803398875f) * 2.f * mathx::pi;
+                const float frequency = 2.f + (i % 5) * 0.5f;
+                sphere* s = (sphere*)list[i];
+                s->center[1] = d.center.y() +
+                               bounceHeight * fabsf(sinf(frequency * time + phase));
+            }
+        });
+        auto t2 = std::chrono::high_resolution_clock::now();
+        dynamicBvh::updateStats stats = bvh.update();
+
+        // What rebuilding from scratch every frame would cost.
+        sceneArena scratch(std::max<size_t>(1u << 20, count * sizeof(bvhNode)));
+        auto t3 = std::chrono::high_resolution_clock::now();
+        bvhNode* rebuilt = (bvhNode*)lbvh::build(list, count, scratch, buildThreadCount);
+        auto t4 = std::chrono::high_resolution_clock::now();
+        const float rebuiltCost = rebuilt->sahCost(rebuilt->box.surfaceArea());
+
+        multithreadRaycast(minDistance, maxDistance, maxDepth, sampling, width, height, channels,
+                           bvh.world(), cam, data.data(), threadCount);
+        auto t5 = std::chrono::high_resolution_clock::now();
+
+        std::vector<unsigned char> pixels(width * height * channels);
+        resolve::parallelResolveRgba8(data.data(), pixels.data(), width * height, resolveParams,
+                                      encodeThreadCount);
+        if (encoding.valid() && !png::writeFile(encodingPath.c_str(), encoding.get())) {
+            std::cout << "problem at png::writeFile" << std::endl;
+        }
+        char path[64];
+        std::snprintf(path, sizeof(path), "frame_%03u.png", frame);
+        encodingPath = path;
+        encoding =
+            png::encodeAsync(std::move(pixels), width, height, channels, encodeThreadCount);
+
+        auto ms = [](std::chrono::high_resolution_clock::time_point a,
+                     std::chrono::high_resolution_clock::time_point b) {
+            return std::chrono::duration_cast<std::chrono::microseconds>(b - a).count() / 1000.0;
+        };
+        std::printf("---------------------\n"
+                    "Frame %u:\n"
+                    " move: %.3f ms\n"
+                    " refit: %.3f ms\n"
+                    " update rebuild: %.3f ms (%s, %u subtrees)\n"
+                    " full rebuild reference: %.3f ms\n"
+                    " SAH cost vs last build: %.3f (fresh build: %.3f)\n"
+                    " render: %.3f ms\n",
+                    frame, ms(t1, t2), stats.refitMilliseconds, stats.rebuildMilliseconds,
+                    stats.isFullRebuild ? "full" : "partial", stats.rebuiltSubtrees, ms(t3, t4),
+                    stats.costRatio, rebuiltCost / bvh.cost() * stats.costRatio, ms(t4, t5));
+    }
+    if (encoding.valid() && !png::writeFile(encodingPath.c_str(), encoding.get())) {
+        std::cout << "problem at png::writeFile" << std::endl;
+    }
+}
+// Renders an all-diffuse version of the scene with the wavefront tracer, once in generation order
+// and once with every secondary wave sorted, and reports rays/s and cache misses of each run.
+// The scene uses the LBVH builder so that no per-ray logging ends up in the measurement.
+void benchmarkRaySorting(const sceneDescription& description, const float minDistance,
+                         const float maxDistance, const unsigned int maxDepth,
+                         const unsigned int sampling, const unsigned int width,
+                         const unsigned int height, const unsigned int channels,
+                         const camera& cam, unsigned int threadCount, unsigned int batchSize)
+{
+    sceneDescription diffuse = description;
+    for (sphereDescription& s : diffuse.spheres) {
+        s.mat = materialDescription{materialType::lambertian, s.mat.color, 0.f};
+    }
+    sceneArena arena;
+    hitable* world = scene::buildLinearBvh(diffuse, arena, threadCount);
+    std::vector<float> data(width * height * channels);
+
+    perf::cacheCounters counters;
+    if (!counters.available()) {
+        std::printf("perf counters unavailable, reporting rays/s only\n");
+    }
+    for (int sorted = 0; sorted < 2; ++sorted) {
+        wavefront::traceStats stats{0, 0., 0.};
+        counters.start();
+        auto t1 = std::chrono::high_resolution_clock::now();
+        wavefrontRaycast(minDistance, maxDistance, maxDepth, sampling, width, height, channels,
+                         world, cam, data.data(), threadCount, sorted != 0, batchSize, stats);
+        auto t2 = std::chrono::high_resolution_clock::now();
+        const perf::cacheCounts counts = counters.stop();
+        const double seconds =
+            std::chrono::duration_cast<std::chrono::microseconds>(t2 - t1).count() / 1e6;
+        std::printf("---------------------\n"
+                    "Wavefront raycast, sorted secondary rays: %d\n"
+                    " threadCount: %u\n"
+                    " batchSize: %u\n"
+                    " rays: %llu\n"
+                    " rays/s: %.0f (tracing only: %.0f)\n"
+                    " sort: %.3f ms\n"
+                    " cache references: %lld\n"
+                    " cache misses: %lld\n"
+                    " L1D read misses: %lld\n"
+                    "duration: %.3f s.\n",
+                    sorted, threadCount, batchSize, stats.rays, stats.rays / seconds,
+                    stats.rays / (stats.traceMilliseconds / 1000.0 / threadCount),
+                    stats.sortMilliseconds, counts.references, counts.misses, counts.l1dMisses,
+                    seconds);
+    }
+}
+// Forwards closest-hit queries only, so occluded() falls back to hit() with a full record.
+class closestHitOnly : public hitable
+{
+  public:
+    closestHitOnly(const hitable* inner) : inner(inner) {}
+    virtual bool hit(const ray& r, float tMin, float tMax, hitRecord& rec) const
+    {
+        return inner->hit(r, tMin, tMax, rec);
+    }
+    virtual aabb boundingBox() const { return inner->boundingBox(); }
+    virtual vec3 centeroid() const { return inner->centeroid(); }
+    const hitable* inner;
+};
+// Times full shading against the ambient-occlusion preview, with the any-hit occluded() queries
+// and with closest-hit queries in their place. Uses the LBVH builder, whose root does not log.
+void benchmarkAmbientOcclusion(const sceneDescription& description, const float minDistance,
+                               const float maxDistance, const unsigned int maxDepth,
+                               const unsigned int sampling, const unsigned int width,
+                               const unsigned int height, const unsigned int channels,
+                               const camera& cam, unsigned int threadCount,
+                               const unsigned int aoSamples, const float aoRadius)
+{
+    sceneArena arena;
+    hitable* world = scene::buildLinearBvh(description, arena, threadCount);
+    closestHitOnly closestWorld(world);
+    std::vector<float> data(width * height * channels);
+    auto ms = [](std::chrono::high_resolution_clock::time_point a,
+                 std::chrono::high_resolution_clock::time_point b) {
+        return std::chrono::duration_cast<std::chrono::microseconds>(b - a).count() / 1000.0;
+    };
+
+    auto t1 = std::chrono::high_resolution_clock::now();
+    multithreadRaycast(minDistance, maxDistance, maxDepth, sampling, width, height, channels,
+                       world, cam, data.data(), threadCount);
+    auto t2 = std::chrono::high_resolution_clock::now();
+    aoRaycast(minDistance, maxDistance, sampling, width, height, channels, &closestWorld, cam,
+              data.data(), threadCount, aoSamples, aoRadius);
+    auto t3 = std::chrono::high_resolution_clock::now();
+    aoRaycast(minDistance, maxDistance, sampling, width, height, channels, world, cam,
+              data.data(), threadCount, aoSamples, aoRadius);
+    auto t4 = std::chrono::high_resolution_clock::now();
+
+    std::printf("---------------------\n"
+                "Ambient occlusion benchmark (%ux%u, sampling %u, aoSamples %u, aoRadius %.2f):\n"
+                " full shading, maxDepth %u: %.3f ms\n"
+                " ao, closest-hit queries: %.3f ms\n"
+                " ao, any-hit queries: %.3f ms (%.2fx faster than closest-hit)\n",
+                width, height, sampling, aoSamples, aoRadius, maxDepth, ms(t1, t2), ms(t2, t3),
+                ms(t3, t4), ms(t2, t3) / ms(t3, t4));
+}
+// Per-operation and end-to-end timings of the vec3 backend this binary was built with (scalar, or
+// 4-lane with -DRT_VEC3_SIMD). Build both ways and compare the reports.
+void benchmarkVec3(const sceneDescription& description, const float minDistance,
+                   const float maxDistance, const unsigned int maxDepth,
+                   const unsigned int sampling, const unsigned int width,
+                   const unsigned int height, const unsigned int channels, const camera& cam,
+                   unsigned int threadCount)
+{
+    const unsigned int count = 1u << 16;
+    const unsigned int repeats = 200u;
+    std::vector<vec3> a(count), b(count), out(count);
+    std::vector<float> scalars(count);
+    for (unsigned int i = 0; i < count; ++i) {
+        a[i] = vec3(myRandom::next(), myRandom::next(), myRandom::next()) + 0.1f;
+        b[i] = vec3(myRandom::next(), myRandom::next(), myRandom::next()) + 0.1f;
+    }
+    std::printf("---------------------\n"
+                "vec3 backend: %s (sizeof %zu, alignof %zu, trivially copyable: %d)\n",
+                vec3::backend(), sizeof(vec3), alignof(vec3),
+                (int)std::is_trivially_copyable<vec3>::value);
+    auto report = [&](const char* name, auto op) {
+        auto t1 = std::chrono::high_resolution_clock::now();
+        for (unsigned int r = 0; r < repeats; ++r) {
+            for (unsigned int i = 0; i < count; ++i) {
+                op(i);
+            }
+        }
+        auto t2 = std::chrono::high_resolution_clock::now();
+        std::printf(" %-10s %.3f ns/op\n", name,
+                    std::chrono::duration_cast<std::chrono::nanoseconds>(t2 - t1).count() /
+                        double(count * repeats));
+    };
+    report("add", [&](unsigned int i) { out[i] = a[i] + b[i]; });
+    report("mul", [&](unsigned int i) { out[i] = a[i] * b[i]; });
+    report("madd", [&](unsigned int i) { out[i] += a[i] * 0.5f; });
+    report("dot", [&](unsigned int i) { scalars[i] = vec3::dot(a[i], b[i]); });
+    report("cross", [&](unsigned int i) { out[i] = vec3::cross(a[i], b[i]); });
+    report("normalize", [&](unsigned int i) { out[i] = a[i].normalized(); });
+    report("ray point", [&](unsigned int i) { out[i] = ray(a[i], b[i]).getPoint(2.f); });
+    float checksum = 0.f;
+    for (unsigned int i = 0; i < count; ++i) {
+        checksum += out[i].x() + scalars[i];
+    }
+
+    sceneArena arena;
+    hitable* world = scene::buildLinearBvh(description, arena, threadCount);
+    std::vector<float> data(width * height * channels);
+    auto t1 = std::chrono::high_resolution_clock::now();
+    multithreadRaycast(minDistance, maxDistance, maxDepth, sampling, width, height, channels,
+                       world, cam, data.data(), threadCount);
+    auto t2 = std::chrono::high_resolution_clock::now();
+    std::printf("---------------------\n"
+                "vec3 backend %s, render %ux%u, sampling %u, threadCount %u: %.3f ms "
+                "(checksum %g)\n",
+                vec3::backend(), width, height, sampling, threadCount,
+                std::chrono::duration_cast<std::chrono::microseconds>(t2 - t1).count() / 1000.0,
+                checksum);
+}
+// Error at fixed wall-clock time for a few configurations, against a reference of the same
+// seeded scene rendered at `referenceSamples` spp. The reference is cached as a PFM named after
+// the seed, size, depth and sample count, plus a hash of everything else it depends on: the
+// camera, the distance range, the scene description and convergence::referenceVersion. Results
+// go to convergence.csv.
+void benchmarkConvergence(const std::vector<double>& budgets, unsigned int sceneSeed,
+                          unsigned int referenceSamples, const float minDistance,
+                          const float maxDistance, const unsigned int maxDepth,
+                          const unsigned int width, const unsigned int height,
+                          const unsigned int channels, const cameraParameters& camParams,
+                          unsigned int threadCount, unsigned int wavefrontBatchSize)
+{
+    myRandom::seed(sceneSeed);
+    const sceneDescription description = randomSceneDescription();
+    const camera cam(camParams);
+    sceneArena lbvhArena;
+    const hitable* lbvhWorld = scene::buildLinearBvh(description, lbvhArena, threadCount);
+    sceneArena bvhArena;
+    hitable** list = scene::buildHitables(description, &bvhArena);
+    const hitable* bvhWorld =
+        bvhArena.create<bvhNode>(list, (int)description.spheres.size(), false, &bvhArena);
+
+    contentHash key;
+    key.add(convergence::referenceVersion);
+    key.add(camParams);
+    key.add(minDistance);
+    key.add(maxDistance);
+    key.add(description);
+    char referencePath[160];
+    std::snprintf(referencePath, sizeof(referencePath),
+                  "reference_s%u_%ux%u_d%u_%uspp_%016llx.pfm", sceneSeed, width, height, maxDepth,
+                  referenceSamples, (unsigned long long)key.value);
+    std::vector<float> reference;
+    unsigned int referenceWidth = 0, referenceHeight = 0;
+    if (!pfm::read(referencePath, referenceWidth, referenceHeight, reference, channels) ||
+        referenceWidth != width || referenceHeight != height) {
+        std::printf("Rendering reference %s ...\n", referencePath);
+        auto t1 = std::chrono::high_resolution_clock::now();
+        std::vector<float> pass(width * height * channels);
+        reference.assign(width * height * channels, 0.f);
+        for (unsigned int s = 0; s < referenceSamples; ++s) {
+            convergence::renderPass(minDistance, maxDistance, maxDepth, width, height, channels,
+                                    lbvhWorld, cam, pass.data(), threadCount);
+            for (size_t k = 0; k < reference.size(); ++k) {
+                reference[k] += pass[k] / referenceSamples;
+            }
+        }
+        auto t2 = std::chrono::high_resolution_clock::now();
+        std::printf("Reference: %.3f s.\n",
+                    std::chrono::duration_cast<std::chrono::milliseconds>(t2 - t1).count() /
+                        1000.0);
+        if (!pfm::write(referencePath, width, height, reference.data(), channels)) {
+            std::cout << "problem at pfm::write" << std::endl;
+        }
+    } else {
+        std::printf("Using cached reference %s\n", referencePath);
+    }
+
+    const std::vector<std::pair<std::string, std::function<void(float*)>>> configurations = {
+        {"bvh",
+         [&](float* out) {
+             convergence::renderPass(minDistance, maxDistance, maxDepth, width, height, channels,
+                                     bvhWorld, cam, out, threadCount);
+         }},
+        {"lbvh",
+         [&](float* out) {
+             convergence::renderPass(minDistance, maxDistance, maxDepth, width, height, channels,
+                                     lbvhWorld, cam, out, threadCount);
+         }},
+        {"lbvh wavefront sorted",
+         [&](float* out) {
+             wavefront::traceStats stats{0, 0., 0.};
+             wavefrontRaycast(minDistance, maxDistance, maxDepth, 1, width, height, channels,
+                              lbvhWorld, cam, out, threadCount, true, wavefrontBatchSize, stats);
+         }},
+    };
+    std::remove("convergence.csv");
+    for (const auto& configuration : configurations) {
+        std::vector<convergence::budgetResult> results = convergence::run(
+            configuration.second, reference.data(), width, height, channels, budgets);
+        std::printf("---------------------\n"
+                    "Convergence of %s (threadCount %u):\n",
+                    configuration.first.c_str(), threadCount);
+        for (const convergence::budgetResult& r : results) {
+            std::printf(" %8.1f ms: %4u spp, rmse %.5f, relMSE %.5f\n", r.budgetMilliseconds,
+                        r.samples, r.error.rmse, r.error.relMse);
+        }
+        if (!convergence::appendCsv("convergence.csv", configuration.first, results)) {
+            std::cout << "problem at convergence::appendCsv" << std::endl;
+        }
+    }
+}
+// Build time, memory and rays/s of the recursive BVH, the LBVH and the uniform grid on the same
+// scene. Memory is what the structure adds on top of the primitives and materials. Rays are
+// traced with the (unsorted) wavefront tracer, which counts them.
+void benchmarkAccelerators(const sceneDescription& description, const float minDistance,
+                           const float maxDistance, const unsigned int maxDepth,
+                           const unsigned int sampling, const unsigned int width,
+                           const unsigned int height, const unsigned int channels,
+                           const camera& cam, unsigned int threadCount)
+{
+    sceneArena primitives;
+    hitable** list = scene::buildHitables(description, &primitives);
+    const unsigned int count = (unsigned int)description.spheres.size();
+    std::vector<hitable*> order(list, list + count);
+    std::vector<float> data(width * height * channels);
+    const char* names[3] = {"bvh (recursive)", "lbvh", "uniform grid"};
+    for (int a = 0; a < 3; ++a) {
+        // Builders may reorder the list; every one starts from the same order.
+        std::copy(order.begin(), order.end(), list);
+        sceneArena nodes;
+        auto t1 = std::chrono::high_resolution_clock::now();
+        hitable* world = nullptr;
+        size_t bytes = 0;
+        if (a == 0) {
+            world = nodes.create<bvhNode>(list, (int)count, false, &nodes);
+            bytes = nodes.bytesUsed;
+        } else if (a == 1) {
+            world = lbvh::build(list, count, nodes, threadCount);
+            bytes = nodes.bytesUsed;
+        } else {
+            uniformGrid* grid = nodes.create<uniformGrid>(list, count, &nodes);
+            world = grid;
+            bytes = nodes.bytesUsed;
+            std::printf("---------------------\n"
+                        "Grid: %d x %d x %d cells, %u primitives, %u big objects, %zu cell "
+                        "references\n",
+                        grid->resolution[0], grid->resolution[1], grid->resolution[2],
+                        grid->primitiveCount, grid->bigObjectCount, grid->cellPrimitiveCount);
+        }
+        auto t2 = std::chrono::high_resolution_clock::now();
+        wavefront::traceStats stats{0, 0., 0.};
+        wavefrontRaycast(minDistance, maxDistance, maxDepth, sampling, width, height, channels,
+                         world, cam, data.data(), threadCount, false, 1u << 16, stats);
+        auto t3 = std::chrono::high_resolution_clock::now();
+        const double seconds =
+            std::chrono::duration_cast<std::chrono::microseconds>(t3 - t2).count() / 1e6;
+        std::printf("---------------------\n"
+                    "%s:\n"
+                    " build: %.3f ms\n"
+                    " memory: %zu bytes\n"
+                    " rays: %llu\n"
+                    " rays/s: %.0f\n",
+                    names[a],
+                    std::chrono::duration_cast<std::chrono::microseconds>(t2 - t1).count() /
+                        1000.0,
+                    bytes, stats.rays, stats.rays / seconds);
+    }
+}
+// Spheres with image textures served by a textureCache of `budgetBytes`. Without images, writes
+// `generatedCount` procedural 1024x1024 ones (texture_<n>.png) first. Reports the cache hit rate
+// and resident bytes against what loading every image at full resolution would take.
+void renderTexturedScene(std::vector<std::string> images, size_t budgetBytes,
+                         unsigned int generatedCount, const float minDistance,
+                         const float maxDistance, const unsigned int maxDepth,
+                         const unsigned int sampling, const unsigned int width,
+                         const unsigned int height, const unsigned int channels, const camera& cam,
+                         float fovDegrees, unsigned int threadCount,
+                         const resolveParameters& resolveParams, unsigned int encodeThreadCount)
+{
+    if (images.empty()) {
+        const unsigned int size = 1024u;
+        std::vector<unsigned char> pixels(size * size * 4);
+        for (unsigned int n = 0; n < generatedCount; ++n) {
+            // Checkerboard with rings, a different hue per image.
+            const vec3 hue(0.5f + 0.5f * cosf(n * 1.7f), 0.5f + 0.5f * cosf(n * 1.7f + 2.1f),
+                           0.5f + 0.5f * cosf(n * 1.7f + 4.2f));
+            for (unsigned int y = 0; y < size; ++y) {
+                for (unsigned int x = 0; x < size; ++x) {
+                    const bool checker = ((x / 64) + (y / 64)) % 2 == 0;
+                    const float dx = (x % 128) - 64.f, dy = (y % 128) - 64.f;
+                    const float ring = 0.5f + 0.5f * cosf(sqrtf(dx * dx + dy * dy) * 0.4f);
+                    const vec3 c = checker ? hue * (0.4f + 0.6f * ring) : vec3(0.9f, 0.9f, 0.9f);
+                    unsigned char* p = pixels.data() + ((size_t)y * size + x) * 4;
+                    p[0] = (unsigned char)(c.x() * 255.99f);
+                    p[1] = (unsigned char)(c.y() * 255.99f);
+                    p[2] = (unsigned char)(c.z() * 255.99f);
+                    p[3] = 255;
+                }
+            }
+            char path[64];
+            std::snprintf(path, sizeof(path), "texture_%u.png", n);
+            if (!png::writeFile(path,
+                                png::encode(pixels.data(), size, size, 4, encodeThreadCount))) {
+                std::cout << "problem at png::writeFile" << std::endl;
+                return;
+            }
+            images.push_back(path);
+        }
+    }
+
+    textureCache cache(budgetBytes);
+    std::vector<imageTexture> textures;
+    auto t1 = std::chrono::high_resolution_clock::now();
+    for (const std::string& image : images) {
+        const int id = cache.add(image.c_str());
+        if (id < 0) {
+            std::printf("Could not read texture %s\n", image.c_str());
+            continue;
+        }
+        textures.push_back(imageTexture(&cache, id));
+    }
+    auto t2 = std::chrono::high_resolution_clock::now();
+    if (textures.empty()) {
+        return;
+    }
+    texture::pixelSpread = fovDegrees * mathx::deg2rad / height;
+
+    sceneArena arena;
+    std::vector<hitable*> list;
+    list.push_back(arena.create<sphere>(vec3(0, -1000, 0), 1000.f,
+                                        arena.create<lambertian>(vec3(0.5f, 0.5f, 0.5f))));
+    unsigned int t = 0;
+    for (int a = -6; a <= 6; a += 2) {
+        for (int b = -6; b <= 6; b += 2) {
+            const imageTexture* tex = &textures[t++ % textures.size()];
+            material* mat = (a + b) % 4 == 0
+                                ? (material*)arena.create<metal>(vec3(1.f, 1.f, 1.f), 0.2f, tex)
+                                : (material*)arena.create<lambertian>(vec3(1.f, 1.f, 1.f), tex);
+            list.push_back(arena.create<sphere>(vec3(a, 0.9f, b), 0.9f, mat));
+        }
+    }
+    hitable* world = lbvh::build(list.data(), (unsigned int)list.size(), arena, threadCount);
+
+    std::vector<float> data(width * height * channels);
+    auto t3 = std::chrono::high_resolution_clock::now();
+    multithreadRaycast(minDistance, maxDistance, maxDepth, sampling, width, height, channels,
+                       world, cam, data.data(), threadCount);
+    auto t4 = std::chrono::high_resolution_clock::now();
+    std::vector<unsigned char> pixels(width * height * channels);
+    resolve::parallelResolveRgba8(data.data(), pixels.data(), width * height, resolveParams,
+                                  encodeThreadCount);
+    if (!png::writeFile("textures.png",
+                        png::encode(pixels.data(), width, height, channels, encodeThreadCount))) {
+        std::cout << "problem at png::writeFile" << std::endl;
+    }
+
+    const textureCache::stats stats = cache.statistics();
+    std::printf("---------------------\n"
+                "Textured render of %zu textures (%u px tiles):\n"
+                " texture setup: %.3f ms\n"
+                " render: %.3f ms\n"
+                " tile lookups: %llu\n"
+                " hit rate: %.2f%%\n"
+                " tile loads: %llu\n"
+                " evictions: %llu\n"
+                " resident: %zu bytes (peak %zu, budget %zu)\n"
+                " full resolution images: %zu bytes\n",
+                textures.size(), cache.tileSize,
+                std::chrono::duration_cast<std::chrono::microseconds>(t2 - t1).count() / 1000.0,
+                std::chrono::duration_cast<std::chrono::microseconds>(t4 - t3).count() / 1000.0,
+                stats.lookups, stats.lookups > 0 ? 100.0 * stats.hits / stats.lookups : 0.0,
+                stats.misses, stats.evictions, stats.residentBytes, stats.peakResidentBytes,
+                stats.budgetBytes, stats.fullResolutionBytes);
+}
+// Noise against samples per pixel for uniform and importance sampled environment light, both
+// against the same `referenceSamples` spp importance sampled reference. Without an image, writes
+// a procedural sky with a small, very bright sun to sky.hdr first. Results go to
+// environment.csv, the final image of each strategy to environment_<strategy>.png.
+void benchmarkEnvironment(std::string path, unsigned int maxSamples,
+                          unsigned int referenceSamples, const sceneDescription& description,
+                          const float minDistance, const float maxDistance,
+                          const unsigned int maxDepth, const unsigned int width,
+                          const unsigned int height, const unsigned int channels,
+                          const camera& cam, unsigned int threadCount,
+                          const resolveParameters& resolveParams, unsigned int encodeThreadCount)
+{
+    if (path.empty()) {
+        const unsigned int skyWidth = 1024u, skyHeight = 512u;
+        const vec3 sun = vec3(-0.5f, 0.6f, 0.6f).normalized();
+        const float sunCosine = cosf(4.f * mathx::deg2rad);
+        std::vector<float> sky(skyWidth * skyHeight * 3);
+        for (unsigned int y = 0; y < skyHeight; ++y) {
+            for (unsigned int x = 0; x < skyWidth; ++x) {
+                const float theta = (y + 0.5f) * mathx::pi / skyHeight;
+                const float phi = (x + 0.5f) * 2 * mathx::pi / skyWidth - mathx::pi;
+                const vec3 d(sinf(theta) * cosf(phi), cosf(theta), -sinf(theta) * sinf(phi));
+                vec3 c = d.y() > 0 ? vec3(0.3f, 0.5f, 0.9f) * (0.4f + 0.6f * (1 - d.y()))
+                                   : vec3(0.2f, 0.18f, 0.15f);
+                if (vec3::dot(d, sun) > sunCosine) {
+                    c = vec3(100.f, 90.f, 75.f);
+                }
+                float* p = sky.data() + ((size_t)y * skyWidth + x) * 3;
+                p[0] = c.x();
+                p[1] = c.y();
+                p[2] = c.z();
+            }
+        }
+        path = "sky.hdr";
+        if (!stbi_write_hdr(path.c_str(), skyWidth, skyHeight, 3, sky.data())) {
+            std::cout << "problem at stbi_write_hdr" << std::endl;
+            return;
+        }
+    }
+    auto t1 = std::chrono::high_resolution_clock::now();
+    environmentMap* environment = environmentMap::load(path.c_str());
+    auto t2 = std::chrono::high_resolution_clock::now();
+    if (environment == nullptr) {
+        std::printf("Could not read environment map %s\n", path.c_str());
+        return;
+    }
+    std::printf("Environment %s: %ux%u, load and alias table %.3f ms\n", path.c_str(),
+                environment->width, environment->height,
+                std::chrono::duration_cast<std::chrono::microseconds>(t2 - t1).count() / 1000.0);
+    environmentMap::active = environment;
+
+    sceneArena arena;
+    const hitable* world = scene::buildLinearBvh(description, arena, threadCount);
+    const size_t pixelCount = (size_t)width * height;
+    std::vector<float> pass(pixelCount * channels), sum(pixelCount * channels),
+        mean(pixelCount * channels);
+
+    environment->sampling = environmentSampling::importance;
+    std::vector<float> reference(pixelCount * channels, 0.f);
+    for (unsigned int s = 0; s < referenceSamples; ++s) {
+        convergence::renderPass(minDistance, maxDistance, maxDepth, width, height, channels,
+                                world, cam, pass.data(), threadCount);
+        for (size_t k = 0; k < reference.size(); ++k) {
+            reference[k] += pass[k] / referenceSamples;
+        }
+    }
+
+    std::remove("environment.csv");
+    std::FILE* csv = std::fopen("environment.csv", "wb");
+    if (csv != nullptr) {
+        std::fprintf(csv, "sampling,spp,ms,rmse,relmse\n");
+    }
+    const environmentSampling strategies[2] = {environmentSampling::uniform,
+                                               environmentSampling::importance};
+    const char* names[2] = {"uniform", "importance"};
+    for (int k = 0; k < 2; ++k) {
+        environment->sampling = strategies[k];
+        std::fill(sum.begin(), sum.end(), 0.f);
+        std::printf("---------------------\n"
+                    "Environment light, %s sampling (threadCount %u):\n",
+                    names[k], threadCount);
+        double milliseconds = 0.;
+        for (unsigned int s = 1; s <= maxSamples; ++s) {
+            auto t3 = std::chrono::high_resolution_clock::now();
+            convergence::renderPass(minDistance, maxDistance, maxDepth, width, height, channels,
+                                    world, cam, pass.data(), threadCount);
+            auto t4 = std::chrono::high_resolution_clock::now();
+            milliseconds +=
+                std::chrono::duration_cast<std::chrono::microseconds>(t4 - t3).count() / 1000.0;
+            for (size_t p = 0; p < sum.size(); ++p) {
+                sum[p] += pass[p];
+                mean[p] = sum[p] / s;
+            }
+            if ((s & (s - 1)) != 0) {
+                continue; // report powers of two
+            }
+            const convergence::errorMetrics error =
+                convergence::measure(mean.data(), reference.data(), pixelCount, channels);
+            std::printf(" %4u spp: %9.1f ms, rmse %.5f, relMSE %.5f\n", s, milliseconds,
+                        error.rmse, error.relMse);
+            if (csv != nullptr) {
+                std::fprintf(csv, "%s,%u,%.3f,%.6g,%.6g\n", names[k], s, milliseconds,
+                             error.rmse, error.relMse);
+            }
+        }
+        std::vector<unsigned char> pixels(pixelCount * channels);
+        resolve::parallelResolveRgba8(mean.data(), pixels.data(), pixelCount, resolveParams,
+                                      encodeThreadCount);
+        const std::string image = std::string("environment_") + names[k] + ".png";
+        if (!png::writeFile(image.c_str(), png::encode(pixels.data(), width, height, channels,
+                                                       encodeThreadCount))) {
+            std::cout << "problem at png::writeFile" << std::endl;
+        }
+    }
+    if (csv != nullptr) {
+        std::fclose(csv);
+    }
+    environmentMap::active = nullptr;
+    delete environment;
+}
+// Quality against time with the radiance cache: `samples` passes of the scene without the cache
+// and with a few cache settings, each compared with a `referenceSamples` render without it.
+// Every setting starts from an empty cache. Lit by the environment map at `environmentPath`
+// when given, whose shadow rays make every diffuse bounce the cache saves twice as expensive.
+// Writes radiance_cache_<setting>.png.
+void benchmarkRadianceCache(unsigned int samples, unsigned int referenceSamples,
+                            const std::string& environmentPath,
+                            const sceneDescription& description, const float minDistance,
+                            const float maxDistance, const unsigned int maxDepth,
+                            const unsigned int width, const unsigned int height,
+                            const unsigned int channels, const camera& cam,
+                            unsigned int threadCount, const resolveParameters& resolveParams,
+                            unsigned int encodeThreadCount)
+{
+    std::unique_ptr<environmentMap> environment;
+    if (!environmentPath.empty()) {
+        environment.reset(environmentMap::load(environmentPath.c_str()));
+        if (!environment) {
+            std::printf("Could not read environment map %s\n", environmentPath.c_str());
+            return;
+        }
+        environmentMap::active = environment.get();
+    }
+    sceneArena arena;
+    const hitable* world = scene::buildLinearBvh(description, arena, threadCount);
+    const size_t pixelCount = (size_t)width * height;
+    std::vector<float> pass(pixelCount * channels), mean(pixelCount * channels);
+    std::vector<float> reference(pixelCount * channels, 0.f);
+    for (unsigned int s = 0; s < referenceSamples; ++s) {
+        convergence::renderPass(minDistance, maxDistance, maxDepth, width, height, channels,
+                                world, cam, pass.data(), threadCount);
+        for (size_t k = 0; k < reference.size(); ++k) {
+            reference[k] += pass[k] / referenceSamples;
+        }
+    }
+    struct setting {
+        const char* name;
+        bool enabled;
+        radianceCacheSettings params;
+    };
+    const setting settings[] = {
+        {"off", false, {}},
+        {"accurate",
+         true,
+         {.cellSize = 0.1f, .readDepth = 2u, .minSamples = 8u, .tableBits = 18u}},
+        {"balanced",
+         true,
+         {.cellSize = 0.25f, .readDepth = 1u, .minSamples = 4u, .tableBits = 18u}},
+        {"preview",
+         true,
+         {.cellSize = 0.5f, .readDepth = 1u, .minSamples = 4u, .tableBits = 16u}},
+    };
+    std::printf("---------------------\n"
+                "Radiance cache, %u spp against %u spp without it, %s (threadCount %u):\n",
+                samples, referenceSamples,
+                environment ? environmentPath.c_str() : "sky gradient", threadCount);
+    for (const setting& s : settings) {
+        std::unique_ptr<radianceCache> cache;
+        if (s.enabled) {
+            cache.reset(new radianceCache(s.params));
+        }
+        radianceCache::active = cache.get();
+        std::fill(mean.begin(), mean.end(), 0.f);
+        auto t1 = std::chrono::high_resolution_clock::now();
+        for (unsigned int p = 0; p < samples; ++p) {
+            convergence::renderPass(minDistance, maxDistance, maxDepth, width, height, channels,
+                                    world, cam, pass.data(), threadCount);
+            for (size_t k = 0; k < mean.size(); ++k) {
+                mean[k] += pass[k] / samples;
+            }
+        }
+        auto t2 = std::chrono::high_resolution_clock::now();
+        radianceCache::active = nullptr;
+        const convergence::errorMetrics error =
+            convergence::measure(mean.data(), reference.data(), pixelCount, channels);
+        std::printf(" %-8s: %9.1f ms, rmse %.5f, relMSE %.5f", s.name,
+                    std::chrono::duration_cast<std::chrono::microseconds>(t2 - t1).count() / 1000.0,
+                    error.rmse, error.relMse);
+        if (cache) {
+            std::printf(", cell %.2f, read depth %u, min samples %u: hit rate %.1f%%, "
+                        "%zu cells (%zu KiB)",
+                        s.params.cellSize, s.params.readDepth, s.params.minSamples,
+                        100.f * cache->hitRate(), cache->usedCells(), cache->memoryBytes() >> 10);
+        }
+        std::printf("\n");
+        std::vector<unsigned char> pixels(pixelCount * channels);
+        resolve::parallelResolveRgba8(mean.data(), pixels.data(), pixelCount, resolveParams,
+                                      encodeThreadCount);
+        const std::string image = std::string("radiance_cache_") + s.name + ".png";
+        if (!png::writeFile(image.c_str(), png::encode(pixels.data(), width, height, channels,
+                                                       encodeThreadCount))) {
+            std::cout << "problem at png::writeFile" << std::endl;
+        }
+    }
+    environmentMap::active = nullptr;
+}
+// Virtual against compile-time typed dispatch: the random scene and the generated sphere field of
+// `fieldCount` spheres, traced through a lazyBvh expanded up front (hitable* leaves, virtual
+// hit), the LBVH and a typedScene, whose tree has the same splits as the lazyBvh.
+void benchmarkStaticScene(unsigned int fieldCount, const sceneDescription& description,
+                          const float minDistance, const float maxDistance,
+                          const unsigned int maxDepth, const unsigned int sampling,
+                          const unsigned int width, const unsigned int height,
+                          const unsigned int channels, const camera& cam, unsigned int threadCount)
+{
+    std::vector<float> data(width * height * channels);
+    auto ms = [](std::chrono::high_resolution_clock::time_point a,
+                 std::chrono::high_resolution_clock::time_point b) {
+        return std::chrono::duration_cast<std::chrono::microseconds>(b - a).count() / 1000.0;
+    };
+    const sceneParameters params{scene::extentForCount(fieldCount, 1.f), 1.f, 0.8f, 0.15f, 2018u,
+                                 256u};
+    sphereStore store = scene::generateSpheres(params, threadCount);
+    std::vector<ray> cameraRays;
+    for (unsigned int k = 0; k < 4 * width * height; ++k) {
+        cameraRays.push_back(cam.getRay(myRandom::next(), myRandom::next()));
+    }
+    for (int s = 0; s < 2; ++s) {
+        sceneArena primitives(64u << 20);
+        const unsigned int count =
+            s == 0 ? (unsigned int)description.spheres.size() : (unsigned int)store.size();
+        hitable** list = s == 0 ? scene::buildHitables(description, &primitives)
+                                : scene::buildHitables(store, primitives);
+        std::printf("---------------------\n"
+                    "%s, %u spheres:\n",
+                    s == 0 ? "Random scene" : "Sphere field", count);
+        const char* names[3] = {"dynamic (lazy bvh, expanded)", "dynamic (lbvh)",
+                                "static (typed scene)"};
+        // Each accelerator reorders or copies its own list, and all stay alive so the renders
+        // can be interleaved: run to run noise is larger than the differences.
+        sceneArena nodes[3];
+        const hitable* worlds[3];
+        double rates[3] = {0., 0., 0.}, hitRates[3] = {0., 0., 0.};
+        for (int a = 0; a < 3; ++a) {
+            hitable** own = nodes[a].createArray<hitable*>(count);
+            std::copy(list, list + count, own);
+            auto t1 = std::chrono::high_resolution_clock::now();
+            if (a == 0) {
+                lazyBvh* bvh = nodes[a].create<lazyBvh>(own, count, nodes[a], /* leafSize */ 4u);
+                bvh->expandAll();
+                worlds[a] = bvh;
+            } else if (a == 1) {
+                worlds[a] = lbvh::build(own, count, nodes[a], threadCount);
+            } else {
+                worlds[a] = nodes[a].create<typedScene>(own, count, nodes[a]);
+            }
+            auto t2 = std::chrono::high_resolution_clock::now();
+            std::printf(" %-28s: build %9.3f ms, memory %10zu bytes\n", names[a], ms(t1, t2),
+                        nodes[a].bytesUsed - count * sizeof(hitable*));
+        }
+        for (int run = 0; run < 3; ++run) {
+            for (int a = 0; a < 3; ++a) {
+                wavefront::traceStats stats{0, 0., 0.};
+                auto t1 = std::chrono::high_resolution_clock::now();
+                wavefrontRaycast(minDistance, maxDistance, maxDepth, sampling, width, height,
+                                 channels, worlds[a], cam, data.data(), threadCount, false,
+                                 1u << 16, stats);
+                auto t2 = std::chrono::high_resolution_clock::now();
+                rates[a] = std::max(rates[a], stats.rays / (ms(t1, t2) / 1000.0));
+                // Closest hits alone, without shading: traversal and intersection only.
+                unsigned int hits = 0;
+                auto t3 = std::chrono::high_resolution_clock::now();
+                for (const ray& r : cameraRays) {
+                    hitRecord rec;
+                    hits += worlds[a]->hit(r, minDistance, maxDistance, rec) ? 1 : 0;
+                }
+                auto t4 = std::chrono::high_resolution_clock::now();
+                hitRates[a] = std::max(hitRates[a], cameraRays.size() / (ms(t3, t4) / 1000.0));
+            }
+        }
+        for (int a = 0; a < 3; ++a) {
+            std::printf(" %-28s: render %.0f rays/s, camera ray hits %.0f rays/s (best of 3)\n",
+                        names[a], rates[a], hitRates[a]);
+        }
+    }
+}
+// Memory and speed against scene size: the generated sphere field at each count, as a packed
+// store with packedBvh and, up to `hitableLimit` spheres, as polymorphic spheres with the LBVH.
+// Rays are traced with the (unsorted) wavefront tracer, which counts them.
+void benchmarkSceneScale(const std::vector<unsigned int>& counts, unsigned int hitableLimit,
+                         const float minDistance, const float maxDistance,
+                         const unsigned int maxDepth, const unsigned int sampling,
+                         const unsigned int width, const unsigned int height,
+                         const unsigned int channels, const camera& cam, unsigned int threadCount)
+{
+    std::vector<float> data(width * height * channels);
+    auto ms = [](std::chrono::high_resolution_clock::time_point a,
+                 std::chrono::high_resolution_clock::time_point b) {
+        return std::chrono::duration_cast<std::chrono::microseconds>(b - a).count() / 1000.0;
+    };
+    auto render = [&](const hitable* world) {
+        wavefront::traceStats stats{0, 0., 0.};
+        auto t1 = std::chrono::high_resolution_clock::now();
+        wavefrontRaycast(minDistance, maxDistance, maxDepth, sampling, width, height, channels,
+                         world, cam, data.data(), threadCount, false, 1u << 16, stats);
+        auto t2 = std::chrono::high_resolution_clock::now();
+        return stats.rays / (ms(t1, t2) / 1000.0);
+    };
+    for (unsigned int count : counts) {
+        const sceneParameters params{scene::extentForCount(count, 1.f), 1.f, 0.8f, 0.15f, 2018u,
+                                     256u};
+        auto t1 = std::chrono::high_resolution_clock::now();
+        sphereStore store = scene::generateSpheres(params, threadCount);
+        auto t2 = std::chrono::high_resolution_clock::now();
+        sceneArena nodes(64u << 20);
+        packedBvh* bvh = nodes.create<packedBvh>(store, nodes, threadCount);
+        auto t3 = std::chrono::high_resolution_clock::now();
+        const double packedRate = render(bvh);
+        const size_t packedBytes = store.memoryBytes() + nodes.bytesUsed;
+        std::printf("---------------------\n"
+                    "Scene of %zu spheres (extent %.1f):\n"
+                    " generate: %.3f ms\n"
+                    " packed: store %zu + bvh %zu bytes = %.1f bytes/sphere, build %.3f ms, "
+                    "%.0f rays/s\n",
+                    store.size(), params.extent, ms(t1, t2), store.memoryBytes(),
+                    nodes.bytesUsed, (double)packedBytes / store.size(), ms(t2, t3), packedRate);
+        if (count > hitableLimit) {
+            std::printf(" hitable + lbvh: skipped\n");
+            continue;
+        }
+        sceneArena arena(64u << 20);
+        auto t4 = std::chrono::high_resolution_clock::now();
+        hitable** list = scene::buildHitables(store, arena);
+        const size_t primitiveBytes = arena.bytesUsed;
+        hitable* world = lbvh::build(list, (unsigned int)store.size(), arena, threadCount);
+        auto t5 = std::chrono::high_resolution_clock::now();
+        std::printf(" hitable + lbvh: primitives %zu + bvh %zu bytes = %.1f bytes/sphere, "
+                    "build %.3f ms, %.0f rays/s\n",
+                    primitiveBytes, arena.bytesUsed - primitiveBytes,
+                    (double)arena.bytesUsed / store.size(), ms(t4, t5), render(world));
+    }
+}
+// Renders through the asynchronous API, printing progress while it runs. With
+// `cancelAfterMilliseconds`, cancels the job then and reports how long the workers took to stop;
+// otherwise writes the finished image to async.png.
+void asyncRender(const sceneDescription& description, int cancelAfterMilliseconds,
+                 const renderSettings& settings, const camera& cam,
+                 const resolveParameters& resolveParams, unsigned int encodeThreadCount)
+{
+    sceneArena arena;
+    const hitable* world = scene::buildLinearBvh(description, arena, settings.threadCount);
+    std::atomic_uint tiles(0u);
+    auto t1 = std::chrono::high_resolution_clock::now();
+    std::unique_ptr<renderJob> job =
+        renderJob::submit(world, cam, settings, [&tiles](const renderTile&) { tiles++; });
+    if (job == nullptr) {
+        std::printf("Invalid render settings.\n");
+        return;
+    }
+    auto elapsed = [&t1]() {
+        return std::chrono::duration_cast<std::chrono::microseconds>(
+                   std::chrono::high_resolution_clock::now() - t1)
+                   .count() /
+               1000.0;
+    };
+    while (job->state() == renderJob::status::running) {
+        if (cancelAfterMilliseconds >= 0 && elapsed() >= cancelAfterMilliseconds) {
+            const double cancelAt = elapsed();
+            job->cancel();
+            job->wait();
+            std::printf("Cancelled at %.3f ms (%.1f%%), workers stopped after %.3f ms\n",
+                        cancelAt, 100.f * job->progress(), elapsed() - cancelAt);
+            break;
+        }
+        std::printf("%8.3f ms: %5.1f%% (%u tiles delivered)\n", elapsed(),
+                    100.f * job->progress(), tiles.load());
+        std::this_thread::sleep_for(std::chrono::milliseconds(20));
+    }
+    if (job->wait() != renderJob::status::completed) {
+        return;
+    }
+    std::printf("Completed in %.3f ms, %u of %u tiles delivered\n", elapsed(), tiles.load(),
+                job->tileCount);
+    std::vector<unsigned char> pixels(settings.width * settings.height * 4);
+    resolve::parallelResolveRgba8(job->image().data(), pixels.data(),
+                                  settings.width * settings.height, resolveParams,
+                                  encodeThreadCount);
+    if (!png::writeFile("async.png", png::encode(pixels.data(), settings.width, settings.height,
+                                                 4, encodeThreadCount))) {
+        std::cout << "problem at png::writeFile" << std::endl;
+    }
+}
+// Time to first pixel with a BVH built on demand: the generated sphere field of `count`
+// spheres traced through the asynchronous API, once as a preview (quarter size, one sample) and
+// once in full, over a lazyBvh that is either expanded completely before the render (eager) or
+// expanded by the rays (lazy). Times run from the start of the build; the first pixel is the
+// first finished tile. The LBVH build is shown for reference.
+void benchmarkLazyBvh(unsigned int count, const renderSettings& full, const camera& cam)
+{
+    auto ms = [](std::chrono::high_resolution_clock::time_point a,
+                 std::chrono::high_resolution_clock::time_point b) {
+        return std::chrono::duration_cast<std::chrono::microseconds>(b - a).count() / 1000.0;
+    };
+    const sceneParameters params{scene::extentForCount(count, 1.f), 1.f, 0.8f, 0.15f, 2018u, 256u};
+    sphereStore store = scene::generateSpheres(params, full.threadCount);
+    sceneArena primitives(64u << 20);
+    hitable** list = scene::buildHitables(store, primitives);
+    const unsigned int size = (unsigned int)store.size();
+    {
+        sceneArena nodes(64u << 20);
+        auto t1 = std::chrono::high_resolution_clock::now();
+        lbvh::build(list, size, nodes, full.threadCount);
+        auto t2 = std::chrono::high_resolution_clock::now();
+        std::printf("---------------------\n"
+                    "Scene of %u spheres, lbvh build for reference: %.3f ms\n",
+                    size, ms(t1, t2));
+    }
+    renderSettings preview = full;
+    preview.width = std::max(1u, full.width / 4);
+    preview.height = std::max(1u, full.height / 4);
+    preview.sampling = 1;
+    const renderSettings* passes[] = {&preview, &full};
+    for (const renderSettings* settings : passes) {
+        std::printf("%s render %ux%u, %u spp:\n", settings == &preview ? "Preview" : "Full",
+                    settings->width, settings->height, settings->sampling);
+        for (bool eager : {true, false}) {
+            sceneArena nodes(16u << 20);
+            std::atomic_bool firstTile(false);
+            std::chrono::high_resolution_clock::time_point firstPixel;
+            auto t1 = std::chrono::high_resolution_clock::now();
+            lazyBvh* bvh = nodes.create<lazyBvh>(list, size, nodes);
+            if (eager) {
+                bvh->expandAll();
+            }
+            auto t2 = std::chrono::high_resolution_clock::now();
+            const unsigned int builtNodes = bvh->expandedNodes;
+            std::unique_ptr<renderJob> job =
+                renderJob::submit(bvh, cam, *settings, [&](const renderTile&) {
+                    if (!firstTile.exchange(true)) {
+                        firstPixel = std::chrono::high_resolution_clock::now();
+                    }
+                });
+            job->wait();
+            auto t3 = std::chrono::high_resolution_clock::now();
+            std::printf(" %s: build %.3f ms (%u nodes), first pixel %.3f ms, total %.3f ms, "
+                        "%u nodes expanded\n",
+                        eager ? "eager" : "lazy ", ms(t1, t2), builtNodes, ms(t1, firstPixel),
+                        ms(t1, t3), bvh->expandedNodes.load());
+        }
+    }
+}
+// Look-dev loop through the tile cache in `directory`: the scene rendered, rendered again
+// unchanged, with the material of the small sphere nearest the image centre changed and with a
+// small sphere off to the side of the frame moved, each timed against a full render. The cache
+// persists, so a second run finds the first frames on disk. Writes lookdev.png.
+void lookDev(const std::string& directory, sceneDescription description,
+             const cameraParameters& camParams, const renderSettings& settings,
+             float influenceRadius, float reflectionRadius, const resolveParameters& resolveParams,
+             unsigned int encodeThreadCount)
+{
+    const camera cam(camParams);
+    auto ms = [](std::chrono::high_resolution_clock::time_point a,
+                 std::chrono::high_resolution_clock::time_point b) {
+        return std::chrono::duration_cast<std::chrono::microseconds>(b - a).count() / 1000.0;
+    };
+    // Screen position of a point, the frame spans [-1, 1] on both axes.
+    const float halfHeight = tanf(camParams.fov * mathx::deg2rad / 2);
+    const float halfWidth = camParams.aspectRatio * halfHeight;
+    auto project = [&](const vec3& p, float& x, float& y) {
+        const vec3 d = p - cam.origin;
+        const float z = vec3::dot(d, cam.direction);
+        x = vec3::dot(d, cam.right) / (z * halfWidth);
+        y = vec3::dot(d, cam.up) / (z * halfHeight);
+        return z > 0.f;
+    };
+    size_t centre = 0, side = 0;
+    float centreDistance = FLT_MAX, sideDistance = 0.f;
+    for (size_t i = 0; i < description.spheres.size(); ++i) {
+        const sphereDescription& s = description.spheres[i];
+        float x, y;
+        if (s.radius > 1.f || !project(s.center, x, y)) {
+            continue;
+        }
+        if (s.mat.type == materialType::lambertian && x * x + y * y < centreDistance) {
+            centreDistance = x * x + y * y;
+            centre = i;
+        }
+        if (fabsf(x) > sideDistance) {
+            sideDistance = fabsf(x);
+            side = i;
+        }
+    }
+
+    tileRenderCache cache(directory, influenceRadius, reflectionRadius);
+    std::vector<float> image;
+    const char* steps[4] = {"initial", "unchanged", "material tweak", "moved object"};
+    std::printf("---------------------\n"
+                "Look-dev through the tile cache in %s (influence radius %.2f, reflection "
+                "radius %.2f):\n",
+                directory.c_str(), influenceRadius, reflectionRadius);
+    for (int step = 0; step < 4; ++step) {
+        if (step == 2) {
+            description.spheres[centre].mat.color = vec3(0.9f, 0.1f, 0.1f);
+        } else if (step == 3) {
+            description.spheres[side].center += vec3(0.f, 0.f, 0.3f);
+        }
+        sceneArena arena;
+        auto t1 = std::chrono::high_resolution_clock::now();
+        const hitable* world = scene::buildLinearBvh(description, arena, settings.threadCount);
+        auto t2 = std::chrono::high_resolution_clock::now();
+        const tileRenderCache::result r =
+            cache.render(description, world, camParams, settings, image);
+        auto t3 = std::chrono::high_resolution_clock::now();
+        std::unique_ptr<renderJob> full = renderJob::submit(world, cam, settings);
+        full->wait();
+        auto t4 = std::chrono::high_resolution_clock::now();
+        std::printf(" %-14s: %3u of %u tiles rendered, keys %.3f ms, tiles %.3f ms, total %.3f "
+                    "ms (full render %.3f ms)\n",
+                    steps[step], r.rendered, r.tiles, r.keyMilliseconds, r.renderMilliseconds,
+                    ms(t1, t3), ms(t1, t2) + ms(t3, t4));
+    }
+    std::vector<unsigned char> pixels(settings.width * settings.height * 4);
+    resolve::parallelResolveRgba8(image.data(), pixels.data(), settings.width * settings.height,
+                                  resolveParams, encodeThreadCount);
+    if (!png::writeFile("lookdev.png", png::encode(pixels.data(), settings.width,
+                                                   settings.height, 4, encodeThreadCount))) {
+        std::cout << "problem at png::writeFile" << std::endl;
+    }
+}
+// Hit candidates and records written per camera ray and per path, by accelerator: closest-hit
+// queries for camera rays alone, then whole paths through color(). Single threaded, as the
+// counters are per thread. Needs a build with -DRT_TRAVERSAL_STATS.
+void benchmarkHitCopies(const sceneDescription& description, const float minDistance,
+                        const float maxDistance, const unsigned int maxDepth,
+                        const unsigned int width, const unsigned int height, const camera& cam)
+{
+    if (!traversalStats) {
+        std::printf("Hit copy counts need a build with -DRT_TRAVERSAL_STATS\n");
+        return;
+    }
+    auto ms = [](std::chrono::high_resolution_clock::time_point a,
+                 std::chrono::high_resolution_clock::time_point b) {
+        return std::chrono::duration_cast<std::chrono::microseconds>(b - a).count() / 1000.0;
+    };
+    std::vector<ray> cameraRays;
+    for (unsigned int k = 0; k < 4 * width * height; ++k) {
+        cameraRays.push_back(cam.getRay(myRandom::next(), myRandom::next()));
+    }
+    const char* names[4] = {"lbvh", "lazy bvh", "uniform grid", "static (typed scene)"};
+    sceneArena arenas[4];
+    const hitable* worlds[4];
+    worlds[0] = scene::buildLinearBvh(description, arenas[0], 1u);
+    hitable** list = scene::buildHitables(description, &arenas[1]);
+    lazyBvh* bvh = arenas[1].create<lazyBvh>(list, (unsigned int)description.spheres.size(),
+                                             arenas[1], /* leafSize */ 4u);
+    bvh->expandAll();
+    worlds[1] = bvh;
+    worlds[2] = scene::buildGrid(description, &arenas[2]);
+    worlds[3] = scene::buildStatic(description, arenas[3]);
+    std::printf("Hit copies per camera ray and per path, %zu spheres, %zu camera rays:\n",
+                description.spheres.size(), cameraRays.size());
+    for (int a = 0; a < 4; ++a) {
+        hitCopies = hitCopyCounters{0, 0, 0};
+        auto t1 = std::chrono::high_resolution_clock::now();
+        for (const ray& r : cameraRays) {
+            hitRecord rec;
+            worlds[a]->hit(r, minDistance, maxDistance, rec);
+        }
+        auto t2 = std::chrono::high_resolution_clock::now();
+        const double rays = (double)cameraRays.size();
+        std::printf(" %-20s camera: %.2f candidates, %.2f records, %6.1f bytes, %.0f rays/s\n",
+                    names[a], hitCopies.candidates / rays, hitCopies.records / rays,
+                    hitCopies.bytes / rays, rays / (ms(t1, t2) / 1000.0));
+        hitCopies = hitCopyCounters{0, 0, 0};
+        t1 = std::chrono::high_resolution_clock::now();
+        for (const ray& r : cameraRays) {
+            color(r, worlds[a], minDistance, maxDistance, /* depth */ 0, maxDepth);
+        }
+        t2 = std::chrono::high_resolution_clock::now();
+        std::printf(" %-20s path  : %.2f candidates, %.2f records, %6.1f bytes, %.0f paths/s\n",
+                    names[a], hitCopies.candidates / rays, hitCopies.records / rays,
+                    hitCopies.bytes / rays, rays / (ms(t1, t2) / 1000.0));
+    }
+}
+int main(int argc, char** argv)
+{
+    // Distributed rendering:
+    //   main worker <port> [threadCount]
+    //   main coordinator <host:port> [<host:port> ...]
+    const std::string mode = argc > 1 ? argv[1] : "";
+    if (mode == "worker") {
+        unsigned short port = argc > 2 ? (unsigned short)std::atoi(argv[2]) : 9000;
+        unsigned int workerThreadCount =
+            argc > 3 ? std::atoi(argv[3]) : std::max(1u, std::thread::hardware_concurrency());
+        return distributed::runWorker(port, workerThreadCount);
+    }
+    // BVH build benchmark: main bench-bvh [primitiveCount ...], defaults to 1M and 10M.
+    if (mode == "bench-bvh") {
+        std::vector<unsigned int> counts;
+        for (int i = 2; i < argc; ++i) {
+            counts.push_back(std::atoi(argv[i]));
+        }
+        if (counts.empty()) {
+            counts = {1000000u, 10000000u};
+        }
+        benchmarkBvhBuild(counts);
+        return 0;
+    }
+    const bool isCoordinator = mode == "coordinator";
+    const unsigned int distributedTileSize = 32u;
+    const unsigned int workerTimeoutSeconds = 120u;
+
     const float minDistance = 0.001f;
     const float maxDistance = 10000.f;
     const unsigned int maxDepth = 40u;
@@ -285,29 +1561,390 @@ int main()
     // Output image data
     const unsigned int width = 200u;
     const unsigned int height = 120u;
-    const unsigned int channels = 4u; // STBI_rgb_alpha
+    const unsigned int channels = 4u; // STBI_rgb_alpha, also rgba floats in the HDR buffer
 
     // Multi-threading
     const unsigned int threadCount = 1;
     // std::thread::hardware_concurrency();
     const unsigned int outputSize = width * height * channels;
 
+    // Resolve and output: the render writes linear floats, the resolve stage applies exposure,
+    // tonemap and gamma. PNG strips are deflated on `encodeThreadCount` threads.
+    const resolveParameters resolveParams{.exposure = 1.f, .tonemap = tonemapOperator::clamp};
+    const bool writePfm = false;
+    const unsigned int encodeThreadCount = std::max(1u, std::thread::hardware_concurrency());
+
+    // NUMA: pin workers to cores, one scene replica per node (or a single shared copy).
+    const bool numaPinning = false;
+    const bool numaReplicateScene = true;
+
+    // Scene memory: primitives, materials and BVH nodes in one arena, released all at once.
+    const bool useSceneArena = true;
+    // Parallel Morton-code BVH builder instead of the recursive one (needs the arena).
+    const bool parallelBvhBuild = false;
+    // Uniform grid (grid.h) instead of a BVH; compare both with: main bench-accel [threadCount]
+    const bool useUniformGrid = false;
+    // Typed primitive arrays with non-virtual intersection (staticScene.h) instead of a BVH of
+    // hitable pointers; compare with: main bench-static [sphereCount]
+    const bool useStaticScene = false;
+    // Generated sphere field in a packed store (sphereStore.h) with its own BVH (packedBvh.h)
+    // instead of the random scene; scale it with: main bench-scale [sphereCount ...]
+    const bool packedScene = false;
+    const sceneParameters packedSceneParams{.extent = 22.f,
+                                            .density = 1.f,
+                                            .diffuseFraction = 0.8f,
+                                            .metalFraction = 0.15f,
+                                            .seed = 2018u,
+                                            .paletteSize = 256u};
+
+    // Radiance cache (radianceCache.h): diffuse bounces from readDepth on end in a world-space
+    // cache filled by earlier samples. Biased, for previews; only color() based renders use it.
+    // Compare settings with: main bench-cache [spp]
+    const bool useRadianceCache = false;
+    const radianceCacheSettings radianceCacheParams{
+        .cellSize = 0.25f, .readDepth = 1u, .minSamples = 4u, .tableBits = 18u};
+
+    // Streaming output: rows are flushed to a PPM as they finish and only `streamWindowRows`
+    // rows are kept in memory, instead of the whole image.
+    const bool streamOutput = false;
+    const unsigned int streamWindowRows = 2u * threadCount;
+
+    // Wavefront tracing: paths advance one bounce at a time in batches, secondary rays can be
+    // sorted by direction octant and origin before each bounce (see wavefront.h).
+    const bool wavefrontRender = false;
+    const bool sortSecondaryRays = true;
+    const unsigned int wavefrontBatchSize = 1u << 16;
+
+    // Timeline of scene build, BVH build, every tile, resolve, encode and write, exported as
+    // Chrome trace-event JSON (open in chrome://tracing or ui.perfetto.dev).
+    const bool traceTimeline = false;
+
+    // Traversal-cost heatmaps (nodes visited, box and primitive tests) written next to test.png;
+    // needs a build with -DRT_TRAVERSAL_STATS.
+    const bool traversalHeatmaps = false;
+    if (traceTimeline) {
+        trace::enable();
+        trace::setThreadName("main");
+    }
+
+    // Ambient-occlusion preview instead of full shading: one primary ray per pixel and
+    // `aoSamples` visibility probes of length `aoRadius` per 2x2 pixels, filtered over 3x3.
+    const bool ambientOcclusionRender = false;
+    const unsigned int aoSamples = 4u;
+    const float aoRadius = 2.f;
+
     // Camera
     vec3 lookFrom(26, 4, 6);
     vec3 lookAt(0, 0, 0);
     float distanceToFocus = 20.0;
     float aperture = 0.1;
-    camera cam(lookFrom, lookAt, /* up */ vec3(0, 1, 0), /* fov */ 20, (float)width / height,
-               aperture, distanceToFocus);
+    const cameraParameters camParams{lookFrom,      lookAt,   /* up */ vec3(0, 1, 0),
+                                     /* fov */ 20, (float)width / height, aperture,
+                                     distanceToFocus};
+    camera cam(camParams);
+
+    // Animation: main animate [frameCount]
+    if (mode == "animate") {
+        animateScene(randomSceneDescription(), argc > 2 ? std::atoi(argv[2]) : 24, minDistance,
+                     maxDistance, maxDepth, sampling, width, height, channels, cam, threadCount,
+                     resolveParams, encodeThreadCount);
+        return 0;
+    }
+    // Secondary ray sorting benchmark: main bench-sort [threadCount]
+    if (mode == "bench-sort") {
+        benchmarkRaySorting(randomSceneDescription(), minDistance, maxDistance, maxDepth, sampling,
+                            width, height, channels, cam,
+                            argc > 2 ? std::atoi(argv[2]) : threadCount, wavefrontBatchSize);
+        return 0;
+    }
+
+    // Ambient occlusion benchmark: main bench-ao [threadCount]
+    if (mode == "bench-ao") {
+        benchmarkAmbientOcclusion(randomSceneDescription(), minDistance, maxDistance, maxDepth,
+                                  sampling, width, height, channels, cam,
+                                  argc > 2 ? std::atoi(argv[2]) : threadCount, aoSamples,
+                                  aoRadius);
+        return 0;
+    }
+
+    // vec3 backend benchmark: main bench-vec3 [threadCount]
+    if (mode == "bench-vec3") {
+        benchmarkVec3(randomSceneDescription(), minDistance, maxDistance, maxDepth, sampling,
+                      width, height, channels, cam, argc > 2 ? std::atoi(argv[2]) : threadCount);
+        return 0;
+    }
+
+    // Acceleration structure comparison: main bench-accel [threadCount]
+    if (mode == "bench-accel") {
+        benchmarkAccelerators(randomSceneDescription(), minDistance, maxDistance, maxDepth,
+                              sampling, width, height, channels, cam,
+                              argc > 2 ? std::atoi(argv[2]) : threadCount);
+        return 0;
+    }
+    // Image textures through the tile cache: main textures [budgetKiB] [image ...]
+    if (mode == "textures") {
+        renderTexturedScene(std::vector<std::string>(argv + std::min(argc, 3), argv + argc),
+                            (argc > 2 ? std::atoi(argv[2]) : 1024) * size_t(1024),
+                            /* generatedCount */ 8u, minDistance, maxDistance, maxDepth,
+                            sampling, width, height, channels, cam, camParams.fov, threadCount,
+                            resolveParams, encodeThreadCount);
+        return 0;
+    }
+    // Environment light sampling comparison: main env [maxSpp] [image.hdr]
+    if (mode == "env") {
+        benchmarkEnvironment(argc > 3 ? argv[3] : "", argc > 2 ? std::atoi(argv[2]) : 64u,
+                             /* referenceSamples */ 256u, randomSceneDescription(), minDistance,
+                             maxDistance, maxDepth, width, height, channels, cam,
+                             std::max(1u, std::thread::hardware_concurrency()), resolveParams,
+                             encodeThreadCount);
+        return 0;
+    }
+    // Radiance cache quality and time: main bench-cache [spp] [environment.hdr]
+    if (mode == "bench-cache") {
+        benchmarkRadianceCache(argc > 2 ? std::atoi(argv[2]) : 16u, /* referenceSamples */ 256u,
+                               argc > 3 ? argv[3] : "", randomSceneDescription(), minDistance,
+                               maxDistance, maxDepth, width, height, channels, cam,
+                               std::max(1u, std::thread::hardware_concurrency()), resolveParams,
+                               encodeThreadCount);
+        return 0;
+    }
+    // Virtual against typed dispatch: main bench-static [sphereCount], defaults to 1M.
+    if (mode == "bench-static") {
+        benchmarkStaticScene(argc > 2 ? std::atoi(argv[2]) : 1000000u, randomSceneDescription(),
+                             minDistance, maxDistance, maxDepth, sampling, width, height,
+                             channels, cam, std::max(1u, std::thread::hardware_concurrency()));
+        return 0;
+    }
+    // Scene size scaling: main bench-scale [sphereCount ...], defaults to 100k, 1M and 10M.
+    if (mode == "bench-scale") {
+        std::vector<unsigned int> counts;
+        for (int i = 2; i < argc; ++i) {
+            counts.push_back(std::atoi(argv[i]));
+        }
+        if (counts.empty()) {
+            counts = {100000u, 1000000u, 10000000u};
+        }
+        benchmarkSceneScale(counts, /* hitableLimit */ 2000000u, minDistance, maxDistance,
+                            maxDepth, sampling, width, height, channels, cam,
+                            std::max(1u, std::thread::hardware_concurrency()));
+        return 0;
+    }
+    // Asynchronous render API: main async [cancelAfterMilliseconds]
+    if (mode == "async") {
+        const renderSettings settings{.minDistance = minDistance,
+                                      .maxDistance = maxDistance,
+                                      .maxDepth = maxDepth,
+                                      .sampling = sampling,
+                                      .width = width,
+                                      .height = height,
+                                      .tileSize = 16u,
+                                      .threadCount =
+                                          std::max(1u, std::thread::hardware_concurrency())};
+        asyncRender(randomSceneDescription(), argc > 2 ? std::atoi(argv[2]) : -1, settings, cam,
+                    resolveParams, encodeThreadCount);
+        return 0;
+    }
+    // Lazy BVH time to first pixel: main bench-lazy [sphereCount], defaults to 1M.
+    if (mode == "bench-lazy") {
+        const renderSettings settings{.minDistance = minDistance,
+                                      .maxDistance = maxDistance,
+                                      .maxDepth = maxDepth,
+                                      .sampling = sampling,
+                                      .width = width,
+                                      .height = height,
+                                      .tileSize = 16u,
+                                      .threadCount =
+                                          std::max(1u, std::thread::hardware_concurrency())};
+        benchmarkLazyBvh(argc > 2 ? std::atoi(argv[2]) : 1000000u, settings, cam);
+        return 0;
+    }
+    // Look-dev with the persistent tile cache, every edit invalidating every tile unless radii are
+    // given: main lookdev [cacheDirectory] [influenceRadius] [reflectionRadius]
+    if (mode == "lookdev") {
+        const renderSettings settings{.minDistance = minDistance,
+                                      .maxDistance = maxDistance,
+                                      .maxDepth = maxDepth,
+                                      .sampling = sampling,
+                                      .width = width,
+                                      .height = height,
+                                      .tileSize = 16u,
+                                      .threadCount =
+                                          std::max(1u, std::thread::hardware_concurrency())};
+        // The same scene in every run, so its tiles are found on disk.
+        myRandom::seed(2018u);
+        lookDev(argc > 2 ? argv[2] : "tilecache", randomSceneDescription(), camParams, settings,
+                argc > 3 ? (float)std::atof(argv[3]) : INFINITY,
+                argc > 4 ? (float)std::atof(argv[4]) : INFINITY,
+                resolveParams, encodeThreadCount);
+        return 0;
+    }
+    // Hit candidate and record traffic per ray (build with -DRT_TRAVERSAL_STATS): main bench-hits
+    if (mode == "bench-hits") {
+        benchmarkHitCopies(randomSceneDescription(), minDistance, maxDistance, maxDepth, width,
+                           height, cam);
+        return 0;
+    }
+    // Convergence benchmark: main converge [budgetMilliseconds ...]
+    if (mode == "converge") {
+        std::vector<double> budgets;
+        for (int i = 2; i < argc; ++i) {
+            budgets.push_back(std::atof(argv[i]));
+        }
+        if (budgets.empty()) {
+            budgets = {100., 200., 400., 800., 1600.};
+        }
+        std::sort(budgets.begin(), budgets.end());
+        benchmarkConvergence(budgets, /* sceneSeed */ 2018u, /* referenceSamples */ 1024u,
+                             minDistance, maxDistance, maxDepth, width, height, channels,
+                             camParams, std::max(1u, std::thread::hardware_concurrency()),
+                             wavefrontBatchSize);
+        return 0;
+    }
 
     // Scene
-    hitable* world = randomScene();
-    // hitable* world = randomSceneList();
-    unsigned char* const data = new unsigned char[outputSize];
+    const sceneDescription description = randomSceneDescription();
+    sceneArena arena;
+    sphereStore store;
+    auto t0 = std::chrono::high_resolution_clock::now();
+    const long long sceneSpan = trace::begin();
+    hitable* world = nullptr;
+    if (isCoordinator) {
+        // The coordinator only ships the description, workers build their own copy.
+    } else if (packedScene) {
+        const unsigned int buildThreadCount = std::max(1u, std::thread::hardware_concurrency());
+        store = scene::generateSpheres(packedSceneParams, buildThreadCount);
+        world = arena.create<packedBvh>(store, arena, buildThreadCount);
+    } else if (useStaticScene && useSceneArena) {
+        world = scene::buildStatic(description, arena);
+    } else if (useUniformGrid) {
+        world = scene::buildGrid(description, useSceneArena ? &arena : nullptr);
+    } else if (parallelBvhBuild && useSceneArena) {
+        world = scene::buildLinearBvh(description, arena,
+                                      std::max(1u, std::thread::hardware_concurrency()));
+    } else {
+        world = randomScene(description, useSceneArena ? &arena : nullptr);
+        // world = randomSceneList(description, useSceneArena ? &arena : nullptr);
+    }
+    trace::complete("scene build", sceneSpan);
+    auto t01 = std::chrono::high_resolution_clock::now();
+    std::printf("---------------------\n"
+                "Scene build for:\n"
+                " spheres: %zu\n"
+                " arena: %u\n"
+                " allocations: %zu\n"
+                " bytesUsed: %zu\n"
+                " bytesReserved: %zu\n"
+                " blocks: %zu\n"
+                "duration: %.3f ms.\n",
+                packedScene ? store.size() : description.spheres.size(), useSceneArena,
+                arena.allocationCount,
+                arena.bytesUsed, arena.bytesReserved, arena.blockCount(),
+                std::chrono::duration_cast<std::chrono::microseconds>(t01 - t0).count() / 1000.0);
+
+    std::unique_ptr<radianceCache> cache;
+    if (useRadianceCache) {
+        cache.reset(new radianceCache(radianceCacheParams));
+        radianceCache::active = cache.get();
+    }
+
+    if (streamOutput && !isCoordinator) {
+        ppmStreamWriter writer("test.ppm", width, height);
+        // ppmStreamWriter writer("out.ppm", width, height);
+        if (!writer.isOpen()) {
+            std::cout << "problem at ppmStreamWriter" << std::endl;
+            releaseScene(world, arena);
+            return 1;
+        }
+        streamingFramebuffer framebuffer(writer, channels, streamWindowRows, resolveParams);
+
+        auto t1 = std::chrono::high_resolution_clock::now();
+        streamingRaycast(minDistance, maxDistance, maxDepth, sampling, width, height, channels,
+                         world, cam, framebuffer, threadCount);
+        auto t2 = std::chrono::high_resolution_clock::now();
+
+        std::printf("---------------------\n"
+                    "Streaming raycast duration for:\n"
+                    " width: %u\n"
+                    " height: %u\n"
+                    " maxDepth: %u\n"
+                    " sampling: %u\n"
+                    " threadCount: %u\n"
+                    " windowRows: %u\n"
+                    " residentBytes: %zu (full image: %zu)\n"
+                    " rowsFlushed: %u\n"
+                    "duration: %.3f ms.\n",
+                    width, height, maxDepth, sampling, threadCount, streamWindowRows,
+                    framebuffer.residentBytes(), outputSize * sizeof(float),
+                    framebuffer.flushed(),
+                    std::chrono::duration_cast<std::chrono::microseconds>(t2 - t1).count() /
+                        1000.0);
+        if (framebuffer.failed()) {
+            std::cout << "problem at ppmStreamWriter::writeRows" << std::endl;
+        }
+
+        releaseScene(world, arena);
+        return 0;
+    }
+
+    float* const data = new float[outputSize];
 
     auto t1 = std::chrono::high_resolution_clock::now();
+    const long long renderSpan = trace::begin();
 
-    if (threadCount == 1) {
+    if (isCoordinator) {
+        const std::vector<std::string> endpoints(argv + 2, argv + argc);
+        const distributed::renderSettings settings{minDistance, maxDistance, maxDepth,
+                                                   sampling,    width,       height};
+        std::vector<distributed::workerStats> stats;
+        bool ok = distributed::raycast(endpoints, settings, camParams, description,
+                                       distributedTileSize, workerTimeoutSeconds, data,
+                                       channels, stats);
+        distributed::printStats(stats, sampling);
+        if (!ok) {
+            std::cout << "problem at distributed::raycast" << std::endl;
+            delete[] data;
+            return 1;
+        }
+    } else if (numaPinning) {
+        const std::vector<numa::node> nodes = numa::discover();
+        std::vector<hitable*> replicas(nodes.size(), world);
+        if (numaReplicateScene) {
+            replicas = numa::replicateScene(
+                nodes, description, [](const sceneDescription& d) { return randomScene(d); });
+        }
+        std::vector<numaNodeReport> reports(nodes.size());
+        numaRaycast(minDistance, maxDistance, maxDepth, sampling, width, height, channels, nodes,
+                    replicas, cam, data, threadCount, reports);
+        std::printf("---------------------\n"
+                    "NUMA raycast per node (replicated scene: %u):\n",
+                    numaReplicateScene);
+        for (size_t n = 0; n < nodes.size(); ++n) {
+            const numa::placement p = numa::queryPlacement(replicas[n], nodes[n].id);
+            const double seconds = reports[n].busyMicroseconds / 1e6 /
+                                   std::max(1u, reports[n].threadCount);
+            std::printf(" node %u: cpus: %zu, threads: %u (%u could not be pinned)\n"
+                        "  scene objects local: %zu, remote: %zu, unknown: %zu%s\n"
+                        "  rays: %llu, %.0f rays/s\n",
+                        nodes[n].id, nodes[n].cpus.size(), reports[n].threadCount,
+                        reports[n].unpinnedThreads.load(), p.local, p.remote, p.unknown,
+                        p.queried ? "" : " (page placement could not be queried)",
+                        reports[n].rays.load(), seconds > 0 ? reports[n].rays / seconds : 0.);
+            if (replicas[n] != world) {
+                delete replicas[n];
+            }
+        }
+    } else if (ambientOcclusionRender) {
+        aoRaycast(minDistance, maxDistance, sampling, width, height, channels, world, cam, data,
+                  threadCount, aoSamples, aoRadius);
+    } else if (wavefrontRender) {
+        wavefront::traceStats stats{0, 0., 0.};
+        wavefrontRaycast(minDistance, maxDistance, maxDepth, sampling, width, height, channels,
+                         world, cam, data, threadCount, sortSecondaryRays, wavefrontBatchSize,
+                         stats);
+        std::printf("---------------------\n"
+                    "Wavefront rays: %llu, sort: %.3f ms, trace: %.3f ms\n",
+                    stats.rays, stats.sortMilliseconds, stats.traceMilliseconds);
+    } else if (threadCount == 1) {
         singlethreadRaycast(minDistance, maxDistance, maxDepth, sampling, width, height, channels,
                             world, cam, data);
     } else {
@@ -315,6 +1952,7 @@ int main()
                            world, cam, data, threadCount);
     }
 
+    trace::complete("render", renderSpan);
     auto t2 = std::chrono::high_resolution_clock::now();
 
     auto duration = std::chrono::duration_cast<std::chrono::seconds>(t2 - t1).count();
@@ -328,14 +1966,65 @@ int main()
                 "duration: %u seconds.\n",
                 width, height, maxDepth, sampling, threadCount, duration);
 
-    int ret = stbi_write_png("test.png", width, height, channels, data, channels * width);
-    // int ret = stbi_write_png("out.png", width, height, channels, data, channels * width);
-    if (ret == 0) {
-        std::cout << "problem at stbi_write_png" << std::endl;
+    auto t3 = std::chrono::high_resolution_clock::now();
+    std::vector<unsigned char> pixels(outputSize);
+    resolve::parallelResolveRgba8(data, pixels.data(), width * height, resolveParams,
+                                  encodeThreadCount);
+    auto t4 = std::chrono::high_resolution_clock::now();
+
+    // The encoder owns the resolved pixels, so it runs while the HDR buffer is written out, the
+    // heatmaps are rendered and the scene is released.
+    std::future<png::encodeResult> encoded =
+        png::encodeAsync(std::move(pixels), width, height, channels, encodeThreadCount);
+
+    const long long pfmSpan = writePfm ? trace::begin() : -1;
+    if (writePfm && !pfm::write("test.pfm", width, height, data, channels)) {
+        // if (writePfm && !pfm::write("out.pfm", width, height, data, channels)) {
+        std::cout << "problem at pfm::write" << std::endl;
     }
+    trace::complete("pfm write", pfmSpan);
 
-    delete world;
+    if (traversalHeatmaps && world != nullptr) {
+        writeTraversalHeatmaps("test", minDistance, maxDistance, maxDepth, sampling, width,
+                               height, world, cam, threadCount, encodeThreadCount);
+    }
+
+    releaseScene(world, arena);
     delete[] data;
 
+    const long long waitSpan = trace::begin();
+    png::encodeResult result = encoded.get();
+    trace::complete("wait for encode", waitSpan);
+
+    auto t5 = std::chrono::high_resolution_clock::now();
+    bool ret = png::writeFile("test.png", result);
+    // bool ret = png::writeFile("out.png", result);
+    if (!ret) {
+        std::cout << "problem at png::writeFile" << std::endl;
+    }
+    auto t6 = std::chrono::high_resolution_clock::now();
+
+    std::printf("---------------------\n"
+                "Output duration for:\n"
+                " encodeThreadCount: %u\n"
+                " pngChunks: %u\n"
+                " pngBytes: %zu\n"
+                "resolve: %.3f ms.\n"
+                "encode: %.3f ms.\n"
+                "write: %.3f ms.\n",
+                encodeThreadCount, result.chunkCount, result.bytes.size(),
+                std::chrono::duration_cast<std::chrono::microseconds>(t4 - t3).count() / 1000.0,
+                result.encodeMilliseconds,
+                std::chrono::duration_cast<std::chrono::microseconds>(t6 - t5).count() / 1000.0);
+
+    if (traceTimeline) {
+        size_t recorded, dropped;
+        trace::counts(recorded, dropped);
+        std::printf("Trace: %zu events (%zu dropped) written to trace.json\n", recorded, dropped);
+        if (!trace::writeJson("trace.json")) {
+            std::cout << "problem at trace::writeJson" << std::endl;
+        }
+    }
+
     return 0;
 }
\ No newline at end of file
@@ -8,8 +8,12 @@ class hitRecord;
 class material
 {
   public:
+    virtual ~material() {}
     virtual bool scatter(const ray& incoming, const hitRecord& rec, vec3& attuenation,
                          ray& scattered) const = 0;
+    // Albedo of the Lambertian lobe at `rec`, for explicit light sampling. False when the
+    // material has none, its light then only arrives through scatter().
+    virtual bool diffuse(const hitRecord& /* rec */, vec3& /* albedo */) const { return false; }
 
   protected:
     static vec3 reflect(const vec3& incoming, const vec3& normal)
@@ -3,38 +3,64 @@
 
 #include "hitable.h"
 #include "material.h"
+#include "texture.h"
+
+// Footprint of a hit in uv units: the width of the path's ray cone over the primitive's world
+// units per uv unit.
+inline float textureFootprint(const hitRecord& rec) { return textureCone.width / rec.uvScale; }
 
 class lambertian : public material
 {
   public:
-    lambertian(const vec3& albedo) : albedo(albedo){};
-    virtual bool scatter(const ray& incoming, const hitRecord& rec, vec3& attenuation,
+    lambertian(const vec3& albedo, const texture* tex = nullptr) : albedo(albedo), tex(tex){};
+    virtual bool scatter(const ray& /* incoming */, const hitRecord& rec, vec3& attenuation,
                          ray& scattered) const
     {
         vec3 target = rec.point + rec.normal + myRandom::nextInUnitSphere();
         scattered = ray(rec.point, target - rec.point);
         attenuation = albedo;
+        if (tex != nullptr) {
+            attenuation *= tex->value(rec.u, rec.v, textureFootprint(rec));
+        }
+        // Diffuse bounces spread over the hemisphere; a cone of about 1 radian is enough to
+        // send them to the coarse levels.
+        textureCone.spread = std::max(textureCone.spread, 1.f);
         return true;
     };
+    virtual bool diffuse(const hitRecord& rec, vec3& albedo) const
+    {
+        albedo = this->albedo;
+        if (tex != nullptr) {
+            albedo *= tex->value(rec.u, rec.v, textureFootprint(rec));
+        }
+        return true;
+    }
 
     vec3 albedo;
+    const texture* tex; // multiplies albedo when set; not owned
 };
 
 class metal : public material
 {
   public:
-    metal(const vec3& albedo, float fuzz) : albedo(albedo), fuzz(std::min(1.f, fuzz)){};
+    metal(const vec3& albedo, float fuzz, const texture* tex = nullptr)
+        : albedo(albedo), fuzz(std::min(1.f, fuzz)), tex(tex){};
     virtual bool scatter(const ray& incoming, const hitRecord& rec, vec3& attenuation,
                          ray& scattered) const
     {
         vec3 reflected = material::reflect(incoming.direction.normalized(), rec.normal);
         scattered = ray(rec.point, reflected + fuzz * myRandom::nextInUnitSphere());
         attenuation = albedo;
+        if (tex != nullptr) {
+            attenuation *= tex->value(rec.u, rec.v, textureFootprint(rec));
+        }
+        textureCone.spread += fuzz;
         return vec3::dot(scattered.direction, rec.normal) > 0.f;
     };
 
     vec3 albedo;
     float fuzz;
+    const texture* tex; // multiplies albedo when set; not owned
 };
 
 class dielectric : public material
@@ -5,9 +5,13 @@
 #include "vec3.h"
 #include <random>
 
+// Every thread draws from its own generator, seeded from std::random_device when the thread
+// first uses it, so render threads never share generator state.
 class myRandom
 {
   public:
+    // Same sequence on the calling thread, and so the same random scene, for the same seed.
+    static void seed(unsigned int s) { e2.seed(s); }
     static float next() { return dist1(e2); };
     static float nextCostheta() { return distCostheta(e2); }
     static float nextPhi() { return distPhi(e2); }
@@ -30,19 +34,15 @@ class myRandom
     };
 
   private:
-    static std::random_device rd;
-    static std::mt19937 e2;
-    static std::uniform_real_distribution<float> dist1;
-    static std::uniform_real_distribution<float> distCostheta;
-    static std::uniform_real_distribution<float> distPhi;
+    static std::mt19937 seeded()
+    {
+        std::random_device rd;
+        return std::mt19937(rd());
+    }
+    static inline thread_local std::mt19937 e2 = seeded();
+    static inline thread_local std::uniform_real_distribution<float> dist1{0.f, 1.f};
+    static inline thread_local std::uniform_real_distribution<float> distCostheta{-1.f, 1.f};
+    static inline thread_local std::uniform_real_distribution<float> distPhi{0.f, 2 * mathx::pi};
 };
 
-std::random_device myRandom::rd;
-std::mt19937 myRandom::e2 = std::mt19937(myRandom::rd());
-std::uniform_real_distribution<float> myRandom::dist1 = std::uniform_real_distribution<float>(0, 1);
-std::uniform_real_distribution<float> myRandom::distCostheta =
-    std::uniform_real_distribution<float>(-1, 1);
-std::uniform_real_distribution<float> myRandom::distPhi =
-    std::uniform_real_distribution<float>(0, 2 * mathx::pi);
-
 #endif
\ No newline at end of file
@@ -0,0 +1,224 @@
+#ifndef NET_H
+#define NET_H
+
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#ifdef _WIN32
+#include <winsock2.h>
+#include <ws2tcpip.h>
+typedef SOCKET socketHandle;
+const static socketHandle invalidSocket = INVALID_SOCKET;
+#else
+#include <arpa/inet.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <unistd.h>
+typedef int socketHandle;
+const static socketHandle invalidSocket = -1;
+#endif
+
+// Minimal blocking TCP helpers and a length-prefixed message framing on top of them.
+namespace net
+{
+inline bool startup()
+{
+#ifdef _WIN32
+    WSADATA data;
+    return WSAStartup(MAKEWORD(2, 2), &data) == 0;
+#else
+    return true;
+#endif
+}
+
+inline void closeSocket(socketHandle s)
+{
+    if (s == invalidSocket) {
+        return;
+    }
+#ifdef _WIN32
+    closesocket(s);
+#else
+    close(s);
+#endif
+}
+
+inline void setOptions(socketHandle s, unsigned int receiveTimeoutSeconds)
+{
+    int one = 1;
+    setsockopt(s, IPPROTO_TCP, TCP_NODELAY, (const char*)&one, sizeof(one));
+    if (receiveTimeoutSeconds > 0) {
+#ifdef _WIN32
+        DWORD timeout = receiveTimeoutSeconds * 1000;
+#else
+        timeval timeout{(time_t)receiveTimeoutSeconds, 0};
+#endif
+        setsockopt(s, SOL_SOCKET, SO_RCVTIMEO, (const char*)&timeout, sizeof(timeout));
+    }
+}
+
+inline socketHandle listenOn(unsigned short port)
+{
+    socketHandle s = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+    if (s == invalidSocket) {
+        return invalidSocket;
+    }
+    int one = 1;
+    setsockopt(s, SOL_SOCKET, SO_REUSEADDR, (const char*)&one, sizeof(one));
+    sockaddr_in address;
+    std::memset(&address, 0, sizeof(address));
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = htonl(INADDR_ANY);
+    address.sin_port = htons(port);
+    if (bind(s, (sockaddr*)&address, sizeof(address)) != 0 || listen(s, 4) != 0) {
+        closeSocket(s);
+        return invalidSocket;
+    }
+    return s;
+}
+
+inline socketHandle acceptFrom(socketHandle listener)
+{
+    return accept(listener, nullptr, nullptr);
+}
+
+// `endpoint` is "host:port".
+inline socketHandle connectTo(const std::string& endpoint)
+{
+    size_t colon = endpoint.rfind(':');
+    if (colon == std::string::npos) {
+        return invalidSocket;
+    }
+    std::string host = endpoint.substr(0, colon);
+    std::string port = endpoint.substr(colon + 1);
+    addrinfo hints;
+    std::memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_STREAM;
+    addrinfo* result = nullptr;
+    if (getaddrinfo(host.c_str(), port.c_str(), &hints, &result) != 0) {
+        return invalidSocket;
+    }
+    socketHandle s = invalidSocket;
+    for (addrinfo* a = result; a != nullptr; a = a->ai_next) {
+        s = socket(a->ai_family, a->ai_socktype, a->ai_protocol);
+        if (s == invalidSocket) {
+            continue;
+        }
+        if (connect(s, a->ai_addr, (int)a->ai_addrlen) == 0) {
+            break;
+        }
+        closeSocket(s);
+        s = invalidSocket;
+    }
+    freeaddrinfo(result);
+    return s;
+}
+
+inline bool sendAll(socketHandle s, const void* data, size_t size)
+{
+    const char* p = (const char*)data;
+    while (size > 0) {
+#ifdef MSG_NOSIGNAL
+        long sent = send(s, p, (int)size, MSG_NOSIGNAL);
+#else
+        long sent = send(s, p, (int)size, 0);
+#endif
+        if (sent <= 0) {
+            return false;
+        }
+        p += sent;
+        size -= sent;
+    }
+    return true;
+}
+
+inline bool receiveAll(socketHandle s, void* data, size_t size)
+{
+    char* p = (char*)data;
+    while (size > 0) {
+        long received = recv(s, p, (int)size, 0);
+        if (received <= 0) {
+            return false;
+        }
+        p += received;
+        size -= received;
+    }
+    return true;
+}
+
+// Appends plain values to a byte buffer. Both ends are assumed to share endianness and float
+// layout, which holds for the x86/ARM machines this is meant for.
+class byteWriter
+{
+  public:
+    template <typename T> void put(const T& value)
+    {
+        const unsigned char* p = (const unsigned char*)&value;
+        bytes.insert(bytes.end(), p, p + sizeof(T));
+    }
+    void putBytes(const void* data, size_t size)
+    {
+        const unsigned char* p = (const unsigned char*)data;
+        bytes.insert(bytes.end(), p, p + size);
+    }
+    std::vector<unsigned char> bytes;
+};
+
+class byteReader
+{
+  public:
+    byteReader(const std::vector<unsigned char>& bytes) : bytes(bytes), offset(0), ok(true) {}
+    template <typename T> T get()
+    {
+        T value;
+        getBytes(&value, sizeof(T));
+        return value;
+    }
+    void getBytes(void* data, size_t size)
+    {
+        if (offset + size > bytes.size()) {
+            ok = false;
+            std::memset(data, 0, size);
+            return;
+        }
+        std::memcpy(data, bytes.data() + offset, size);
+        offset += size;
+    }
+    inline size_t remaining() const { return bytes.size() - offset; }
+    const std::vector<unsigned char>& bytes;
+    size_t offset;
+    bool ok;
+};
+
+// Message = uint32 type, uint32 payload size, payload.
+inline bool sendMessage(socketHandle s, uint32_t type, const std::vector<unsigned char>& payload)
+{
+    uint32_t header[2] = {type, (uint32_t)payload.size()};
+    return sendAll(s, header, sizeof(header)) &&
+           (payload.empty() || sendAll(s, payload.data(), payload.size()));
+}
+
+// Largest payload receiveMessage accepts by default.
+constexpr uint32_t maxPayloadBytes = 1u << 30;
+
+// Fails without allocating when the header announces more than `maxPayload` bytes.
+inline bool receiveMessage(socketHandle s, uint32_t& type, std::vector<unsigned char>& payload,
+                           uint32_t maxPayload = maxPayloadBytes)
+{
+    uint32_t header[2];
+    if (!receiveAll(s, header, sizeof(header)) || header[1] > maxPayload) {
+        return false;
+    }
+    type = header[0];
+    payload.resize(header[1]);
+    return payload.empty() || receiveAll(s, payload.data(), payload.size());
+}
+} // namespace net
+
+#endif
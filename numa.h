@@ -0,0 +1,192 @@
+#ifndef NUMA_H
+#define NUMA_H
+
+#include "hitable.h"
+#include "myRandom.h"
+#include "scene.h"
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <random>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#ifdef __linux__
+#include <pthread.h>
+#include <sched.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+// NUMA topology discovery (Linux /sys), thread pinning and per-node scene replicas. Elsewhere
+// everything degrades to a single node holding all hardware threads and pinning is a no-op.
+namespace numa
+{
+struct node {
+    unsigned int id;
+    std::vector<unsigned int> cpus;
+};
+
+// Parses a kernel cpu list such as "0-3,8-11".
+inline std::vector<unsigned int> parseCpuList(const std::string& list)
+{
+    std::vector<unsigned int> cpus;
+    std::stringstream ss(list);
+    std::string range;
+    while (std::getline(ss, range, ',')) {
+        if (range.empty() || range[0] == '\n') {
+            continue;
+        }
+        size_t dash = range.find('-');
+        unsigned int first = std::atoi(range.c_str());
+        unsigned int last = dash == std::string::npos ? first : std::atoi(range.c_str() + dash + 1);
+        for (unsigned int c = first; c <= last; ++c) {
+            cpus.push_back(c);
+        }
+    }
+    return cpus;
+}
+
+inline std::vector<node> discover()
+{
+    std::vector<node> nodes;
+#ifdef __linux__
+    for (unsigned int id = 0; id < 1024; ++id) {
+        std::ifstream file("/sys/devices/system/node/node" + std::to_string(id) + "/cpulist");
+        if (!file) {
+            continue; // node ids can have holes
+        }
+        std::string list;
+        std::getline(file, list);
+        std::vector<unsigned int> cpus = parseCpuList(list);
+        if (!cpus.empty()) {
+            nodes.push_back(node{id, cpus});
+        }
+    }
+#endif
+    if (nodes.empty()) {
+        node all{0, {}};
+        for (unsigned int c = 0; c < std::max(1u, std::thread::hardware_concurrency()); ++c) {
+            all.cpus.push_back(c);
+        }
+        nodes.push_back(all);
+    }
+    return nodes;
+}
+
+inline bool pinCurrentThread(unsigned int cpu)
+{
+#ifdef __linux__
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    return pthread_setaffinity_np(pthread_self(), sizeof(set), &set) == 0;
+#else
+    return false;
+#endif
+}
+
+// Node that currently backs each address in `status`, -1 where unknown (page not present).
+// Returns false, with every status -1, when the kernel can not be asked.
+inline bool nodesOfAddresses(const std::vector<const void*>& addresses, std::vector<int>& status)
+{
+    status.assign(addresses.size(), -1);
+#if defined(__linux__) && defined(SYS_move_pages)
+    const uintptr_t pageMask = ~(uintptr_t)(sysconf(_SC_PAGESIZE) - 1);
+    std::vector<void*> pages(addresses.size());
+    for (size_t i = 0; i < addresses.size(); ++i) {
+        pages[i] = (void*)((uintptr_t)addresses[i] & pageMask);
+    }
+    // With a null node list move_pages only reports where each page lives.
+    if (syscall(SYS_move_pages, 0, pages.size(), pages.data(), nullptr, status.data(), 0) != 0) {
+        std::fill(status.begin(), status.end(), -1);
+        return false;
+    }
+    for (int& s : status) {
+        s = s < 0 ? -1 : s;
+    }
+    return true;
+#else
+    return false;
+#endif
+}
+
+// Collects the addresses of the BVH nodes, primitives and materials reachable from `root`.
+inline void collectAddresses(const hitable* h, std::vector<const void*>& out)
+{
+    if (h == nullptr) {
+        return;
+    }
+    out.push_back(h);
+    if (const bvhNode* n = dynamic_cast<const bvhNode*>(h)) {
+        collectAddresses(n->left, out);
+        collectAddresses(n->right, out);
+    } else if (const sphere* s = dynamic_cast<const sphere*>(h)) {
+        out.push_back(s->mat);
+    } else if (const hitableList* l = dynamic_cast<const hitableList*>(h)) {
+        out.push_back(l->list);
+        for (unsigned int i = 0; i < l->count; ++i) {
+            collectAddresses(l->list[i], out);
+        }
+    }
+}
+
+struct placement {
+    size_t local;
+    size_t remote;
+    size_t unknown;
+    bool queried; // false when the pages could not be looked up, all of them are unknown then
+};
+
+inline placement queryPlacement(const hitable* root, unsigned int nodeId)
+{
+    std::vector<const void*> addresses;
+    collectAddresses(root, addresses);
+    std::vector<int> nodes;
+    placement p{0, 0, 0, nodesOfAddresses(addresses, nodes)};
+    for (int n : nodes) {
+        if (n < 0) {
+            p.unknown++;
+        } else if ((unsigned int)n == nodeId) {
+            p.local++;
+        } else {
+            p.remote++;
+        }
+    }
+    return p;
+}
+
+// Builds one copy of the scene per node on a thread pinned to that node, so first-touch places
+// the BVH, primitives and materials in the node's local memory. Every builder thread seeds its
+// myRandom generator with the same value, so builders that draw random numbers (the bvhNode
+// split axes) make identical replicas. A builder that can not be pinned is reported and builds
+// its replica wherever it runs.
+template <typename Builder>
+std::vector<hitable*> replicateScene(const std::vector<node>& nodes, const sceneDescription& desc,
+                                     Builder build)
+{
+    std::vector<hitable*> replicas(nodes.size(), nullptr);
+    std::vector<std::thread> builders;
+    const unsigned int seed = std::random_device()();
+    for (size_t n = 0; n < nodes.size(); ++n) {
+        builders.push_back(std::thread([&nodes, &desc, &replicas, build, n, seed]() {
+            if (!pinCurrentThread(nodes[n].cpus[0])) {
+                std::printf("numa: could not pin the replica builder of node %u to cpu %u\n",
+                            nodes[n].id, nodes[n].cpus[0]);
+            }
+            myRandom::seed(seed);
+            replicas[n] = build(desc);
+        }));
+    }
+    for (auto& b : builders) {
+        b.join();
+    }
+    return replicas;
+}
+} // namespace numa
+
+#endif
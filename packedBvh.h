@@ -0,0 +1,295 @@
+#ifndef PACKEDBVH_H
+#define PACKEDBVH_H
+
+#include "arena.h"
+#include "hitable.h"
+#include "lbvh.h"
+#include "sphereStore.h"
+#include "trace.h"
+#include <algorithm>
+#include <cfloat>
+#include <cstdint>
+#include <vector>
+
+// BVH over a sphereStore, traversed without virtual calls. The store is reordered along the
+// Morton curve of the sphere centres and every leaf covers a range of it, so nodes hold indices
+// rather than pointers: 32 bytes per node and about one node per two spheres. Internal nodes
+// split their range where the highest Morton bit changes (as lbvh.h does), and their two
+// children sit next to each other. Nodes and materials come from the arena; the store must
+// outlive the BVH.
+class packedBvh : public hitable
+{
+  public:
+    struct node {
+        float min[3];
+        float max[3];
+        uint32_t first; // first sphere of a leaf, left child of an internal node (right follows)
+        uint32_t count; // spheres of a leaf, 0 for an internal node
+    };
+
+    packedBvh(sphereStore& store, sceneArena& arena, unsigned int threadCount,
+              unsigned int leafSize = 4)
+        : store(store), nodes(nullptr), nodeCount(0), leafSize(std::max(1u, leafSize))
+    {
+        trace::scope span("packed bvh build", store.size());
+        const uint32_t count = (uint32_t)store.size();
+        materials = store.buildMaterials(arena);
+        if (count == 0) {
+            return;
+        }
+        std::vector<uint32_t> keys;
+        sortByMorton(keys, threadCount);
+        std::vector<node> built;
+        built.reserve(2 * (count / this->leafSize) + 1);
+        built.push_back(node{});
+        buildRange(built, keys, 0, 0, count);
+        nodeCount = built.size();
+        nodes = arena.createArray<node>(nodeCount);
+        std::copy(built.begin(), built.end(), nodes);
+    }
+    packedBvh(const packedBvh&) = delete;
+    packedBvh& operator=(const packedBvh&) = delete;
+
+    virtual bool hit(const ray& r, float tMin, float tMax, hitRecord& rec) const
+    {
+        int closest = -1;
+        traverse(r, tMin, tMax, [&](uint32_t i, float& tFar) {
+            float t;
+            if (intersect(store.spheres[i], r, tMin, tFar, t)) {
+                tFar = t;
+                closest = (int)i;
+            }
+            return false;
+        });
+        if (closest < 0) {
+            return false;
+        }
+        const packedSphere& s = store.spheres[closest];
+        const vec3 center(s.x, s.y, s.z);
+        rec.distance = tMax;
+        rec.point = r.getPoint(rec.distance);
+        rec.normal = (rec.point - center) / s.radius;
+        rec.mat = materials[store.materialIndices[closest]];
+        sphere::setUv(rec, s.radius);
+        return true;
+    }
+    virtual bool occluded(const ray& r, float tMin, float tMax) const
+    {
+        bool isOccluded = false;
+        traverse(r, tMin, tMax, [&](uint32_t i, float& tFar) {
+            float t;
+            isOccluded = intersect(store.spheres[i], r, tMin, tFar, t);
+            return isOccluded;
+        });
+        return isOccluded;
+    }
+    virtual aabb boundingBox() const
+    {
+        if (nodeCount == 0) {
+            return aabb();
+        }
+        return aabb(vec3(nodes[0].min[0], nodes[0].min[1], nodes[0].min[2]),
+                    vec3(nodes[0].max[0], nodes[0].max[1], nodes[0].max[2]));
+    }
+    virtual vec3 centeroid() const
+    {
+        aabb box = boundingBox();
+        return (box.min() + box.max()) / 2.f;
+    }
+
+    // Bytes of the nodes; the store and palette materials are counted separately.
+    inline size_t memoryBytes() const { return sizeof(*this) + nodeCount * sizeof(node); }
+
+    sphereStore& store;
+    node* nodes;
+    size_t nodeCount;
+    const unsigned int leafSize;
+
+  private:
+    // Reorders the spheres and their material indices along the Morton curve of the centres.
+    void sortByMorton(std::vector<uint32_t>& keys, unsigned int threadCount)
+    {
+        const uint32_t count = (uint32_t)store.size();
+        aabb bounds(vec3(FLT_MAX, FLT_MAX, FLT_MAX), vec3(-FLT_MAX, -FLT_MAX, -FLT_MAX));
+        for (const packedSphere& s : store.spheres) {
+            bounds.expandToInclude(vec3(s.x, s.y, s.z));
+        }
+        const vec3 extent = bounds.extent();
+        const vec3 inverseExtent(extent.x() > 0 ? 1 / extent.x() : 0,
+                                 extent.y() > 0 ? 1 / extent.y() : 0,
+                                 extent.z() > 0 ? 1 / extent.z() : 0);
+        keys.resize(count);
+        std::vector<uint32_t> order(count);
+        lbvh::parallelFor(count, threadCount, [&](size_t begin, size_t end, unsigned int) {
+            for (size_t i = begin; i < end; ++i) {
+                const packedSphere& s = store.spheres[i];
+                keys[i] = lbvh::morton3D((vec3(s.x, s.y, s.z) - bounds.min()) * inverseExtent);
+                order[i] = (uint32_t)i;
+            }
+        });
+        lbvh::radixSort(keys, order, threadCount);
+        std::vector<packedSphere> spheres(count);
+        std::vector<uint16_t> materialIndices(count);
+        lbvh::parallelFor(count, threadCount, [&](size_t begin, size_t end, unsigned int) {
+            for (size_t i = begin; i < end; ++i) {
+                spheres[i] = store.spheres[order[i]];
+                materialIndices[i] = store.materialIndices[order[i]];
+            }
+        });
+        store.spheres.swap(spheres);
+        store.materialIndices.swap(materialIndices);
+    }
+
+    // Fills nodes[index] for spheres [begin, end) and returns its bounds.
+    aabb buildRange(std::vector<node>& built, const std::vector<uint32_t>& keys, size_t index,
+                    uint32_t begin, uint32_t end)
+    {
+        aabb box;
+        if (end - begin <= leafSize) {
+            box = sphereBox(begin);
+            for (uint32_t i = begin + 1; i < end; ++i) {
+                box.expandToInclude(sphereBox(i));
+            }
+            built[index].first = begin;
+            built[index].count = end - begin;
+        } else {
+            const uint32_t split = findSplit(keys, begin, end);
+            const size_t left = built.size();
+            built.push_back(node{});
+            built.push_back(node{});
+            box = buildRange(built, keys, left, begin, split);
+            box.expandToInclude(buildRange(built, keys, left + 1, split, end));
+            built[index].first = (uint32_t)left;
+            built[index].count = 0;
+        }
+        for (int a = 0; a < 3; ++a) {
+            built[index].min[a] = box.min()[a];
+            built[index].max[a] = box.max()[a];
+        }
+        return box;
+    }
+
+    // First index of the upper half: where the highest differing Morton bit of the range turns
+    // on, or the middle when all keys are equal.
+    static uint32_t findSplit(const std::vector<uint32_t>& keys, uint32_t begin, uint32_t end)
+    {
+        const uint32_t firstKey = keys[begin], lastKey = keys[end - 1];
+        if (firstKey == lastKey) {
+            return begin + (end - begin) / 2;
+        }
+        const int prefix = __builtin_clz(firstKey ^ lastKey);
+        uint32_t lo = begin, hi = end - 1; // keys[lo] shares the prefix bit off, keys[hi] on
+        while (hi - lo > 1) {
+            const uint32_t mid = lo + (hi - lo) / 2;
+            if (keys[mid] == firstKey || __builtin_clz(firstKey ^ keys[mid]) > prefix) {
+                lo = mid;
+            } else {
+                hi = mid;
+            }
+        }
+        return hi;
+    }
+
+    inline aabb sphereBox(uint32_t i) const
+    {
+        const packedSphere& s = store.spheres[i];
+        return aabb(vec3(s.x - s.radius, s.y - s.radius, s.z - s.radius),
+                    vec3(s.x + s.radius, s.y + s.radius, s.z + s.radius));
+    }
+
+    static inline bool intersect(const packedSphere& s, const ray& r, float tMin, float tMax,
+                                 float& t)
+    {
+        countPrimitiveTest();
+        const vec3 oc = r.origin - vec3(s.x, s.y, s.z);
+        const float a = vec3::dot(r.direction, r.direction);
+        const float b = vec3::dot(oc, r.direction);
+        const float c = vec3::dot(oc, oc) - s.radius * s.radius;
+        const float discriminant = b * b - a * c;
+        if (discriminant <= 0) {
+            return false;
+        }
+        const float root = sqrtf(discriminant);
+        t = (-b - root) / a;
+        if (t < tMax && t > tMin) {
+            return true;
+        }
+        t = (-b + root) / a;
+        return t < tMax && t > tMin;
+    }
+
+    // Entry distance of the ray into node n within (tMin, tMax), or FLT_MAX when it misses.
+    inline float enter(const node& n, const vec3& origin, const float* invDirection, float tMin,
+                       float tMax) const
+    {
+        countBoxTest();
+        for (int a = 0; a < 3; ++a) {
+            float t0 = (n.min[a] - origin[a]) * invDirection[a];
+            float t1 = (n.max[a] - origin[a]) * invDirection[a];
+            if (invDirection[a] < 0.f) {
+                std::swap(t0, t1);
+            }
+            tMin = std::max(tMin, t0);
+            tMax = std::min(tMax, t1);
+            if (tMax <= tMin) {
+                return FLT_MAX;
+            }
+        }
+        return tMin;
+    }
+
+    // Calls visit(sphere, tMax) for the spheres of the leaves the ray reaches, nearer child
+    // first; visit may lower tMax and stops the traversal by returning true.
+    template <typename Visit>
+    void traverse(const ray& r, float tMin, float& tMax, Visit visit) const
+    {
+        if (nodeCount == 0) {
+            return;
+        }
+        const float invDirection[3] = {1 / r.direction.x(), 1 / r.direction.y(),
+                                       1 / r.direction.z()};
+        if (enter(nodes[0], r.origin, invDirection, tMin, tMax) == FLT_MAX) {
+            return;
+        }
+        // Nodes waiting to be visited with their entry distance, skipped once a closer hit
+        // has lowered tMax below it.
+        struct entry {
+            uint32_t index;
+            float distance;
+        } stack[64];
+        int top = 0;
+        stack[top++] = entry{0, tMin};
+        while (top > 0) {
+            const entry e = stack[--top];
+            if (e.distance > tMax) {
+                continue;
+            }
+            const node& n = nodes[e.index];
+            countNodeVisit();
+            if (n.count > 0) {
+                for (uint32_t i = n.first; i < n.first + n.count; ++i) {
+                    if (visit(i, tMax)) {
+                        return;
+                    }
+                }
+                continue;
+            }
+            const float tLeft = enter(nodes[n.first], r.origin, invDirection, tMin, tMax);
+            const float tRight = enter(nodes[n.first + 1], r.origin, invDirection, tMin, tMax);
+            // Push the farther child first so the nearer one is visited next.
+            const bool leftFirst = tLeft <= tRight;
+            const entry nearer{leftFirst ? n.first : n.first + 1, leftFirst ? tLeft : tRight};
+            const entry farther{leftFirst ? n.first + 1 : n.first, leftFirst ? tRight : tLeft};
+            if (farther.distance != FLT_MAX) {
+                stack[top++] = farther;
+            }
+            if (nearer.distance != FLT_MAX) {
+                stack[top++] = nearer;
+            }
+        }
+    }
+
+    material** materials;
+};
+
+#endif
@@ -0,0 +1,106 @@
+#ifndef PERFCOUNTERS_H
+#define PERFCOUNTERS_H
+
+#include <cstdint>
+#include <cstring>
+
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+// Hardware cache counters for the calling thread and the threads it starts after start(), read
+// through perf_event_open. Counts stay at -1 where the kernel refuses the event (no PMU in a VM,
+// perf_event_paranoid too high) and on other platforms.
+namespace perf
+{
+struct cacheCounts {
+    long long references; // last level cache accesses
+    long long misses;     // last level cache misses
+    long long l1dMisses;  // L1 data cache read misses
+};
+
+class cacheCounters
+{
+  public:
+    cacheCounters() : fds{-1, -1, -1}
+    {
+#ifdef __linux__
+        fds[0] = open(PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_REFERENCES);
+        fds[1] = open(PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES);
+        fds[2] = open(PERF_TYPE_HW_CACHE, PERF_COUNT_HW_CACHE_L1D |
+                                              (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+                                              (PERF_COUNT_HW_CACHE_RESULT_MISS << 16));
+#endif
+    }
+    ~cacheCounters()
+    {
+#ifdef __linux__
+        for (int fd : fds) {
+            if (fd >= 0) {
+                close(fd);
+            }
+        }
+#endif
+    }
+    cacheCounters(const cacheCounters&) = delete;
+    cacheCounters& operator=(const cacheCounters&) = delete;
+
+    inline bool available() const { return fds[0] >= 0 || fds[1] >= 0 || fds[2] >= 0; }
+
+    void start()
+    {
+#ifdef __linux__
+        for (int fd : fds) {
+            if (fd >= 0) {
+                ioctl(fd, PERF_EVENT_IOC_RESET, 0);
+                ioctl(fd, PERF_EVENT_IOC_ENABLE, 0);
+            }
+        }
+#endif
+    }
+
+    // Counts of inherited threads are only added once those threads have exited, so join the
+    // workers before calling stop().
+    cacheCounts stop()
+    {
+        long long values[3] = {-1, -1, -1};
+#ifdef __linux__
+        for (int i = 0; i < 3; ++i) {
+            if (fds[i] < 0) {
+                continue;
+            }
+            ioctl(fds[i], PERF_EVENT_IOC_DISABLE, 0);
+            uint64_t value = 0;
+            if (read(fds[i], &value, sizeof(value)) == sizeof(value)) {
+                values[i] = (long long)value;
+            }
+        }
+#endif
+        return cacheCounts{values[0], values[1], values[2]};
+    }
+
+  private:
+#ifdef __linux__
+    static int open(uint32_t type, uint64_t config)
+    {
+        perf_event_attr attr;
+        std::memset(&attr, 0, sizeof(attr));
+        attr.size = sizeof(attr);
+        attr.type = type;
+        attr.config = config;
+        attr.disabled = 1;
+        attr.inherit = 1;
+        attr.exclude_kernel = 1;
+        attr.exclude_hv = 1;
+        return (int)syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+    }
+#endif
+
+    int fds[3];
+};
+} // namespace perf
+
+#endif
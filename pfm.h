@@ -0,0 +1,65 @@
+#ifndef PFM_H
+#define PFM_H
+
+#include <cstdio>
+#include <vector>
+
+// Portable float map (PF, 3 channel) input and output of the linear HDR framebuffer. PFM stores
+// rows bottom-to-top; a negative scale marks little-endian data.
+namespace pfm
+{
+inline bool write(const char* path, unsigned int width, unsigned int height, const float* data,
+                  unsigned int channels)
+{
+    std::FILE* file = std::fopen(path, "wb");
+    if (file == nullptr) {
+        return false;
+    }
+    std::fprintf(file, "PF\n%u %u\n-1.0\n", width, height);
+    std::vector<float> row(width * 3);
+    bool ok = true;
+    for (unsigned int j = height; ok && j-- > 0;) {
+        const float* src = data + (size_t)j * width * channels;
+        for (unsigned int i = 0; i < width; ++i) {
+            row[i * 3 + 0] = src[i * channels + 0];
+            row[i * 3 + 1] = src[i * channels + 1];
+            row[i * 3 + 2] = src[i * channels + 2];
+        }
+        ok = std::fwrite(row.data(), sizeof(float), row.size(), file) == row.size();
+    }
+    std::fclose(file);
+    return ok;
+}
+
+// Reads a little-endian PF file written by write() into `channels` floats per pixel (alpha, if
+// any, set to 1). Fails on other formats.
+inline bool read(const char* path, unsigned int& width, unsigned int& height,
+                 std::vector<float>& data, unsigned int channels)
+{
+    std::FILE* file = std::fopen(path, "rb");
+    if (file == nullptr) {
+        return false;
+    }
+    char magic[3] = {0, 0, 0};
+    float scale = 0.f;
+    bool ok = std::fscanf(file, "%2s %u %u %f", magic, &width, &height, &scale) == 4 &&
+              magic[0] == 'P' && magic[1] == 'F' && scale < 0.f && std::fgetc(file) == '\n';
+    if (ok) {
+        data.assign((size_t)width * height * channels, 1.f);
+        std::vector<float> row(width * 3);
+        for (unsigned int j = height; ok && j-- > 0;) {
+            ok = std::fread(row.data(), sizeof(float), row.size(), file) == row.size();
+            float* dst = data.data() + (size_t)j * width * channels;
+            for (unsigned int i = 0; ok && i < width; ++i) {
+                dst[i * channels + 0] = row[i * 3 + 0];
+                dst[i * channels + 1] = row[i * 3 + 1];
+                dst[i * channels + 2] = row[i * 3 + 2];
+            }
+        }
+    }
+    std::fclose(file);
+    return ok;
+}
+} // namespace pfm
+
+#endif
@@ -0,0 +1,411 @@
+#ifndef PNGENCODER_H
+#define PNGENCODER_H
+
+#include "trace.h"
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <future>
+#include <thread>
+#include <vector>
+
+// PNG encoder that deflates horizontal strips of the image in parallel.
+//
+// Every strip is filtered and compressed on its own (LZ77 + fixed Huffman, no back references
+// across strips) into a non-final deflate block followed by an empty stored block, which leaves
+// the stream byte aligned. The strips are then emitted as consecutive IDAT chunks; a final empty
+// block and the adler32 of the whole stream (combined from the per-strip checksums) close it.
+namespace png
+{
+struct encodeResult {
+    std::vector<unsigned char> bytes;
+    unsigned int chunkCount;
+    double encodeMilliseconds;
+};
+
+namespace detail
+{
+inline std::vector<uint32_t> makeCrcTable()
+{
+    std::vector<uint32_t> table(256);
+    for (uint32_t n = 0; n < 256; ++n) {
+        uint32_t c = n;
+        for (int k = 0; k < 8; ++k) {
+            c = (c & 1) ? 0xEDB88320u ^ (c >> 1) : c >> 1;
+        }
+        table[n] = c;
+    }
+    return table;
+}
+inline uint32_t crc32(uint32_t crc, const unsigned char* data, size_t size)
+{
+    static const std::vector<uint32_t> table = makeCrcTable();
+    crc = ~crc;
+    for (size_t i = 0; i < size; ++i) {
+        crc = table[(crc ^ data[i]) & 0xFF] ^ (crc >> 8);
+    }
+    return ~crc;
+}
+
+const static uint32_t adlerBase = 65521;
+inline uint32_t adler32(const unsigned char* data, size_t size)
+{
+    uint32_t s1 = 1, s2 = 0;
+    while (size > 0) {
+        size_t block = size < 5552 ? size : 5552;
+        size -= block;
+        while (block-- > 0) {
+            s1 += *data++;
+            s2 += s1;
+        }
+        s1 %= adlerBase;
+        s2 %= adlerBase;
+    }
+    return (s2 << 16) | s1;
+}
+// adler32 of A followed by B, given adler32(A), adler32(B) and the length of B (as in zlib).
+inline uint32_t adler32Combine(uint32_t a1, uint32_t a2, size_t length2)
+{
+    uint32_t rem = (uint32_t)(length2 % adlerBase);
+    uint32_t sum1 = a1 & 0xFFFF;
+    uint32_t sum2 = (uint32_t)(((uint64_t)rem * sum1) % adlerBase);
+    sum1 += (a2 & 0xFFFF) + adlerBase - 1;
+    sum2 += (a1 >> 16) + (a2 >> 16) + adlerBase - rem;
+    if (sum1 >= adlerBase) sum1 -= adlerBase;
+    if (sum1 >= adlerBase) sum1 -= adlerBase;
+    if (sum2 >= (adlerBase << 1)) sum2 -= (adlerBase << 1);
+    if (sum2 >= adlerBase) sum2 -= adlerBase;
+    return sum1 | (sum2 << 16);
+}
+
+class bitWriter
+{
+  public:
+    bitWriter(std::vector<unsigned char>& out) : out(out), buffer(0), count(0) {}
+    // Deflate packs values LSB first.
+    inline void bits(uint32_t value, int length)
+    {
+        buffer |= value << count;
+        count += length;
+        while (count >= 8) {
+            out.push_back((unsigned char)(buffer & 0xFF));
+            buffer >>= 8;
+            count -= 8;
+        }
+    }
+    // Huffman codes are stored MSB first.
+    inline void huffman(uint32_t code, int length)
+    {
+        uint32_t reversed = 0;
+        for (int i = 0; i < length; ++i) {
+            reversed = (reversed << 1) | ((code >> i) & 1);
+        }
+        bits(reversed, length);
+    }
+    inline void alignToByte()
+    {
+        if (count > 0) {
+            bits(0, 8 - count);
+        }
+    }
+
+  private:
+    std::vector<unsigned char>& out;
+    uint32_t buffer;
+    int count;
+};
+
+inline void literal(bitWriter& w, unsigned int symbol)
+{
+    if (symbol <= 143) {
+        w.huffman(0x30 + symbol, 8);
+    } else if (symbol <= 255) {
+        w.huffman(0x190 + symbol - 144, 9);
+    } else if (symbol <= 279) {
+        w.huffman(symbol - 256, 7);
+    } else {
+        w.huffman(0xC0 + symbol - 280, 8);
+    }
+}
+
+inline void match(bitWriter& w, unsigned int length, unsigned int distance)
+{
+    static const unsigned short lengthBase[29] = {3,  4,  5,  6,  7,  8,  9,  10,  11,  13,
+                                                  15, 17, 19, 23, 27, 31, 35, 43,  51,  59,
+                                                  67, 83, 99, 115, 131, 163, 195, 227, 258};
+    static const unsigned char lengthExtra[29] = {0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2,
+                                                  2, 3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0};
+    static const unsigned short distanceBase[30] = {
+        1,   2,   3,   4,   5,   7,    9,    13,   17,   25,   33,   49,   65,    97,    129,
+        193, 257, 385, 513, 769, 1025, 1537, 2049, 3073, 4097, 6145, 8193, 12289, 16385, 24577};
+    static const unsigned char distanceExtra[30] = {0, 0, 0, 0, 1, 1, 2, 2,  3,  3,  4,  4,  5,  5,  6,
+                                                    6, 7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13};
+    int l = 28;
+    while (lengthBase[l] > length) {
+        --l;
+    }
+    literal(w, 257 + l);
+    w.bits(length - lengthBase[l], lengthExtra[l]);
+    int d = 29;
+    while (distanceBase[d] > distance) {
+        --d;
+    }
+    w.huffman(d, 5);
+    w.bits(distance - distanceBase[d], distanceExtra[d]);
+}
+
+// One non-final fixed Huffman block for `data`, then a sync flush (empty stored block).
+inline void deflateStrip(const unsigned char* data, size_t size, std::vector<unsigned char>& out)
+{
+    const int hashBits = 15;
+    const size_t window = 32768;
+    const unsigned int maxChain = 32;
+    const unsigned int minMatch = 3, maxMatch = 258;
+    std::vector<int> head(1 << hashBits, -1);
+    std::vector<int> previous(size, -1);
+    auto hash = [data](size_t i) {
+        uint32_t h = (data[i] << 16) | (data[i + 1] << 8) | data[i + 2];
+        return (h * 2654435761u) >> (32 - hashBits);
+    };
+
+    bitWriter w(out);
+    w.bits(0, 1); // BFINAL
+    w.bits(1, 2); // BTYPE fixed Huffman
+    size_t i = 0;
+    while (i < size) {
+        unsigned int bestLength = 0, bestDistance = 0;
+        if (i + minMatch <= size) {
+            uint32_t h = hash(i);
+            int candidate = head[h];
+            unsigned int chain = 0;
+            const unsigned int limit = (unsigned int)std::min<size_t>(maxMatch, size - i);
+            while (candidate >= 0 && i - candidate <= window && chain++ < maxChain) {
+                unsigned int length = 0;
+                while (length < limit && data[candidate + length] == data[i + length]) {
+                    ++length;
+                }
+                if (length > bestLength) {
+                    bestLength = length;
+                    bestDistance = (unsigned int)(i - candidate);
+                    if (length == limit) {
+                        break;
+                    }
+                }
+                candidate = previous[candidate];
+            }
+            previous[i] = head[h];
+            head[h] = (int)i;
+        }
+        if (bestLength >= minMatch) {
+            match(w, bestLength, bestDistance);
+            // Keep the hash chains up to date inside the match.
+            for (size_t k = i + 1; k < i + bestLength && k + minMatch <= size; ++k) {
+                uint32_t h = hash(k);
+                previous[k] = head[h];
+                head[h] = (int)k;
+            }
+            i += bestLength;
+        } else {
+            literal(w, data[i]);
+            ++i;
+        }
+    }
+    literal(w, 256); // end of block
+    // Empty stored block: aligns the stream so strips can simply be concatenated.
+    w.bits(0, 1);
+    w.bits(0, 2);
+    w.alignToByte();
+    const unsigned char stored[4] = {0x00, 0x00, 0xFF, 0xFF};
+    out.insert(out.end(), stored, stored + 4);
+}
+
+inline unsigned char paeth(int a, int b, int c)
+{
+    int p = a + b - c;
+    int pa = std::abs(p - a), pb = std::abs(p - b), pc = std::abs(p - c);
+    if (pa <= pb && pa <= pc) {
+        return (unsigned char)a;
+    }
+    return (unsigned char)(pb <= pc ? b : c);
+}
+
+// Filters row `j` into `out` (filter byte + row), picking the filter with the smallest sum of
+// absolute values.
+inline void filterRow(const unsigned char* pixels, unsigned int width, unsigned int channels,
+                      unsigned int j, unsigned char* out, std::vector<unsigned char>& scratch)
+{
+    const size_t stride = (size_t)width * channels;
+    const unsigned char* row = pixels + j * stride;
+    const unsigned char* up = j > 0 ? row - stride : nullptr;
+    unsigned int bestSum = ~0u;
+    for (int filter = 0; filter < 5; ++filter) {
+        unsigned int sum = 0;
+        for (size_t i = 0; i < stride; ++i) {
+            int a = i >= channels ? row[i - channels] : 0;
+            int b = up != nullptr ? up[i] : 0;
+            int c = (up != nullptr && i >= channels) ? up[i - channels] : 0;
+            int predicted = 0;
+            switch (filter) {
+                case 1: predicted = a; break;
+                case 2: predicted = b; break;
+                case 3: predicted = (a + b) >> 1; break;
+                case 4: predicted = paeth(a, b, c); break;
+                default: break;
+            }
+            unsigned char value = (unsigned char)(row[i] - predicted);
+            scratch[i] = value;
+            sum += value < 128 ? value : 256 - value;
+        }
+        if (sum < bestSum) {
+            bestSum = sum;
+            out[0] = (unsigned char)filter;
+            std::memcpy(out + 1, scratch.data(), stride);
+        }
+    }
+}
+
+inline void appendChunk(std::vector<unsigned char>& out, const char* type,
+                        const unsigned char* data, size_t size, uint32_t crc)
+{
+    const unsigned char header[8] = {(unsigned char)(size >> 24), (unsigned char)(size >> 16),
+                                     (unsigned char)(size >> 8),  (unsigned char)size,
+                                     (unsigned char)type[0],      (unsigned char)type[1],
+                                     (unsigned char)type[2],      (unsigned char)type[3]};
+    out.insert(out.end(), header, header + 8);
+    out.insert(out.end(), data, data + size);
+    const unsigned char tail[4] = {(unsigned char)(crc >> 24), (unsigned char)(crc >> 16),
+                                   (unsigned char)(crc >> 8), (unsigned char)crc};
+    out.insert(out.end(), tail, tail + 4);
+}
+inline uint32_t chunkCrc(const char* type, const unsigned char* data, size_t size)
+{
+    return crc32(crc32(0, (const unsigned char*)type, 4), data, size);
+}
+inline void appendChunk(std::vector<unsigned char>& out, const char* type,
+                        const unsigned char* data, size_t size)
+{
+    appendChunk(out, type, data, size, chunkCrc(type, data, size));
+}
+} // namespace detail
+
+// Encodes 8-bit rgb (channels 3) or rgba (channels 4) pixels. `threadCount` strips are deflated
+// in parallel; rowsPerStrip trades compression ratio for parallelism.
+inline encodeResult encode(const unsigned char* pixels, unsigned int width, unsigned int height,
+                           unsigned int channels, unsigned int threadCount,
+                           unsigned int rowsPerStrip = 64)
+{
+    trace::scope span("png encode");
+    auto t1 = std::chrono::high_resolution_clock::now();
+    struct strip {
+        unsigned int startHeight;
+        unsigned int endHeight;
+        std::vector<unsigned char> deflated;
+        uint32_t adler;
+        uint32_t crc;
+        size_t rawSize;
+    };
+    std::vector<strip> strips;
+    for (unsigned int j = 0; j < height; j += rowsPerStrip) {
+        strips.push_back(strip{j, std::min(height, j + rowsPerStrip), {}, 0, 0, 0});
+    }
+    std::atomic_uint stripIndex(0u);
+    auto worker = [&]() {
+        const size_t stride = (size_t)width * channels;
+        std::vector<unsigned char> scratch(stride);
+        std::vector<unsigned char> filtered;
+        while (true) {
+            unsigned int s = stripIndex++;
+            if (s >= strips.size()) {
+                break;
+            }
+            trace::scope stripSpan("png strip", s);
+            strip& st = strips[s];
+            filtered.resize((st.endHeight - st.startHeight) * (stride + 1));
+            for (unsigned int j = st.startHeight; j < st.endHeight; ++j) {
+                detail::filterRow(pixels, width, channels, j,
+                                  filtered.data() + (j - st.startHeight) * (stride + 1), scratch);
+            }
+            st.rawSize = filtered.size();
+            st.adler = detail::adler32(filtered.data(), filtered.size());
+            detail::deflateStrip(filtered.data(), filtered.size(), st.deflated);
+            st.crc = detail::chunkCrc("IDAT", st.deflated.data(), st.deflated.size());
+        }
+    };
+    std::vector<std::thread> workers;
+    for (unsigned int t = 1; t < threadCount; ++t) {
+        workers.push_back(std::thread(worker));
+    }
+    worker();
+    for (auto& w : workers) {
+        w.join();
+    }
+
+    encodeResult result;
+    std::vector<unsigned char>& out = result.bytes;
+    const unsigned char signature[8] = {0x89, 'P', 'N', 'G', '\r', '\n', 0x1A, '\n'};
+    out.insert(out.end(), signature, signature + 8);
+    const unsigned char ihdr[13] = {(unsigned char)(width >> 24),  (unsigned char)(width >> 16),
+                                    (unsigned char)(width >> 8),   (unsigned char)width,
+                                    (unsigned char)(height >> 24), (unsigned char)(height >> 16),
+                                    (unsigned char)(height >> 8),  (unsigned char)height,
+                                    8,
+                                    (unsigned char)(channels == 4 ? 6 : 2),
+                                    0,
+                                    0,
+                                    0};
+    detail::appendChunk(out, "IHDR", ihdr, 13);
+    const unsigned char zlibHeader[2] = {0x78, 0x01};
+    detail::appendChunk(out, "IDAT", zlibHeader, 2);
+    uint32_t adler = 1;
+    for (const strip& st : strips) {
+        detail::appendChunk(out, "IDAT", st.deflated.data(), st.deflated.size(), st.crc);
+        adler = detail::adler32Combine(adler, st.adler, st.rawSize);
+    }
+    // Final empty fixed Huffman block, then the adler32 trailer.
+    const unsigned char trailer[6] = {0x03,
+                                      0x00,
+                                      (unsigned char)(adler >> 24),
+                                      (unsigned char)(adler >> 16),
+                                      (unsigned char)(adler >> 8),
+                                      (unsigned char)adler};
+    detail::appendChunk(out, "IDAT", trailer, 6);
+    detail::appendChunk(out, "IEND", nullptr, 0);
+
+    auto t2 = std::chrono::high_resolution_clock::now();
+    result.chunkCount = (unsigned int)strips.size();
+    result.encodeMilliseconds =
+        std::chrono::duration_cast<std::chrono::microseconds>(t2 - t1).count() / 1000.0;
+    return result;
+}
+
+// Takes ownership of the pixels so the caller can start rendering the next frame while this
+// one is being encoded.
+inline std::future<encodeResult> encodeAsync(std::vector<unsigned char>&& pixels,
+                                             unsigned int width, unsigned int height,
+                                             unsigned int channels, unsigned int threadCount)
+{
+    return std::async(std::launch::async,
+                      [width, height, channels, threadCount](std::vector<unsigned char> pixels) {
+                          return encode(pixels.data(), width, height, channels, threadCount);
+                      },
+                      std::move(pixels));
+}
+
+inline bool writeFile(const char* path, const encodeResult& result)
+{
+    trace::scope span("png write");
+    std::FILE* file = std::fopen(path, "wb");
+    if (file == nullptr) {
+        return false;
+    }
+    bool ok = std::fwrite(result.bytes.data(), 1, result.bytes.size(), file) == result.bytes.size();
+    std::fclose(file);
+    return ok;
+}
+} // namespace png
+
+#endif
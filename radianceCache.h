@@ -0,0 +1,155 @@
+#ifndef RADIANCECACHE_H
+#define RADIANCECACHE_H
+
+#include "vec3.h"
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <cstdint>
+#include <memory>
+
+// World-space cache of the light leaving diffuse surfaces. Positions are snapped to cubic cells
+// of `cellSize` and normals to the nearest axis direction; the pair is hashed into a fixed table
+// with linear probing. Paths store the radiance they computed at their shallow diffuse hits
+// (depth <= readDepth) and end at deeper ones once the cell has averaged `minSamples` estimates,
+// so the cache fills progressively over samples and threads and a path costs about readDepth
+// bounces instead of maxDepth.
+//
+// Entries are claimed with a compare-and-swap on their key and accumulate in 64-bit fixed point
+// with fetch_add, so no thread ever waits for another. A table that is full drops new cells.
+//
+// The estimate is biased: it averages radiance over a cell, and over the albedo texture in it.
+// Larger cells and a smaller readDepth or minSamples trade accuracy for speed.
+struct radianceCacheSettings {
+    float cellSize;          // world units
+    unsigned int readDepth;  // first bounce that may end in the cache, at least 1
+    unsigned int minSamples; // estimates a cell needs before it is read
+    unsigned int tableBits;  // log2 of the entry count
+};
+
+class radianceCache
+{
+  public:
+    explicit radianceCache(const radianceCacheSettings& settings)
+        : settings(settings), mask((size_t(1) << settings.tableBits) - 1),
+          entries(new entry[mask + 1]), inverseCellSize(1 / settings.cellSize)
+    {
+    }
+    radianceCache(const radianceCache&) = delete;
+    radianceCache& operator=(const radianceCache&) = delete;
+
+    // Cached radiance leaving the surface at `point` with `normal`, when its cell has enough
+    // samples.
+    bool lookup(const vec3& point, const vec3& normal, vec3& radiance) const
+    {
+        lookups.fetch_add(1, std::memory_order_relaxed);
+        const entry* e = find(key(point, normal), false);
+        if (e == nullptr) {
+            return false;
+        }
+        const uint32_t count = e->count.load(std::memory_order_relaxed);
+        if (count < settings.minSamples) {
+            return false;
+        }
+        hits.fetch_add(1, std::memory_order_relaxed);
+        const float scale = 1.f / (fixedPointScale * count);
+        radiance = vec3(e->sum[0].load(std::memory_order_relaxed) * scale,
+                        e->sum[1].load(std::memory_order_relaxed) * scale,
+                        e->sum[2].load(std::memory_order_relaxed) * scale);
+        return true;
+    }
+
+    // Adds one radiance estimate for the surface at `point` with `normal`.
+    void record(const vec3& point, const vec3& normal, const vec3& radiance)
+    {
+        entry* e = const_cast<entry*>(find(key(point, normal), true));
+        if (e == nullptr) {
+            return;
+        }
+        for (int c = 0; c < 3; ++c) {
+            // Clamped so a single firefly can not overflow the cell.
+            const float value = std::min(std::max(radiance[c], 0.f), maxRadiance);
+            e->sum[c].fetch_add((uint64_t)(value * fixedPointScale), std::memory_order_relaxed);
+        }
+        e->count.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    inline size_t capacity() const { return mask + 1; }
+    inline size_t memoryBytes() const { return capacity() * sizeof(entry); }
+    inline size_t usedCells() const { return cells.load(); }
+    // Share of lookups answered by the cache.
+    inline float hitRate() const
+    {
+        const unsigned long long l = lookups.load();
+        return l > 0 ? float(hits.load()) / l : 0.f;
+    }
+
+    const radianceCacheSettings settings;
+
+    // Used by color() when set.
+    static inline radianceCache* active = nullptr;
+
+  private:
+    struct entry {
+        std::atomic<uint64_t> key{0}; // 0 while free
+        std::atomic<uint64_t> sum[3] = {{0}, {0}, {0}};
+        std::atomic<uint32_t> count{0};
+    };
+
+    static constexpr float fixedPointScale = 1024.f;
+    static constexpr float maxRadiance = 1e6f;
+    static constexpr unsigned int maxProbes = 16;
+
+    // Cell coordinates (20 bits each, wrapping) and normal direction (one of six), never 0.
+    uint64_t key(const vec3& point, const vec3& normal) const
+    {
+        uint64_t k = 0;
+        for (int a = 0; a < 3; ++a) {
+            const int64_t cell = (int64_t)floorf(point[a] * inverseCellSize);
+            k = (k << 20) | ((uint64_t)cell & 0xFFFFF);
+        }
+        int axis = 0;
+        for (int a = 1; a < 3; ++a) {
+            if (fabsf(normal[a]) > fabsf(normal[axis])) {
+                axis = a;
+            }
+        }
+        k = (k << 3) | (2 * axis + (normal[axis] < 0 ? 1 : 0));
+        return k | (uint64_t(1) << 63);
+    }
+
+    const entry* find(uint64_t k, bool insert) const
+    {
+        uint64_t h = k * 0x9E3779B97F4A7C15ull;
+        h ^= h >> 29;
+        for (unsigned int probe = 0; probe < maxProbes; ++probe) {
+            entry& e = entries[(h + probe) & mask];
+            uint64_t current = e.key.load(std::memory_order_acquire);
+            if (current == k) {
+                return &e;
+            }
+            if (current == 0) {
+                if (!insert) {
+                    return nullptr;
+                }
+                if (e.key.compare_exchange_strong(current, k, std::memory_order_acq_rel)) {
+                    cells.fetch_add(1, std::memory_order_relaxed);
+                    return &e;
+                }
+                if (current == k) {
+                    return &e; // another thread claimed it for the same cell
+                }
+            }
+        }
+        return nullptr;
+    }
+
+    const size_t mask;
+    std::unique_ptr<entry[]> entries;
+    const float inverseCellSize;
+    mutable std::atomic<unsigned long long> lookups{0};
+    mutable std::atomic<unsigned long long> hits{0};
+    mutable std::atomic<size_t> cells{0};
+};
+
+#endif
@@ -0,0 +1,277 @@
+#ifndef RENDER_H
+#define RENDER_H
+
+#include "camera.h"
+#include "environment.h"
+#include "hitable.h"
+#include "materials.h"
+#include "radianceCache.h"
+#include "trace.h"
+#include <chrono>
+#include <cstdio>
+#include <functional>
+#include <thread>
+
+// Light besides the sky gradient: an environment map and a radiance cache, both optional.
+struct lighting {
+    const environmentMap* environment;
+    radianceCache* cache;
+};
+// The process-wide lighting, environmentMap::active and radianceCache::active.
+inline lighting activeLighting() { return lighting{environmentMap::active, radianceCache::active}; }
+
+inline vec3 backgroundColor(const ray& r, const environmentMap* environment)
+{
+    if (environment != nullptr) {
+        return environment->radiance(r.direction);
+    }
+    vec3 unit = r.direction.normalized();
+    float t1 = 0.5f - (0.5f * unit.y());
+    float t2 = 0.5f + (0.5f * unit.y());
+    return t1 * vec3(0.5f, 1.f, 1.f) + t2 * vec3(0.5f, 0.7f, 1.f);
+}
+inline vec3 backgroundColor(const ray& r) { return backgroundColor(r, environmentMap::active); }
+// Rays traced by the calling thread, for throughput reports.
+inline thread_local unsigned long long tracedRays = 0;
+
+// With an environment map, diffuse hits take its light through directLight() and the path
+// continuing from them no longer counts it when it escapes (`environmentSampled`).
+// With a radiance cache, diffuse hits from its readDepth on return the cached radiance once
+// there is some, and hits up to readDepth store what they computed.
+inline vec3 color(const ray& r, const hitable* hitable, const float minDistance,
+                  const float maxDistance, const unsigned int depth, const unsigned int maxDepth,
+                  const lighting& light, bool environmentSampled = false)
+{
+    hitRecord rec;
+    ++tracedRays;
+    // auto t1 = std::chrono::high_resolution_clock::now();
+    bool isHit = hitable->hit(r, minDistance, maxDistance, rec);
+    // auto t2 = std::chrono::high_resolution_clock::now();
+    // auto duration = std::chrono::duration_cast<std::chrono::microseconds>(t2 - t1).count();
+    // std::printf("Hit duration: %u. IsHit: %u.\n", duration, isHit);
+    if (isHit) {
+        if (depth == 0) {
+            textureCone = rayCone{0.f, texture::pixelSpread};
+        }
+        textureCone.width += textureCone.spread * rec.distance * r.direction.length();
+        ray scattered;
+        vec3 attenuation;
+        if (depth < maxDepth && rec.mat->scatter(r, rec, attenuation, scattered)) {
+            vec3 direct(0, 0, 0), albedo;
+            radianceCache* cache = light.cache;
+            const bool isDiffuse = (light.environment != nullptr || cache != nullptr) &&
+                                   rec.mat->diffuse(rec, albedo);
+            vec3 cached;
+            if (isDiffuse && cache != nullptr && depth >= cache->settings.readDepth &&
+                cache->lookup(rec.point, rec.normal, cached)) {
+                return cached;
+            }
+            const bool sampleEnvironment = isDiffuse && light.environment != nullptr;
+            if (sampleEnvironment) {
+                direct = light.environment->directLight(rec, albedo, hitable, minDistance,
+                                                        maxDistance);
+            }
+            const vec3 radiance =
+                direct + attenuation * color(scattered, hitable, minDistance, maxDistance,
+                                             depth + 1, maxDepth, light, sampleEnvironment);
+            if (isDiffuse && cache != nullptr && depth <= cache->settings.readDepth) {
+                cache->record(rec.point, rec.normal, radiance);
+            }
+            return radiance;
+        }
+        return vec3(0, 0, 0);
+    }
+    if (environmentSampled) {
+        return vec3(0, 0, 0);
+    }
+    return backgroundColor(r, light.environment);
+}
+// color() with the process-wide lighting.
+inline vec3 color(const ray& r, const hitable* hitable, const float minDistance,
+                  const float maxDistance, const unsigned int depth, const unsigned int maxDepth,
+                  bool environmentSampled = false)
+{
+    return color(r, hitable, minDistance, maxDistance, depth, maxDepth, activeLighting(),
+                 environmentSampled);
+}
+// Cosine-distributed unit direction around the unit normal `n`, for uniform samples u1 (radius)
+// and u2 (angle) in [0, 1): a point of the unit disk lifted onto the hemisphere, in a tangent
+// frame that needs no branch on the normal's direction.
+inline vec3 cosineDirection(const vec3& n, float u1, float u2)
+{
+    const float r = sqrtf(u1);
+    const float phi = 2 * mathx::pi * u2;
+    const float x = r * cosf(phi), y = r * sinf(phi), z = sqrtf(mathx::max(0.f, 1.f - u1));
+    const float sign = n.z() >= 0.f ? 1.f : -1.f;
+    const float a = -1.f / (sign + n.z());
+    const float b = n.x() * n.y() * a;
+    const vec3 tangent(1.f + sign * n.x() * n.x() * a, sign * b, -sign * n.x());
+    const vec3 bitangent(b, sign + n.y() * n.y() * a, -n.y());
+    return x * tangent + y * bitangent + z * n;
+}
+// Primary hit of an ambient-occlusion preview pixel and the share of its probes that were open.
+struct aoPixel {
+    vec3 point;
+    vec3 normal;
+    float visibility;
+    bool hit;
+};
+// Shoots `samples` cosine-distributed probes of length `radius` from the primary hit of `r`,
+// traced as fans of up to rayFan::maxRays with one traversal per fan. The probe angles are
+// stratified: the hemisphere is cut into samples * strata sectors and probe k takes sector
+// stratum + k * strata, so `strata` pixels with different strata cover it together. Rays that
+// miss the scene count as fully open.
+inline aoPixel ambientOcclusion(const ray& r, const hitable* hitable, const float minDistance,
+                                const float maxDistance, const unsigned int samples,
+                                const float radius, const unsigned int stratum = 0,
+                                const unsigned int strata = 1)
+{
+    hitRecord rec;
+    ++tracedRays;
+    if (!hitable->hit(r, minDistance, maxDistance, rec)) {
+        return aoPixel{vec3(), vec3(), 1.f, false};
+    }
+    const float sectors = float(samples * strata);
+    unsigned int blocked = 0;
+    for (unsigned int first = 0; first < samples; first += rayFan::maxRays) {
+        rayFan probes(rec.point);
+        while (probes.count < rayFan::maxRays && first + probes.count < samples) {
+            const unsigned int sector = stratum + (first + probes.count) * strata;
+            const float angle = (sector + myRandom::next()) / sectors;
+            probes.add(cosineDirection(rec.normal, myRandom::next(), angle));
+        }
+        tracedRays += probes.count;
+        uint32_t mask = hitable->occludedFan(probes, minDistance, radius, probes.all());
+        blocked += __builtin_popcount(mask);
+    }
+    return aoPixel{rec.point, rec.normal, float(samples - blocked) / float(samples), true};
+}
+struct raycastWorldParameters {
+    const float minDistance;
+    const float maxDistance;
+    const unsigned int maxDepth;
+    const unsigned int sampling;
+    const unsigned int width;
+    const unsigned int height;
+    const unsigned int startWidth;
+    const unsigned int endWidth;
+    const unsigned int startHeight;
+    const unsigned int endHeight;
+    const unsigned int channels;
+    // Image row that is stored at the start of `out`; lets a caller pass a buffer that only
+    // holds the rows being rendered.
+    const unsigned int outStartHeight;
+};
+// Writes the linear (HDR) pixel colour as `channels` floats: r, g, b, 1. Gamma and quantization
+// happen in the resolve stage.
+inline void raycastWorld(const raycastWorldParameters& params, const hitable* world,
+                         const camera& cam, float* out)
+{
+    trace::scope span("raycastWorld", params.startHeight);
+    auto t1 = std::chrono::high_resolution_clock::now();
+    const size_t threadId = std::hash<std::thread::id>()(std::this_thread::get_id());
+
+    for (unsigned int j = params.startHeight; j < params.endHeight; ++j) {
+        std::printf("- threadId: %zx %u/%u\n", threadId, j, params.height);
+        for (unsigned int i = params.startWidth; i < params.endWidth; ++i) {
+            vec3 col(0.f, 0.f, 0.f);
+            for (unsigned int s = 0; s < params.sampling; ++s) {
+                float u = float(i + myRandom::next()) / float(params.width);
+                float v = float(j + myRandom::next()) / float(params.height);
+                ray r = cam.getRay(u, v);
+                col += color(r, world, params.minDistance, params.maxDistance,
+                             /* depth */ 0, params.maxDepth);
+            }
+            col /= params.sampling;
+
+            int index = (((j - params.outStartHeight) * params.width) + i) * params.channels;
+
+            out[index + 0] = col.x();
+            out[index + 1] = col.y();
+            out[index + 2] = col.z();
+            out[index + 3] = 1.f;
+        }
+    }
+    auto t2 = std::chrono::high_resolution_clock::now();
+    auto duration = std::chrono::duration_cast<std::chrono::microseconds>(t2 - t1).count() / 1000.0;
+    std::printf("--------------------------\n"
+                "raycastWorld duration for:\n"
+                " startWidth: %u\n"
+                " endWidth: %u\n"
+                " startHeight: %u\n"
+                " endHeight: %u\n"
+                " maxDepth: %u\n"
+                " sampling: %u\n"
+                " threadId: %zx\n"
+                "duration: %.3f ms.\n",
+                params.startWidth, params.endWidth, params.startHeight, params.endHeight,
+                params.maxDepth, params.sampling, threadId, duration);
+}
+
+// First stage of the ambient-occlusion preview: one primary ray per pixel, since a visibility
+// preview does not need antialiasing (`sampling` is not used), and interleaved probes. The
+// `aoSamples` probes of each 2x2 block of pixels are split over its four pixels, at least one
+// per pixel, with one angle stratum each; filterAmbientOcclusion() gathers them again. Writes
+// the rows of `params` to `pixels`, which starts at row outStartHeight.
+inline void raycastAmbientOcclusion(const raycastWorldParameters& params, const hitable* world,
+                                    const camera& cam, const unsigned int aoSamples,
+                                    const float aoRadius, aoPixel* pixels)
+{
+    trace::scope span("raycastAmbientOcclusion", params.startHeight);
+    const unsigned int samples = std::max(1u, (aoSamples + 3) / 4);
+    for (unsigned int j = params.startHeight; j < params.endHeight; ++j) {
+        for (unsigned int i = params.startWidth; i < params.endWidth; ++i) {
+            float u = float(i + myRandom::next()) / float(params.width);
+            float v = float(j + myRandom::next()) / float(params.height);
+            ray r = cam.getRay(u, v);
+            const unsigned int stratum = (j & 1) * 2 + (i & 1);
+            pixels[(j - params.outStartHeight) * params.width + i] =
+                ambientOcclusion(r, world, params.minDistance, params.maxDistance, samples,
+                                 aoRadius, stratum, /* strata */ 4);
+        }
+    }
+}
+
+// Second stage of the ambient-occlusion preview: every hit pixel averages the visibility of the
+// 3x3 pixels around it that lie on the same surface, with a normal within about 25 degrees of
+// its own and a point within `tolerance` of its tangent plane. `pixels` holds the whole image;
+// the rows of `params` go to `out` as r, g, b, 1.
+inline void filterAmbientOcclusion(const raycastWorldParameters& params, const aoPixel* pixels,
+                                   const float tolerance, float* out)
+{
+    trace::scope span("filterAmbientOcclusion", params.startHeight);
+    for (unsigned int j = params.startHeight; j < params.endHeight; ++j) {
+        for (unsigned int i = params.startWidth; i < params.endWidth; ++i) {
+            const aoPixel& center = pixels[j * params.width + i];
+            float visibility = center.visibility;
+            if (center.hit) {
+                float sum = 0.f;
+                unsigned int count = 0;
+                const unsigned int firstRow = j > 0 ? j - 1 : 0;
+                const unsigned int lastRow = std::min(j + 1, params.height - 1);
+                const unsigned int firstColumn = i > 0 ? i - 1 : 0;
+                const unsigned int lastColumn = std::min(i + 1, params.width - 1);
+                for (unsigned int y = firstRow; y <= lastRow; ++y) {
+                    for (unsigned int x = firstColumn; x <= lastColumn; ++x) {
+                        const aoPixel& p = pixels[y * params.width + x];
+                        if (p.hit && vec3::dot(p.normal, center.normal) > 0.9f &&
+                            fabsf(vec3::dot(p.point - center.point, center.normal)) < tolerance) {
+                            sum += p.visibility;
+                            ++count;
+                        }
+                    }
+                }
+                visibility = sum / count;
+            }
+
+            int index = (((j - params.outStartHeight) * params.width) + i) * params.channels;
+
+            out[index + 0] = visibility;
+            out[index + 1] = visibility;
+            out[index + 2] = visibility;
+            out[index + 3] = 1.f;
+        }
+    }
+}
+
+#endif
@@ -0,0 +1,221 @@
+#ifndef RENDERJOB_H
+#define RENDERJOB_H
+
+#include "camera.h"
+#include "hitable.h"
+#include "render.h"
+#include "trace.h"
+#include <atomic>
+#include <condition_variable>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Asynchronous rendering for embedding: submit() returns at once with a handle while worker
+// threads trace the image tile by tile. The caller can poll progress(), get every finished tile
+// through a callback, wait() for the result or cancel(). Workers check for cancellation between
+// rows, so after cancel() they stop within one tile row and wait() returns shortly after.
+// A job can be limited to some of the tiles (numbered row by row), the rest of the image then
+// stays black.
+//
+// The scene, and the environment map and radiance cache in the settings, must outlive the job;
+// the camera and settings are copied. Jobs share no other state, so several can run at once.
+struct renderSettings {
+    float minDistance;
+    float maxDistance;
+    unsigned int maxDepth;
+    unsigned int sampling;
+    unsigned int width;
+    unsigned int height;
+    unsigned int tileSize;
+    unsigned int threadCount;
+    // The job's own lighting; environmentMap::active and radianceCache::active are not used.
+    lighting light = {nullptr, nullptr};
+};
+
+// A finished tile: linear rgba floats, `width * height` of them row by row, at (x, y) of the
+// image. Only valid during the callback.
+struct renderTile {
+    unsigned int x;
+    unsigned int y;
+    unsigned int width;
+    unsigned int height;
+    const float* pixels;
+};
+
+class renderJob
+{
+  public:
+    enum class status { running, completed, cancelled };
+    // Called from the worker threads, possibly concurrently; must not call wait() on its job.
+    typedef std::function<void(const renderTile&)> tileCallback;
+
+    // Returns nullptr when the tile size is 0 or a tile of the list is not in the image.
+    static std::unique_ptr<renderJob> submit(const hitable* world, const camera& cam,
+                                             const renderSettings& settings,
+                                             tileCallback onTile = nullptr,
+                                             std::vector<unsigned int> tiles = {})
+    {
+        if (settings.tileSize == 0) {
+            return nullptr;
+        }
+        const unsigned int tileCount = tilesAcross(settings) * tilesDown(settings);
+        for (unsigned int t : tiles) {
+            if (t >= tileCount) {
+                return nullptr;
+            }
+        }
+        std::unique_ptr<renderJob> job(
+            new renderJob(world, cam, settings, std::move(onTile), std::move(tiles)));
+        job->start();
+        return job;
+    }
+    // Abandoning a job cancels it and waits for the workers.
+    ~renderJob()
+    {
+        cancel();
+        wait();
+    }
+    renderJob(const renderJob&) = delete;
+    renderJob& operator=(const renderJob&) = delete;
+
+    // Finished tiles over the tiles to render, in [0, 1].
+    float progress() const { return renderCount > 0 ? float(tilesDone.load()) / renderCount : 1.f; }
+    void cancel() { cancelled.store(true); }
+    status state() const
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (runningWorkers > 0) {
+            return status::running;
+        }
+        return tilesDone.load() == renderCount ? status::completed : status::cancelled;
+    }
+    // Blocks until the workers have stopped.
+    status wait()
+    {
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            finished.wait(lock, [this]() { return runningWorkers == 0; });
+        }
+        std::lock_guard<std::mutex> lock(joinMutex);
+        for (std::thread& w : workers) {
+            if (w.joinable()) {
+                w.join();
+            }
+        }
+        return tilesDone.load() == renderCount ? status::completed : status::cancelled;
+    }
+    // The image as linear rgba floats, complete once wait() returned status::completed.
+    const std::vector<float>& image() const { return pixels; }
+
+    const renderSettings settings;
+    const unsigned int tileCount;
+    // Tiles the job renders: all of them, or the ones it was given.
+    const std::vector<unsigned int> tiles;
+    const unsigned int renderCount;
+
+  private:
+    renderJob(const hitable* world, const camera& cam, const renderSettings& settings,
+              tileCallback onTile, std::vector<unsigned int> tiles)
+        : settings(settings), tileCount(tilesAcross(settings) * tilesDown(settings)),
+          tiles(std::move(tiles)),
+          renderCount(this->tiles.empty() ? tileCount : (unsigned int)this->tiles.size()),
+          world(world), cam(cam), onTile(std::move(onTile)),
+          pixels((size_t)settings.width * settings.height * 4), nextTile(0), tilesDone(0),
+          cancelled(false), runningWorkers(0)
+    {
+    }
+    static unsigned int tilesAcross(const renderSettings& s)
+    {
+        return (s.width + s.tileSize - 1) / s.tileSize;
+    }
+    static unsigned int tilesDown(const renderSettings& s)
+    {
+        return (s.height + s.tileSize - 1) / s.tileSize;
+    }
+
+    void start()
+    {
+        const unsigned int threadCount = std::max(1u, settings.threadCount);
+        runningWorkers = threadCount;
+        for (unsigned int t = 0; t < threadCount; ++t) {
+            workers.push_back(std::thread([this]() { work(); }));
+        }
+    }
+
+    void work()
+    {
+        trace::setThreadName("render job worker");
+        const unsigned int across = tilesAcross(settings);
+        std::vector<float> tile((size_t)settings.tileSize * settings.tileSize * 4);
+        while (!cancelled.load(std::memory_order_relaxed)) {
+            const unsigned int next = nextTile++;
+            if (next >= renderCount) {
+                break;
+            }
+            const unsigned int t = tiles.empty() ? next : tiles[next];
+            const unsigned int x0 = (t % across) * settings.tileSize;
+            const unsigned int y0 = (t / across) * settings.tileSize;
+            const unsigned int x1 = std::min(settings.width, x0 + settings.tileSize);
+            const unsigned int y1 = std::min(settings.height, y0 + settings.tileSize);
+            if (renderTileRows(x0, y0, x1, y1, tile.data())) {
+                if (onTile) {
+                    onTile(renderTile{x0, y0, x1 - x0, y1 - y0, tile.data()});
+                }
+                tilesDone++;
+            }
+        }
+        std::lock_guard<std::mutex> lock(mutex);
+        if (--runningWorkers == 0) {
+            finished.notify_all();
+        }
+    }
+
+    // Traces a tile into `tile` and the image; false when cancelled part way.
+    bool renderTileRows(unsigned int x0, unsigned int y0, unsigned int x1, unsigned int y1,
+                        float* tile)
+    {
+        trace::scope span("render job tile", y0 * settings.width + x0);
+        const unsigned int tileWidth = x1 - x0;
+        for (unsigned int j = y0; j < y1; ++j) {
+            if (cancelled.load(std::memory_order_relaxed)) {
+                return false;
+            }
+            for (unsigned int i = x0; i < x1; ++i) {
+                vec3 col(0.f, 0.f, 0.f);
+                for (unsigned int s = 0; s < settings.sampling; ++s) {
+                    float u = float(i + myRandom::next()) / float(settings.width);
+                    float v = float(j + myRandom::next()) / float(settings.height);
+                    col += color(cam.getRay(u, v), world, settings.minDistance,
+                                 settings.maxDistance, /* depth */ 0, settings.maxDepth,
+                                 settings.light);
+                }
+                col /= settings.sampling;
+                float* p = tile + ((size_t)(j - y0) * tileWidth + (i - x0)) * 4;
+                float* q = pixels.data() + ((size_t)j * settings.width + i) * 4;
+                p[0] = q[0] = col.x();
+                p[1] = q[1] = col.y();
+                p[2] = q[2] = col.z();
+                p[3] = q[3] = 1.f;
+            }
+        }
+        return true;
+    }
+
+    const hitable* world;
+    const camera cam;
+    const tileCallback onTile;
+    std::vector<float> pixels;
+    std::vector<std::thread> workers;
+    std::atomic_uint nextTile;
+    std::atomic_uint tilesDone;
+    std::atomic_bool cancelled;
+    unsigned int runningWorkers;
+    mutable std::mutex mutex;
+    std::mutex joinMutex;
+    std::condition_variable finished;
+};
+
+#endif
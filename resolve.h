@@ -0,0 +1,98 @@
+#ifndef RESOLVE_H
+#define RESOLVE_H
+
+#include "trace.h"
+#include <algorithm>
+#include <cmath>
+#include <cstddef>
+#include <thread>
+#include <vector>
+
+#if defined(__SSE2__) || defined(_M_X64)
+#include <emmintrin.h>
+#define RESOLVE_SSE
+#endif
+
+// Converts the linear HDR framebuffer (rgba floats) to 8-bit display values: exposure, optional
+// tonemap, gamma 2 (sqrt) and quantization. Kept out of the render loop so the float image is
+// still available for PFM output.
+enum class tonemapOperator { clamp, reinhard };
+
+struct resolveParameters {
+    float exposure;
+    tonemapOperator tonemap;
+};
+
+namespace resolve
+{
+inline unsigned char resolveChannel(float c, const resolveParameters& params)
+{
+    c *= params.exposure;
+    if (params.tonemap == tonemapOperator::reinhard) {
+        c = c / (1.f + c);
+    }
+    c = std::min(sqrtf(std::max(c, 0.f)), 1.f);
+    return (unsigned char)(c * 255.99f);
+}
+
+// `src` is rgba floats, `dst` rgba bytes. Alpha is always written as 255.
+inline void resolveRgba8(const float* src, unsigned char* dst, size_t pixelCount,
+                         const resolveParameters& params)
+{
+    size_t p = 0;
+#ifdef RESOLVE_SSE
+    const __m128 exposure = _mm_set1_ps(params.exposure);
+    const __m128 zero = _mm_setzero_ps();
+    const __m128 one = _mm_set1_ps(1.f);
+    const __m128 scale = _mm_set1_ps(255.99f);
+    const __m128i alpha = _mm_set1_epi32((int)0xFF000000);
+    const bool reinhard = params.tonemap == tonemapOperator::reinhard;
+    // Four pixels per iteration, one pixel per register, packed down to 16 bytes.
+    for (; p + 4 <= pixelCount; p += 4) {
+        __m128i q[4];
+        for (int k = 0; k < 4; ++k) {
+            __m128 c = _mm_mul_ps(_mm_loadu_ps(src + (p + k) * 4), exposure);
+            if (reinhard) {
+                c = _mm_div_ps(c, _mm_add_ps(one, c));
+            }
+            c = _mm_min_ps(_mm_sqrt_ps(_mm_max_ps(c, zero)), one);
+            q[k] = _mm_cvttps_epi32(_mm_mul_ps(c, scale));
+        }
+        __m128i lo = _mm_packs_epi32(q[0], q[1]);
+        __m128i hi = _mm_packs_epi32(q[2], q[3]);
+        __m128i bytes = _mm_or_si128(_mm_packus_epi16(lo, hi), alpha);
+        _mm_storeu_si128((__m128i*)(dst + p * 4), bytes);
+    }
+#endif
+    for (; p < pixelCount; ++p) {
+        dst[p * 4 + 0] = resolveChannel(src[p * 4 + 0], params);
+        dst[p * 4 + 1] = resolveChannel(src[p * 4 + 1], params);
+        dst[p * 4 + 2] = resolveChannel(src[p * 4 + 2], params);
+        dst[p * 4 + 3] = 255;
+    }
+}
+
+// Splits the image into `threadCount` contiguous ranges resolved in parallel.
+inline void parallelResolveRgba8(const float* src, unsigned char* dst, size_t pixelCount,
+                                 const resolveParameters& params, unsigned int threadCount)
+{
+    trace::scope span("resolve");
+    if (threadCount <= 1) {
+        resolveRgba8(src, dst, pixelCount, params);
+        return;
+    }
+    std::vector<std::thread> workers;
+    const size_t step = (pixelCount + threadCount - 1) / threadCount;
+    for (size_t begin = 0; begin < pixelCount; begin += step) {
+        const size_t count = std::min(step, pixelCount - begin);
+        workers.push_back(std::thread([src, dst, begin, count, &params]() {
+            resolveRgba8(src + begin * 4, dst + begin * 4, count, params);
+        }));
+    }
+    for (auto& worker : workers) {
+        worker.join();
+    }
+}
+} // namespace resolve
+
+#endif
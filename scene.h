@@ -0,0 +1,115 @@
+#ifndef SCENE_H
+#define SCENE_H
+
+#include "arena.h"
+#include "grid.h"
+#include "hitable.h"
+#include "lbvh.h"
+#include "materials.h"
+#include "staticScene.h"
+#include "trace.h"
+#include <utility>
+#include <vector>
+
+// Plain-data description of a scene. Building the hitables from it is deterministic, so the same
+// description can be shipped to other processes (see distributed.h) and rebuilt there.
+enum class materialType : unsigned int { lambertian = 0, metal = 1, dielectric = 2 };
+
+struct materialDescription {
+    materialType type;
+    vec3 color;      // albedo for lambertian/metal, mask for dielectric
+    float parameter; // fuzz for metal, refIdx for dielectric
+};
+
+struct sphereDescription {
+    vec3 center;
+    float radius;
+    materialDescription mat;
+};
+
+struct sceneDescription {
+    std::vector<sphereDescription> spheres;
+};
+
+// The primitive types a static scene (staticScene.h) is specialized for.
+typedef staticScene<sphere, triangle> typedScene;
+
+namespace scene
+{
+// Every builder allocates from `arena` when one is given (see arena.h) and from the heap
+// otherwise. Arena-built scenes are released with the arena, never deleted.
+template <typename T, typename... Args> T* create(sceneArena* arena, Args&&... args)
+{
+    return arena != nullptr ? arena->create<T>(std::forward<Args>(args)...)
+                            : new T(std::forward<Args>(args)...);
+}
+
+inline material* buildMaterial(const materialDescription& desc, sceneArena* arena = nullptr)
+{
+    switch (desc.type) {
+        case materialType::metal:
+            return create<metal>(arena, desc.color, desc.parameter);
+        case materialType::dielectric:
+            return create<dielectric>(arena, desc.color, desc.parameter);
+        case materialType::lambertian:
+        default:
+            return create<lambertian>(arena, desc.color);
+    }
+}
+
+// Each material is placed right before the sphere using it, so a hit and the following scatter
+// touch neighbouring memory.
+inline hitable** buildHitables(const sceneDescription& desc, sceneArena* arena = nullptr)
+{
+    trace::scope span("build primitives", desc.spheres.size());
+    const size_t count = desc.spheres.size();
+    hitable** list = arena != nullptr ? arena->createArray<hitable*>(count) : new hitable*[count];
+    for (size_t i = 0; i < count; ++i) {
+        const sphereDescription& s = desc.spheres[i];
+        material* mat = buildMaterial(s.mat, arena);
+        list[i] = create<sphere>(arena, s.center, s.radius, mat);
+    }
+    return list;
+}
+
+// A root bvhNode prints the duration of every hit; `isRoot` false builds one that does not.
+inline hitable* buildBvh(const sceneDescription& desc, sceneArena* arena = nullptr,
+                         bool isRoot = true)
+{
+    hitable** list = buildHitables(desc, arena);
+    trace::scope span("bvh build", desc.spheres.size());
+    return create<bvhNode>(arena, list, (int)desc.spheres.size(), isRoot, arena);
+}
+
+// Same scene with the parallel Morton-code builder (see lbvh.h), which needs an arena.
+inline hitable* buildLinearBvh(const sceneDescription& desc, sceneArena& arena,
+                               unsigned int threadCount, lbvh::buildStats* stats = nullptr)
+{
+    hitable** list = buildHitables(desc, &arena);
+    return lbvh::build(list, (unsigned int)desc.spheres.size(), arena, threadCount, stats);
+}
+
+// Same scene as typed primitive arrays with non-virtual intersection (see staticScene.h), which
+// needs an arena.
+inline hitable* buildStatic(const sceneDescription& desc, sceneArena& arena)
+{
+    hitable** list = buildHitables(desc, &arena);
+    return arena.create<typedScene>(list, (unsigned int)desc.spheres.size(), arena);
+}
+
+// Uniform grid with the big primitives (the ground) in a separate list, see grid.h.
+inline hitable* buildGrid(const sceneDescription& desc, sceneArena* arena = nullptr)
+{
+    hitable** list = buildHitables(desc, arena);
+    trace::scope span("grid build", desc.spheres.size());
+    return create<uniformGrid>(arena, list, (unsigned int)desc.spheres.size(), arena);
+}
+
+inline hitable* buildList(const sceneDescription& desc, sceneArena* arena = nullptr)
+{
+    hitable** list = buildHitables(desc, arena);
+    return create<hitableList>(arena, list, (unsigned int)desc.spheres.size());
+}
+} // namespace scene
+
+#endif
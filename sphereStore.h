@@ -0,0 +1,189 @@
+#ifndef SPHERESTORE_H
+#define SPHERESTORE_H
+
+#include "arena.h"
+#include "lbvh.h"
+#include "scene.h"
+#include "trace.h"
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <vector>
+
+// Spheres as plain arrays: 16 bytes of geometry and a 2 byte index into a small material palette
+// per sphere, instead of a polymorphic object and a material object each. Acceleration structures
+// built over the store (see packedBvh.h) read it directly.
+struct packedSphere {
+    float x;
+    float y;
+    float z;
+    float radius;
+};
+
+class sphereStore
+{
+  public:
+    inline size_t size() const { return spheres.size(); }
+    // Bytes of sphere and material index data plus the palette descriptions.
+    inline size_t memoryBytes() const
+    {
+        return spheres.size() * sizeof(packedSphere) + materialIndices.size() * sizeof(uint16_t) +
+               palette.size() * sizeof(materialDescription);
+    }
+    // One material object per palette entry, allocated from `arena`.
+    material** buildMaterials(sceneArena& arena) const
+    {
+        material** materials = arena.createArray<material*>(palette.size());
+        for (size_t m = 0; m < palette.size(); ++m) {
+            materials[m] = scene::buildMaterial(palette[m], &arena);
+        }
+        return materials;
+    }
+
+    std::vector<packedSphere> spheres;
+    std::vector<uint16_t> materialIndices;
+    std::vector<materialDescription> palette;
+};
+
+// The random sphere field of the demo scene at any size. Small spheres sit jittered on a square
+// grid of `density` cells per unit^2 covering [-extent, extent]^2 of the ground, with radius
+// 0.2 / sqrt(density) so the field looks the same at every density.
+struct sceneParameters {
+    float extent;           // 22 is the classic scene
+    float density;          // small spheres per unit^2
+    float diffuseFraction;  // of the small spheres; then metal, the rest is glass
+    float metalFraction;
+    unsigned int seed;
+    unsigned int paletteSize; // distinct diffuse and metal materials each, at most 32765
+};
+
+namespace scene
+{
+// The palette holds the ground, brown, glass and bronze materials of the classic scene, then
+// `paletteSize` diffuse and as many metal ones, then the glass of the small spheres. All of them
+// must be addressable by the 16 bit material index.
+constexpr unsigned int fixedPaletteEntries = 5;
+constexpr unsigned int maxPaletteSize = (65535 - fixedPaletteEntries) / 2;
+static_assert(fixedPaletteEntries + 2 * maxPaletteSize <= 65536,
+              "palette entries must fit the uint16_t material index");
+
+// Extent that gives about `count` small spheres at `density`.
+inline float extentForCount(size_t count, float density)
+{
+    return 0.5f * sqrtf(count / density);
+}
+
+// Uniform float in [0, 1) from (seed, stream, index), so every sphere is generated
+// independently of the others and of the thread count.
+inline float hashToUnit(uint32_t seed, uint32_t stream, uint64_t index)
+{
+    uint64_t h = index * 0x9E3779B97F4A7C15ull ^ ((uint64_t)seed << 32 | stream);
+    h ^= h >> 33;
+    h *= 0xFF51AFD7ED558CCDull;
+    h ^= h >> 33;
+    h *= 0xC4CEB9FE1A85EC53ull;
+    h ^= h >> 33;
+    return (h >> 40) * (1.f / 16777216.f);
+}
+
+// Same layout as the classic scene: the ground, the small spheres and three large ones. Spheres
+// that would overlap a large one are left out.
+inline sphereStore generateSpheres(const sceneParameters& params, unsigned int threadCount)
+{
+    trace::scope span("generate spheres");
+    sphereStore store;
+    std::vector<materialDescription>& palette = store.palette;
+    palette.push_back({materialType::lambertian, vec3(0.5f, 0.5f, 0.5f), 0.f});
+    palette.push_back({materialType::lambertian, vec3(0.4f, 0.2f, 0.1f), 0.f});
+    palette.push_back({materialType::dielectric, vec3(1.f, 1.f, 1.f), 1.5f});
+    palette.push_back({materialType::metal, vec3(0.7f, 0.6f, 0.5f), 0.f});
+    const unsigned int paletteSize = std::min(params.paletteSize, maxPaletteSize);
+    const uint16_t firstDiffuse = (uint16_t)palette.size();
+    for (unsigned int m = 0; m < paletteSize; ++m) {
+        auto r = [&](uint32_t k) { return hashToUnit(params.seed, 1000 + k, m); };
+        palette.push_back({materialType::lambertian,
+                           vec3(r(0) * r(1), r(2) * r(3), r(4) * r(5)), 0.f});
+    }
+    const uint16_t firstMetal = (uint16_t)palette.size();
+    for (unsigned int m = 0; m < paletteSize; ++m) {
+        auto r = [&](uint32_t k) { return hashToUnit(params.seed, 2000 + k, m); };
+        palette.push_back({materialType::metal,
+                           vec3(0.5f * (1 + r(0)), 0.5f * (1 + r(1)), 0.5f * (1 + r(2))),
+                           0.5f * r(3)});
+    }
+    const uint16_t glass = (uint16_t)palette.size();
+    palette.push_back({materialType::dielectric, vec3(1.f, 1.f, 1.f), 1.5f});
+
+    const packedSphere large[3] = {{-6, 1.5f, -4, 1.5f}, {-2, 1.5f, -4, 1.5f}, {2, 1.5f, -4, 1.5f}};
+    const float cell = 1.f / sqrtf(params.density);
+    const float radius = 0.2f * cell;
+    const size_t side = (size_t)ceilf(2 * params.extent / cell);
+    const size_t cellCount = side * side;
+    store.spheres.resize(1 + cellCount + 3);
+    store.materialIndices.resize(1 + cellCount + 3);
+    store.spheres[0] = packedSphere{0, -1000, 0, 1000};
+    store.materialIndices[0] = 0;
+    // Cells are written in place and rejected ones marked with radius 0, then compacted.
+    lbvh::parallelFor(cellCount, threadCount, [&](size_t begin, size_t end, unsigned int) {
+        for (size_t k = begin; k < end; ++k) {
+            const float x =
+                -params.extent + ((k % side) + 0.9f * hashToUnit(params.seed, 0, k)) * cell;
+            const float z =
+                -params.extent + ((k / side) + 0.9f * hashToUnit(params.seed, 1, k)) * cell;
+            packedSphere s{x, radius, z, radius};
+            for (const packedSphere& l : large) {
+                const float dx = x - l.x, dy = radius - l.y, dz = z - l.z;
+                if (dx * dx + dy * dy + dz * dz < (l.radius + radius) * (l.radius + radius)) {
+                    s.radius = 0.f;
+                }
+            }
+            const float choose = hashToUnit(params.seed, 2, k);
+            const uint32_t pick =
+                std::min(paletteSize - 1, (uint32_t)(hashToUnit(params.seed, 3, k) * paletteSize));
+            uint16_t m = glass;
+            if (choose < params.diffuseFraction) {
+                m = firstDiffuse + pick;
+            } else if (choose < params.diffuseFraction + params.metalFraction) {
+                m = firstMetal + pick;
+            }
+            store.spheres[1 + k] = s;
+            store.materialIndices[1 + k] = m;
+        }
+    });
+    size_t kept = 1;
+    for (size_t k = 1; k <= cellCount; ++k) {
+        if (store.spheres[k].radius > 0.f) {
+            store.spheres[kept] = store.spheres[k];
+            store.materialIndices[kept] = store.materialIndices[k];
+            ++kept;
+        }
+    }
+    for (int l = 0; l < 3; ++l) {
+        store.spheres[kept] = large[l];
+        store.materialIndices[kept] = (uint16_t)(1 + l);
+        ++kept;
+    }
+    store.spheres.resize(kept);
+    store.spheres.shrink_to_fit();
+    store.materialIndices.resize(kept);
+    store.materialIndices.shrink_to_fit();
+    return store;
+}
+
+// Polymorphic spheres for the store, sharing the palette materials, for comparisons with the
+// hitable based accelerators.
+inline hitable** buildHitables(const sphereStore& store, sceneArena& arena)
+{
+    trace::scope span("build primitives", store.size());
+    material** materials = store.buildMaterials(arena);
+    hitable** list = arena.createArray<hitable*>(store.size());
+    for (size_t i = 0; i < store.size(); ++i) {
+        const packedSphere& s = store.spheres[i];
+        list[i] = arena.create<sphere>(vec3(s.x, s.y, s.z), s.radius,
+                                       materials[store.materialIndices[i]]);
+    }
+    return list;
+}
+} // namespace scene
+
+#endif
@@ -0,0 +1,289 @@
+#ifndef STATICSCENE_H
+#define STATICSCENE_H
+
+#include "arena.h"
+#include "hitable.h"
+#include "trace.h"
+#include <algorithm>
+#include <cfloat>
+#include <cstdint>
+#include <tuple>
+#include <type_traits>
+#include <typeinfo>
+#include <utility>
+#include <vector>
+
+// Scene whose primitive types are fixed at compile time. Every type gets its own array, copied
+// from the hitable list, and the BVH over them has leaves that cover a range of one array: the
+// leaf's type tag picks the array and the intersection is called non-virtually
+// (`T::intersect`), so traversal and intersection are inlined per type. Only the surface of the
+// closest hit goes through a virtual call. The scene itself is still a hitable, usable wherever
+// the dynamic accelerators are.
+//
+// Nodes split at the centroid median of their widest axis, as lazyBvh does; a leaf that would
+// mix types is split by type first. Primitives of other types than `Primitives` are left out and
+// counted in `skipped`. The arrays and nodes come from the arena.
+template <typename... Primitives> class staticScene : public hitable
+{
+  public:
+    static constexpr unsigned int typeCount = sizeof...(Primitives);
+
+    struct node {
+        float min[3];
+        float max[3];
+        uint32_t first; // first primitive of a leaf in its type's array, left child otherwise
+        uint16_t count; // primitives of a leaf, 0 for an internal node (right child follows)
+        uint16_t type;  // index into Primitives of a leaf
+    };
+
+    staticScene(hitable** list, unsigned int count, sceneArena& arena, unsigned int leafSize = 4)
+        : leafSize(std::max(1u, std::min(leafSize, 0xFFFFu))), skipped(0), nodes(nullptr),
+          nodeCount(0)
+    {
+        trace::scope span("static scene build", count);
+        std::vector<reference> references;
+        references.reserve(count);
+        for (unsigned int i = 0; i < count; ++i) {
+            const unsigned int type = typeOf(*list[i], std::index_sequence_for<Primitives...>());
+            if (type == typeCount) {
+                ++skipped;
+                continue;
+            }
+            references.push_back(reference{list[i], list[i]->boundingBox(),
+                                           list[i]->centeroid(), (uint16_t)type});
+        }
+        if (references.empty()) {
+            return;
+        }
+        std::vector<node> built;
+        built.reserve(2 * (references.size() / this->leafSize) + 1);
+        built.push_back(node{});
+        std::vector<const hitable*> order[typeCount];
+        buildRange(built, order, references.data(), 0, 0, references.size());
+        nodeCount = built.size();
+        nodes = arena.createArray<node>(nodeCount);
+        std::copy(built.begin(), built.end(), nodes);
+        fillArrays(order, arena, std::index_sequence_for<Primitives...>());
+    }
+    staticScene(const staticScene&) = delete;
+    staticScene& operator=(const staticScene&) = delete;
+
+    virtual bool intersect(const ray& r, float tMin, float tMax, hitCandidate& candidate) const
+    {
+        bool isHit = false;
+        traverse(r, tMin, tMax, [&](const auto& primitive) {
+            typedef typename std::decay<decltype(primitive)>::type primitiveType;
+            if (primitive.primitiveType::intersect(r, tMin, tMax, candidate)) {
+                tMax = candidate.distance;
+                isHit = true;
+            }
+            return false;
+        });
+        return isHit;
+    }
+    virtual bool occluded(const ray& r, float tMin, float tMax) const
+    {
+        return traverse(r, tMin, tMax, [&](const auto& primitive) {
+            typedef typename std::decay<decltype(primitive)>::type primitiveType;
+            return primitive.primitiveType::occluded(r, tMin, tMax);
+        });
+    }
+    virtual aabb boundingBox() const
+    {
+        if (nodeCount == 0) {
+            return aabb();
+        }
+        return aabb(vec3(nodes[0].min[0], nodes[0].min[1], nodes[0].min[2]),
+                    vec3(nodes[0].max[0], nodes[0].max[1], nodes[0].max[2]));
+    }
+    virtual vec3 centeroid() const
+    {
+        aabb box = boundingBox();
+        return (box.min() + box.max()) / 2.f;
+    }
+
+    // Primitives of type T in the scene.
+    template <typename T> inline unsigned int primitiveCount() const
+    {
+        return std::get<typedArray<T>>(arrays).count;
+    }
+    // Bytes of the nodes and primitive arrays.
+    inline size_t memoryBytes() const
+    {
+        return nodeCount * sizeof(node) + arrayBytes(std::index_sequence_for<Primitives...>());
+    }
+
+    const unsigned int leafSize;
+    unsigned int skipped;
+    node* nodes;
+    size_t nodeCount;
+
+  private:
+    template <typename T> struct typedArray {
+        T* items = nullptr;
+        unsigned int count = 0;
+    };
+    struct reference {
+        const hitable* primitive;
+        aabb box;
+        vec3 centroid;
+        uint16_t type;
+    };
+
+    // Index of the dynamic type of `h` in Primitives, typeCount when it is none of them.
+    template <size_t... I>
+    static unsigned int typeOf(const hitable& h, std::index_sequence<I...>)
+    {
+        unsigned int type = typeCount;
+        ((type == typeCount && typeid(h) == typeid(Primitives) ? type = I : 0), ...);
+        return type;
+    }
+
+    // Fills built[index] for references [begin, end) and returns its bounds. Leaves append
+    // their primitives to the order of their type.
+    aabb buildRange(std::vector<node>& built, std::vector<const hitable*>* order,
+                    reference* references, size_t index, size_t begin, size_t end)
+    {
+        aabb box = references[begin].box;
+        for (size_t i = begin + 1; i < end; ++i) {
+            box.expandToInclude(references[i].box);
+        }
+        const uint16_t type = references[begin].type;
+        auto sameType = [type](const reference& r) { return r.type == type; };
+        const bool small = end - begin <= leafSize;
+        if (small && std::all_of(references + begin, references + end, sameType)) {
+            built[index].first = (uint32_t)order[type].size();
+            built[index].count = (uint16_t)(end - begin);
+            built[index].type = type;
+            for (size_t i = begin; i < end; ++i) {
+                order[type].push_back(references[i].primitive);
+            }
+        } else {
+            size_t split;
+            if (small) {
+                split = std::partition(references + begin, references + end, sameType) -
+                        references;
+            } else {
+                aabb centroids(references[begin].centroid);
+                for (size_t i = begin + 1; i < end; ++i) {
+                    centroids.expandToInclude(references[i].centroid);
+                }
+                const unsigned int axis = centroids.maxDimension();
+                split = begin + (end - begin) / 2;
+                std::nth_element(references + begin, references + split, references + end,
+                                 [axis](const reference& a, const reference& b) {
+                                     return a.centroid[axis] < b.centroid[axis];
+                                 });
+            }
+            const size_t left = built.size();
+            built.push_back(node{});
+            built.push_back(node{});
+            buildRange(built, order, references, left, begin, split);
+            buildRange(built, order, references, left + 1, split, end);
+            built[index].first = (uint32_t)left;
+            built[index].count = 0;
+        }
+        for (int a = 0; a < 3; ++a) {
+            built[index].min[a] = box.min()[a];
+            built[index].max[a] = box.max()[a];
+        }
+        return box;
+    }
+
+    // Copies the primitives of every type into its array, in leaf order.
+    template <size_t... I>
+    void fillArrays(const std::vector<const hitable*>* order, sceneArena& arena,
+                    std::index_sequence<I...>)
+    {
+        (fillArray<I>(order[I], arena), ...);
+    }
+    template <size_t I> void fillArray(const std::vector<const hitable*>& order, sceneArena& arena)
+    {
+        typedef typename std::tuple_element<I, std::tuple<Primitives...>>::type type;
+        typedArray<type>& array = std::get<I>(arrays);
+        array.count = (unsigned int)order.size();
+        array.items = arena.createArray<type>(order.size());
+        for (size_t i = 0; i < order.size(); ++i) {
+            array.items[i] = static_cast<const type&>(*order[i]);
+        }
+    }
+    template <size_t... I> size_t arrayBytes(std::index_sequence<I...>) const
+    {
+        return (size_t(0) + ... + (std::get<I>(arrays).count * sizeof(Primitives)));
+    }
+
+    // Entry distance of the ray into node n within (tMin, tMax), or FLT_MAX when it misses.
+    inline float enter(const node& n, const vec3& origin, const float* invDirection, float tMin,
+                       float tMax) const
+    {
+        countBoxTest();
+        for (int a = 0; a < 3; ++a) {
+            float t0 = (n.min[a] - origin[a]) * invDirection[a];
+            float t1 = (n.max[a] - origin[a]) * invDirection[a];
+            if (invDirection[a] < 0.f) {
+                std::swap(t0, t1);
+            }
+            tMin = std::max(tMin, t0);
+            tMax = std::min(tMax, t1);
+            if (tMax <= tMin) {
+                return FLT_MAX;
+            }
+        }
+        return tMin;
+    }
+
+    // Calls visit on the primitives of leaf n with their static type, until it returns true.
+    template <typename Visit, size_t... I>
+    inline bool visitLeaf(const node& n, Visit& visit, std::index_sequence<I...>) const
+    {
+        bool stop = false;
+        ((n.type == I ? stop = visitRange<I>(n, visit) : false), ...);
+        return stop;
+    }
+    template <size_t I, typename Visit> inline bool visitRange(const node& n, Visit& visit) const
+    {
+        const auto& array = std::get<I>(arrays);
+        for (uint32_t i = n.first; i < n.first + n.count; ++i) {
+            if (visit(array.items[i])) {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    // Calls visit(primitive) for the primitives of the leaves the ray reaches, left child first
+    // as in lazyBvh; visit may lower tMax and stops the traversal by returning true, as does
+    // traverse.
+    template <typename Visit>
+    bool traverse(const ray& r, float tMin, float& tMax, Visit visit) const
+    {
+        if (nodeCount == 0) {
+            return false;
+        }
+        const float invDirection[3] = {1 / r.direction.x(), 1 / r.direction.y(),
+                                       1 / r.direction.z()};
+        uint32_t stack[64];
+        int top = 0;
+        stack[top++] = 0;
+        while (top > 0) {
+            const node& n = nodes[stack[--top]];
+            if (enter(n, r.origin, invDirection, tMin, tMax) == FLT_MAX) {
+                continue;
+            }
+            countNodeVisit();
+            if (n.count > 0) {
+                if (visitLeaf(n, visit, std::index_sequence_for<Primitives...>())) {
+                    return true;
+                }
+                continue;
+            }
+            stack[top++] = n.first + 1;
+            stack[top++] = n.first;
+        }
+        return false;
+    }
+
+    std::tuple<typedArray<Primitives>...> arrays;
+};
+
+#endif
@@ -0,0 +1,128 @@
+#ifndef STREAMINGIMAGE_H
+#define STREAMINGIMAGE_H
+
+#include "resolve.h"
+#include <condition_variable>
+#include <cstdio>
+#include <mutex>
+#include <vector>
+
+// Binary PPM (P6) writer. The header only needs the image size, so rows can be appended as they
+// are finished and nothing but the current rows has to stay in memory.
+class ppmStreamWriter
+{
+  public:
+    ppmStreamWriter(const char* path, unsigned int width, unsigned int height)
+        : width(width), height(height), rowsWritten(0), rgb(width * 3)
+    {
+        file = std::fopen(path, "wb");
+        if (file != nullptr) {
+            std::fprintf(file, "P6\n%u %u\n255\n", width, height);
+        }
+    }
+    ~ppmStreamWriter()
+    {
+        if (file != nullptr) {
+            std::fclose(file);
+        }
+    }
+
+    inline bool isOpen() const { return file != nullptr; }
+
+    // Appends rows in top-to-bottom order. Input has `channels` bytes per pixel (rgb or rgba).
+    bool writeRows(const unsigned char* rows, unsigned int rowCount, unsigned int channels)
+    {
+        if (file == nullptr || rowsWritten + rowCount > height) {
+            return false;
+        }
+        for (unsigned int j = 0; j < rowCount; ++j) {
+            const unsigned char* row = rows + (j * width * channels);
+            for (unsigned int i = 0; i < width; ++i) {
+                rgb[i * 3 + 0] = row[i * channels + 0];
+                rgb[i * 3 + 1] = row[i * channels + 1];
+                rgb[i * 3 + 2] = row[i * channels + 2];
+            }
+            if (std::fwrite(rgb.data(), 1, rgb.size(), file) != rgb.size()) {
+                return false;
+            }
+        }
+        rowsWritten += rowCount;
+        return true;
+    }
+
+    unsigned int width;
+    unsigned int height;
+    unsigned int rowsWritten;
+
+  private:
+    std::FILE* file;
+    std::vector<unsigned char> rgb;
+};
+
+// Ring buffer of `windowRows` linear HDR image rows between the render workers and a
+// ppmStreamWriter. Rows may finish out of order; every contiguous run of finished rows at the
+// front of the window is resolved to 8-bit, flushed to disk and its slots are reused. A worker
+// asking for a row that is more than `windowRows` ahead of the flushed front blocks until the
+// front catches up, so memory stays at windowRows * width * channels floats regardless of the
+// image height.
+class streamingFramebuffer
+{
+  public:
+    streamingFramebuffer(ppmStreamWriter& writer, unsigned int channels, unsigned int windowRows,
+                         const resolveParameters& resolveParams)
+        : writer(writer), channels(channels), windowRows(windowRows),
+          rowFloats(writer.width * channels), flushedRows(0), flushFailed(false),
+          resolveParams(resolveParams), window(windowRows * writer.width * channels),
+          resolved(writer.width * 4), finished(windowRows, false)
+    {
+    }
+
+    // Returns the slot that row `j` renders into. Blocks while the slot is still in use.
+    float* acquireRow(unsigned int j)
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        rowFlushed.wait(lock, [this, j]() { return j < flushedRows + windowRows; });
+        return window.data() + (j % windowRows) * rowFloats;
+    }
+
+    // Marks row `j` as finished and flushes every finished row at the front of the window.
+    void commitRow(unsigned int j)
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        finished[j % windowRows] = true;
+        while (flushedRows < writer.height && finished[flushedRows % windowRows]) {
+            const unsigned int slot = flushedRows % windowRows;
+            resolve::resolveRgba8(window.data() + slot * rowFloats, resolved.data(), writer.width,
+                                  resolveParams);
+            if (!writer.writeRows(resolved.data(), 1, 4)) {
+                flushFailed = true;
+            }
+            finished[slot] = false;
+            ++flushedRows;
+        }
+        rowFlushed.notify_all();
+    }
+
+    inline unsigned int flushed() const { return flushedRows; }
+    inline bool failed() const { return flushFailed; }
+    inline size_t residentBytes() const
+    {
+        return window.size() * sizeof(float) + resolved.size();
+    }
+
+  private:
+    ppmStreamWriter& writer;
+    const unsigned int channels;
+    const unsigned int windowRows;
+    const unsigned int rowFloats;
+    unsigned int flushedRows;
+    bool flushFailed;
+    const resolveParameters resolveParams;
+    std::vector<float> window;
+    std::vector<unsigned char> resolved;
+    std::vector<bool> finished;
+    std::mutex mutex;
+    std::condition_variable rowFlushed;
+};
+
+#endif
@@ -0,0 +1,40 @@
+#ifndef TEXTURE_H
+#define TEXTURE_H
+
+#include "vec3.h"
+
+// Colour lookup for materials. `footprint` is the size of the shaded area in uv units, used by
+// filtered textures to pick a mip level.
+class texture
+{
+  public:
+    virtual ~texture() {}
+    virtual vec3 value(float u, float v, float footprint) const = 0;
+
+    // Angle covered by one pixel of the camera, in radians: the spread of primary ray cones.
+    static inline float pixelSpread = 0.f;
+};
+
+// Ray cone of the path being shaded on this thread (Akenine-Moller et al., "Texture Level of
+// Detail Strategies for Real-Time Ray Tracing"). The integrator starts it at the camera with
+// texture::pixelSpread and widens it by spread * distance at every hit; rough materials widen the
+// spread of the rays they scatter, so bounces read coarse mip levels.
+struct rayCone {
+    float width;  // world units at the current hit
+    float spread; // radians
+};
+inline thread_local rayCone textureCone = {0.f, 0.f};
+
+class constantTexture : public texture
+{
+  public:
+    constantTexture(const vec3& color) : color(color) {}
+    virtual vec3 value(float /* u */, float /* v */, float /* footprint */) const
+    {
+        return color;
+    }
+
+    vec3 color;
+};
+
+#endif
@@ -0,0 +1,382 @@
+#ifndef TEXTURECACHE_H
+#define TEXTURECACHE_H
+
+#include "external\stb_image.h"
+#include "texture.h"
+#include "trace.h"
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+// Tiled, mip-mapped image textures under a memory budget.
+//
+// add() decodes an image once and writes its full mip chain as square rgba8 tiles to
+// "<image>.tiles" next to it (reused on later runs when present), then drops the decoded image.
+// Rendering only reads tiles: a tile is loaded from the tiles file on its first use and the least
+// recently used tiles are evicted whenever the resident tiles exceed the budget, so the textures
+// of a scene can be much larger than the memory given to them.
+//
+// Tiles are spread by key over up to `maxShards` independently locked shards, each with its own
+// LRU list and an even share of the budget (at least one tile), so render threads sampling
+// different tiles rarely wait for each other. A lock is only held around the lookup: a missing
+// tile is inserted as pending and read from disk unlocked, threads wanting it wait for it. Tiles
+// being read are never evicted, so the resident bytes can briefly pass the budget by a few tiles.
+//
+// Tile file: uint32 magic, width, height, levelCount, tileSize, then the tiles of every level
+// from full resolution down to 1x1, row by row, each tileSize * tileSize * 4 bytes.
+class textureCache
+{
+  public:
+    struct stats {
+        unsigned long long lookups; // tile lookups, one per texel read
+        unsigned long long hits;
+        unsigned long long misses; // tile loads from disk
+        unsigned long long evictions;
+        size_t residentBytes;
+        size_t peakResidentBytes;
+        size_t budgetBytes;
+        size_t fullResolutionBytes; // all level 0 images as rgba8, for comparison
+    };
+
+    textureCache(size_t budgetBytes, unsigned int tileSize = 64)
+        : tileSize(tileSize), tileBytes((size_t)tileSize * tileSize * 4),
+          budgetBytes(budgetBytes),
+          shards(std::min(std::max(budgetBytes / tileBytes, (size_t)1), (size_t)maxShards)),
+          shardBudgetBytes(budgetBytes / shards),
+          fullResolutionBytes(0), residentBytes(0), peakResidentBytes(0)
+    {
+    }
+    ~textureCache()
+    {
+        for (textureInfo& t : textures) {
+            if (t.file != nullptr) {
+                std::fclose(t.file);
+            }
+        }
+    }
+    textureCache(const textureCache&) = delete;
+    textureCache& operator=(const textureCache&) = delete;
+
+    // Returns the texture id, or -1 when the image can not be read.
+    int add(const char* path)
+    {
+        textureInfo t;
+        t.path = std::string(path) + ".tiles";
+        t.file = std::fopen(t.path.c_str(), "rb");
+        if (t.file == nullptr || !readHeader(t)) {
+            if (t.file != nullptr) {
+                std::fclose(t.file);
+            }
+            if (!convert(path, t.path.c_str())) {
+                return -1;
+            }
+            t.file = std::fopen(t.path.c_str(), "rb");
+            if (t.file == nullptr || !readHeader(t)) {
+                return -1;
+            }
+        }
+        t.fileMutex.reset(new std::mutex());
+        std::lock_guard<std::mutex> lock(texturesMutex);
+        fullResolutionBytes += (size_t)t.levels[0].width * t.levels[0].height * 4;
+        textures.push_back(std::move(t));
+        return (int)textures.size() - 1;
+    }
+
+    inline unsigned int width(int id) const { return textures[id].levels[0].width; }
+    inline unsigned int height(int id) const { return textures[id].levels[0].height; }
+
+    // Trilinear lookup with repeating uv; `lod` 0 is full resolution. Colours are decoded from
+    // gamma 2 to match the resolve stage.
+    vec3 sample(int id, float u, float v, float lod)
+    {
+        const textureInfo& t = textures[id];
+        lod = std::min(std::max(lod, 0.f), (float)(t.levels.size() - 1));
+        const unsigned int level = (unsigned int)lod;
+        const float f = lod - level;
+        vec3 c = bilinear(id, level, u, v);
+        if (f > 0.f && level + 1 < t.levels.size()) {
+            c = c * (1.f - f) + bilinear(id, level + 1, u, v) * f;
+        }
+        return c;
+    }
+
+    stats statistics()
+    {
+        stats result{0, 0, 0, 0, residentBytes.load(), peakResidentBytes.load(), budgetBytes, 0};
+        for (unsigned int i = 0; i < shards; ++i) {
+            shard& s = shardList[i];
+            std::lock_guard<std::mutex> lock(s.mutex);
+            result.lookups += s.lookups;
+            result.hits += s.hits;
+            result.misses += s.misses;
+            result.evictions += s.evictions;
+        }
+        std::lock_guard<std::mutex> lock(texturesMutex);
+        result.fullResolutionBytes = fullResolutionBytes;
+        return result;
+    }
+
+    const unsigned int tileSize;
+
+  private:
+    struct levelInfo {
+        unsigned int width;
+        unsigned int height;
+        unsigned int tilesX;
+        unsigned int tilesY;
+        uint64_t offset; // of the first tile in the tiles file
+    };
+    struct textureInfo {
+        std::string path;
+        std::FILE* file;
+        std::unique_ptr<std::mutex> fileMutex; // around seek and read of `file`
+        std::vector<levelInfo> levels;
+    };
+    struct tile {
+        uint64_t key;
+        bool ready;        // false while its pixels are read
+        unsigned int pins; // the loading thread and waiting ones; pinned tiles are not evicted
+        std::vector<unsigned char> pixels;
+    };
+    struct shard {
+        std::mutex mutex;
+        std::condition_variable loaded;
+        std::list<tile> lru; // most recently used first
+        std::unordered_map<uint64_t, std::list<tile>::iterator> index;
+        size_t residentBytes = 0;
+        unsigned long long lookups = 0;
+        unsigned long long hits = 0;
+        unsigned long long misses = 0;
+        unsigned long long evictions = 0;
+    };
+    static const uint32_t magic = 0x53454C54; // "TLES"
+    static const unsigned int maxShards = 16;
+
+    // 64 bit offsets, tiles files of large texture sets pass 2 GB.
+    static bool seek(std::FILE* file, uint64_t offset)
+    {
+#ifdef _WIN32
+        return _fseeki64(file, (__int64)offset, SEEK_SET) == 0;
+#else
+        return fseeko(file, (off_t)offset, SEEK_SET) == 0;
+#endif
+    }
+
+    std::vector<levelInfo> layout(unsigned int width, unsigned int height) const
+    {
+        std::vector<levelInfo> levels;
+        uint64_t offset = 5 * sizeof(uint32_t);
+        while (true) {
+            levelInfo l{width, height, (width + tileSize - 1) / tileSize,
+                        (height + tileSize - 1) / tileSize, offset};
+            levels.push_back(l);
+            offset += (uint64_t)l.tilesX * l.tilesY * tileBytes;
+            if (width == 1 && height == 1) {
+                return levels;
+            }
+            width = std::max(1u, width / 2);
+            height = std::max(1u, height / 2);
+        }
+    }
+
+    bool readHeader(textureInfo& t) const
+    {
+        uint32_t header[5];
+        if (std::fread(header, sizeof(uint32_t), 5, t.file) != 5 || header[0] != magic ||
+            header[4] != tileSize) {
+            return false;
+        }
+        t.levels = layout(header[1], header[2]);
+        return t.levels.size() == header[3];
+    }
+
+    // Decodes the image, builds the mip chain with a 2x2 box filter and writes it tiled.
+    bool convert(const char* imagePath, const char* tilesPath) const
+    {
+        trace::scope span("texture convert");
+        int w, h, n;
+        unsigned char* image = stbi_load(imagePath, &w, &h, &n, 4);
+        if (image == nullptr) {
+            return false;
+        }
+        std::FILE* file = std::fopen(tilesPath, "wb");
+        if (file == nullptr) {
+            stbi_image_free(image);
+            return false;
+        }
+        const std::vector<levelInfo> levels = layout(w, h);
+        const uint32_t header[5] = {magic, (uint32_t)w, (uint32_t)h, (uint32_t)levels.size(),
+                                    tileSize};
+        bool ok = std::fwrite(header, sizeof(uint32_t), 5, file) == 5;
+        std::vector<unsigned char> current(image, image + (size_t)w * h * 4), next;
+        stbi_image_free(image);
+        std::vector<unsigned char> tilePixels(tileBytes);
+        for (size_t l = 0; ok && l < levels.size(); ++l) {
+            const levelInfo& level = levels[l];
+            for (unsigned int ty = 0; ok && ty < level.tilesY; ++ty) {
+                for (unsigned int tx = 0; ok && tx < level.tilesX; ++tx) {
+                    for (unsigned int y = 0; y < tileSize; ++y) {
+                        for (unsigned int x = 0; x < tileSize; ++x) {
+                            const unsigned int sx = std::min(tx * tileSize + x, level.width - 1);
+                            const unsigned int sy = std::min(ty * tileSize + y, level.height - 1);
+                            const unsigned char* src =
+                                current.data() + ((size_t)sy * level.width + sx) * 4;
+                            std::copy(src, src + 4, tilePixels.data() + (y * tileSize + x) * 4);
+                        }
+                    }
+                    ok = std::fwrite(tilePixels.data(), 1, tileBytes, file) == tileBytes;
+                }
+            }
+            if (l + 1 < levels.size()) {
+                const levelInfo& down = levels[l + 1];
+                next.resize((size_t)down.width * down.height * 4);
+                for (unsigned int y = 0; y < down.height; ++y) {
+                    for (unsigned int x = 0; x < down.width; ++x) {
+                        for (unsigned int c = 0; c < 4; ++c) {
+                            const unsigned int x0 = std::min(2 * x, level.width - 1);
+                            const unsigned int x1 = std::min(2 * x + 1, level.width - 1);
+                            const unsigned int y0 = std::min(2 * y, level.height - 1);
+                            const unsigned int y1 = std::min(2 * y + 1, level.height - 1);
+                            const unsigned int sum =
+                                current[((size_t)y0 * level.width + x0) * 4 + c] +
+                                current[((size_t)y0 * level.width + x1) * 4 + c] +
+                                current[((size_t)y1 * level.width + x0) * 4 + c] +
+                                current[((size_t)y1 * level.width + x1) * 4 + c];
+                            next[((size_t)y * down.width + x) * 4 + c] = (sum + 2) / 4;
+                        }
+                    }
+                }
+                current.swap(next);
+            }
+        }
+        return std::fclose(file) == 0 && ok;
+    }
+
+    // Copies the texel at byte `offset` of a tile to `rgba`, loading the tile and evicting the
+    // least recently used unpinned ones of its shard as needed.
+    void fetch(int id, unsigned int level, unsigned int tx, unsigned int ty, size_t offset,
+               unsigned char* rgba)
+    {
+        const uint64_t key =
+            ((uint64_t)id << 48) | ((uint64_t)level << 40) | ((uint64_t)ty << 20) | tx;
+        // The top bits of the product depend on every bit of the key.
+        const uint32_t hash = (uint32_t)((key * 0x9E3779B97F4A7C15ull) >> 32);
+        shard& s = shardList[((uint64_t)hash * shards) >> 32];
+        std::unique_lock<std::mutex> lock(s.mutex);
+        s.lookups++;
+        auto found = s.index.find(key);
+        if (found != s.index.end()) {
+            s.hits++;
+            s.lru.splice(s.lru.begin(), s.lru, found->second);
+            tile& t = *found->second;
+            if (!t.ready) {
+                t.pins++;
+                s.loaded.wait(lock, [&] { return t.ready; });
+                t.pins--;
+            }
+            std::copy(t.pixels.data() + offset, t.pixels.data() + offset + 4, rgba);
+            return;
+        }
+        s.misses++;
+        auto victim = s.lru.end();
+        while (victim != s.lru.begin() && s.residentBytes + tileBytes > shardBudgetBytes) {
+            --victim;
+            if (victim->pins == 0) {
+                s.index.erase(victim->key);
+                victim = s.lru.erase(victim);
+                s.residentBytes -= tileBytes;
+                residentBytes -= tileBytes;
+                s.evictions++;
+            }
+        }
+        s.lru.push_front(tile{key, false, 1, std::vector<unsigned char>(tileBytes)});
+        const auto loading = s.lru.begin();
+        s.index[key] = loading;
+        s.residentBytes += tileBytes;
+        const size_t resident = residentBytes += tileBytes;
+        size_t peak = peakResidentBytes.load();
+        while (resident > peak && !peakResidentBytes.compare_exchange_weak(peak, resident)) {
+        }
+        lock.unlock();
+
+        const textureInfo& t = textures[id];
+        const levelInfo& l = t.levels[level];
+        unsigned char* pixels = loading->pixels.data();
+        {
+            std::lock_guard<std::mutex> fileLock(*t.fileMutex);
+            if (!seek(t.file, l.offset + ((uint64_t)ty * l.tilesX + tx) * tileBytes) ||
+                std::fread(pixels, 1, tileBytes, t.file) != tileBytes) {
+                std::fill(pixels, pixels + tileBytes, 0);
+            }
+        }
+        std::copy(pixels + offset, pixels + offset + 4, rgba);
+
+        lock.lock();
+        loading->ready = true;
+        loading->pins--;
+        lock.unlock();
+        s.loaded.notify_all();
+    }
+
+    vec3 texel(int id, unsigned int level, int x, int y)
+    {
+        const levelInfo& l = textures[id].levels[level];
+        x = ((x % (int)l.width) + l.width) % l.width;
+        y = ((y % (int)l.height) + l.height) % l.height;
+        unsigned char p[4];
+        fetch(id, level, x / tileSize, y / tileSize, ((y % tileSize) * tileSize + x % tileSize) * 4,
+              p);
+        const float r = p[0] / 255.f, g = p[1] / 255.f, b = p[2] / 255.f;
+        return vec3(r * r, g * g, b * b);
+    }
+
+    vec3 bilinear(int id, unsigned int level, float u, float v)
+    {
+        const levelInfo& l = textures[id].levels[level];
+        const float x = (u - floorf(u)) * l.width - 0.5f;
+        const float y = (1.f - (v - floorf(v))) * l.height - 0.5f; // v = 0 is the bottom row
+        const int x0 = (int)floorf(x), y0 = (int)floorf(y);
+        const float fx = x - x0, fy = y - y0;
+        return (texel(id, level, x0, y0) * (1.f - fx) + texel(id, level, x0 + 1, y0) * fx) *
+                   (1.f - fy) +
+               (texel(id, level, x0, y0 + 1) * (1.f - fx) + texel(id, level, x0 + 1, y0 + 1) * fx) *
+                   fy;
+    }
+
+    const size_t tileBytes;
+    const size_t budgetBytes;
+    const unsigned int shards; // in use, fewer when the budget holds fewer than maxShards tiles
+    const size_t shardBudgetBytes;
+    std::vector<textureInfo> textures; // added before rendering, read only while sampling
+    std::mutex texturesMutex;
+    size_t fullResolutionBytes;
+    shard shardList[maxShards];
+    std::atomic<size_t> residentBytes;
+    std::atomic<size_t> peakResidentBytes;
+};
+
+// Image texture served by a textureCache. The mip level follows the footprint of the hit.
+class imageTexture : public texture
+{
+  public:
+    imageTexture(textureCache* cache, int id) : cache(cache), id(id) {}
+    virtual vec3 value(float u, float v, float footprint) const
+    {
+        const float texels = footprint * std::max(cache->width(id), cache->height(id));
+        return cache->sample(id, u, v, texels > 1.f ? log2f(texels) : 0.f);
+    }
+
+    textureCache* cache;
+    int id;
+};
+
+#endif
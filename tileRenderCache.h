@@ -0,0 +1,320 @@
+#ifndef TILERENDERCACHE_H
+#define TILERENDERCACHE_H
+
+#include "camera.h"
+#include "contentHash.h"
+#include "environment.h"
+#include "hitable.h"
+#include "radianceCache.h"
+#include "renderJob.h"
+#include "scene.h"
+#include "trace.h"
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <filesystem>
+#include <functional>
+#include <string>
+#include <thread>
+#include <vector>
+
+#ifdef _WIN32
+#include <process.h>
+#else
+#include <unistd.h>
+#endif
+
+// Persistent, content-addressed cache of rendered tiles for look-dev loops that re-render nearly
+// the same frame. Every tile gets a key hashing the camera, the render settings, its position
+// and the description of every object that may change it; a tile whose key has a file in the
+// cache directory is read back, the others are rendered through renderJob and stored.
+//
+// By default every tile depends on every object, so any edit invalidates every tile: light can
+// reach a tile from anywhere in the scene. A finite `influenceRadius` opts in to narrowing that
+// down from bounds:
+//  - objects whose bounding sphere, widened by the lens blur, touches the tile's frustum;
+//  - objects within `influenceRadius` of that frustum, for shadows and diffuse interreflection;
+//  - every object, when the tile sees a metal or glass one, since a reflection or refraction
+//    can show anything; or with a finite `reflectionRadius`, the objects within it.
+// This approximates: a change further away than `influenceRadius` (or `reflectionRadius` from a
+// shiny tile) leaves the tile cached, so the image can be stale there.
+//
+// Sampling is random, so a re-rendered tile has different noise than its cached neighbours.
+// Lighting outside the description is keyed too: the environment map by its contentKey and the
+// radiance cache by its settings. The cache's contents, which change as it fills, are not.
+class tileRenderCache
+{
+  public:
+    struct result {
+        unsigned int tiles;
+        unsigned int reused;
+        unsigned int rendered;
+        double keyMilliseconds;    // hashing and frustum tests
+        double renderMilliseconds; // reading, rendering and writing tiles
+    };
+
+    tileRenderCache(const std::string& directory, float influenceRadius = INFINITY,
+                    float reflectionRadius = INFINITY)
+        : directory(directory), influenceRadius(influenceRadius),
+          reflectionRadius(reflectionRadius)
+    {
+        std::error_code error;
+        std::filesystem::create_directories(directory, error);
+    }
+
+    // Renders `description` (built as `world`) into `image`, `width * height` rgba floats.
+    // Renders nothing when the tile size is 0.
+    result render(const sceneDescription& description, const hitable* world,
+                  const cameraParameters& camParams, const renderSettings& settings,
+                  std::vector<float>& image)
+    {
+        trace::scope span("tile cache render");
+        result stats{0, 0, 0, 0., 0.};
+        if (settings.tileSize == 0) {
+            return stats;
+        }
+        auto t1 = std::chrono::high_resolution_clock::now();
+        const std::vector<uint64_t> keys = tileKeys(description, camParams, settings);
+        auto t2 = std::chrono::high_resolution_clock::now();
+        const unsigned int across = (settings.width + settings.tileSize - 1) / settings.tileSize;
+        image.assign((size_t)settings.width * settings.height * 4, 0.f);
+        std::vector<float> tile((size_t)settings.tileSize * settings.tileSize * 4);
+        std::vector<unsigned int> missing;
+        for (unsigned int t = 0; t < keys.size(); ++t) {
+            const unsigned int x0 = (t % across) * settings.tileSize;
+            const unsigned int y0 = (t / across) * settings.tileSize;
+            const unsigned int w = std::min(settings.tileSize, settings.width - x0);
+            const unsigned int h = std::min(settings.tileSize, settings.height - y0);
+            if (!readTile(keys[t], w, h, tile.data())) {
+                missing.push_back(t);
+                continue;
+            }
+            for (unsigned int j = 0; j < h; ++j) {
+                std::copy(tile.data() + (size_t)j * w * 4, tile.data() + (size_t)(j + 1) * w * 4,
+                          image.data() + ((size_t)(y0 + j) * settings.width + x0) * 4);
+            }
+        }
+        stats.tiles = (unsigned int)keys.size();
+        stats.rendered = (unsigned int)missing.size();
+        stats.reused = stats.tiles - stats.rendered;
+        if (!missing.empty()) {
+            const camera cam(camParams);
+            std::unique_ptr<renderJob> job = renderJob::submit(
+                world, cam, settings,
+                [&](const renderTile& t) {
+                    const unsigned int index =
+                        (t.y / settings.tileSize) * across + t.x / settings.tileSize;
+                    writeTile(keys[index], t.width, t.height, t.pixels);
+                },
+                missing);
+            job->wait();
+            const std::vector<float>& rendered = job->image();
+            for (unsigned int t : missing) {
+                const unsigned int x0 = (t % across) * settings.tileSize;
+                const unsigned int y0 = (t / across) * settings.tileSize;
+                const unsigned int x1 = std::min(settings.width, x0 + settings.tileSize);
+                const unsigned int y1 = std::min(settings.height, y0 + settings.tileSize);
+                for (unsigned int j = y0; j < y1; ++j) {
+                    const size_t row = (size_t)j * settings.width;
+                    std::copy(rendered.data() + (row + x0) * 4, rendered.data() + (row + x1) * 4,
+                              image.data() + (row + x0) * 4);
+                }
+            }
+        }
+        auto t3 = std::chrono::high_resolution_clock::now();
+        stats.keyMilliseconds =
+            std::chrono::duration_cast<std::chrono::microseconds>(t2 - t1).count() / 1000.0;
+        stats.renderMilliseconds =
+            std::chrono::duration_cast<std::chrono::microseconds>(t3 - t2).count() / 1000.0;
+        return stats;
+    }
+
+    // Key of every tile, row by row.
+    std::vector<uint64_t> tileKeys(const sceneDescription& description,
+                                   const cameraParameters& camParams,
+                                   const renderSettings& settings) const
+    {
+        contentHash frame;
+        frame.add(formatVersion);
+        frame.add(camParams);
+        frame.add(settings.minDistance);
+        frame.add(settings.maxDistance);
+        frame.add(settings.maxDepth);
+        frame.add(settings.sampling);
+        frame.add(settings.width);
+        frame.add(settings.height);
+        frame.add(settings.tileSize);
+        frame.add(settings.light.environment != nullptr);
+        if (settings.light.environment != nullptr) {
+            frame.add(settings.light.environment->contentKey);
+        }
+        frame.add(settings.light.cache != nullptr);
+        if (settings.light.cache != nullptr) {
+            const radianceCacheSettings& c = settings.light.cache->settings;
+            frame.add(c.cellSize);
+            frame.add(c.readDepth);
+            frame.add(c.minSamples);
+            frame.add(c.tableBits);
+        }
+
+        std::vector<uint64_t> objectKeys(description.spheres.size());
+        uint64_t everything = 0;
+        for (size_t i = 0; i < objectKeys.size(); ++i) {
+            contentHash object;
+            object.add(description.spheres[i]);
+            objectKeys[i] = object.value;
+            // A sum is independent of the object order.
+            everything += object.value;
+        }
+
+        const camera cam(camParams);
+        const float reflectionMargin = std::max(influenceRadius, reflectionRadius);
+        const unsigned int across = (settings.width + settings.tileSize - 1) / settings.tileSize;
+        const unsigned int down = (settings.height + settings.tileSize - 1) / settings.tileSize;
+        std::vector<uint64_t> keys(across * down);
+        for (unsigned int t = 0; t < keys.size(); ++t) {
+            const unsigned int x0 = (t % across) * settings.tileSize;
+            const unsigned int y0 = (t / across) * settings.tileSize;
+            const unsigned int x1 = std::min(settings.width, x0 + settings.tileSize);
+            const unsigned int y1 = std::min(settings.height, y0 + settings.tileSize);
+            const frustum f = tileFrustum(cam, float(x0) / settings.width,
+                                          float(x1) / settings.width, float(y0) / settings.height,
+                                          float(y1) / settings.height);
+            uint64_t dependencies = 0, reflected = 0;
+            bool specular = false;
+            const bool bounded = std::isfinite(influenceRadius);
+            for (size_t i = 0; bounded && i < description.spheres.size(); ++i) {
+                const sphereDescription& s = description.spheres[i];
+                if (std::isfinite(reflectionRadius) &&
+                    f.touches(cam, s.center, s.radius, reflectionMargin)) {
+                    reflected += objectKeys[i];
+                }
+                if (!f.touches(cam, s.center, s.radius, influenceRadius)) {
+                    continue;
+                }
+                dependencies += objectKeys[i];
+                specular = specular || (s.mat.type != materialType::lambertian &&
+                                        f.touches(cam, s.center, s.radius, 0.f));
+            }
+            if (!bounded) {
+                dependencies = everything;
+            } else if (specular) {
+                dependencies = std::isfinite(reflectionRadius) ? reflected : everything;
+            }
+            contentHash tileKey = frame;
+            tileKey.add(t);
+            tileKey.add(specular);
+            tileKey.add(dependencies);
+            keys[t] = tileKey.value;
+        }
+        return keys;
+    }
+
+    const std::string directory;
+    const float influenceRadius;
+    const float reflectionRadius;
+
+  private:
+    static constexpr uint32_t formatVersion = 1;
+
+    // The four side planes through the camera origin and the edges of a tile, normals inwards.
+    struct frustum {
+        vec3 normals[4];
+
+        // Whether a sphere, grown by `margin`, may meet the rays of the tile. Rays leave from
+        // the lens rather than its centre: an offset of up to lensRadius that scales with
+        // |1 - depth / focusDistance| along the ray.
+        bool touches(const camera& cam, const vec3& center, float radius, float margin) const
+        {
+            const vec3 toCenter = center - cam.origin;
+            const float depth = vec3::dot(toCenter, cam.direction) + radius;
+            const float blur =
+                cam.lensRadius * std::max(1.f, fabsf(1.f - depth / cam.focusDistance));
+            const float reach = radius + margin + blur;
+            if (depth + margin + blur < 0.f) {
+                return false; // behind the camera
+            }
+            for (const vec3& n : normals) {
+                if (vec3::dot(n, toCenter) < -reach) {
+                    return false;
+                }
+            }
+            return true;
+        }
+    };
+
+    static frustum tileFrustum(const camera& cam, float u0, float u1, float v0, float v1)
+    {
+        auto corner = [&cam](float u, float v) {
+            return cam.upperLeftCorner + u * cam.horizontal + v * cam.vertical - cam.origin;
+        };
+        const vec3 topLeft = corner(u0, v0), topRight = corner(u1, v0);
+        const vec3 bottomLeft = corner(u0, v1), bottomRight = corner(u1, v1);
+        const vec3 inside = (topLeft + topRight + bottomLeft + bottomRight) / 4.f;
+        const vec3 edges[4][2] = {{topLeft, bottomLeft},
+                                  {bottomLeft, bottomRight},
+                                  {bottomRight, topRight},
+                                  {topRight, topLeft}};
+        frustum f;
+        for (int e = 0; e < 4; ++e) {
+            vec3 n = vec3::cross(edges[e][0], edges[e][1]).normalized();
+            f.normals[e] = vec3::dot(n, inside) < 0 ? -n : n;
+        }
+        return f;
+    }
+
+    std::string pathOf(uint64_t key) const
+    {
+        char name[32];
+        std::snprintf(name, sizeof(name), "%016llx.tile", (unsigned long long)key);
+        return directory + "/" + name;
+    }
+
+    // A tile file: width and height as uint32, then the rgba floats row by row.
+    bool readTile(uint64_t key, unsigned int width, unsigned int height, float* pixels) const
+    {
+        std::FILE* file = std::fopen(pathOf(key).c_str(), "rb");
+        if (file == nullptr) {
+            return false;
+        }
+        uint32_t size[2];
+        const size_t count = (size_t)width * height * 4;
+        const bool ok = std::fread(size, sizeof(size), 1, file) == 1 && size[0] == width &&
+                        size[1] == height &&
+                        std::fread(pixels, sizeof(float), count, file) == count;
+        std::fclose(file);
+        return ok;
+    }
+
+    // Written under a temporary name and renamed, so a reader never sees a partial tile. The
+    // name is unique to the process and thread, so writers of the same tile never share a file.
+    void writeTile(uint64_t key, unsigned int width, unsigned int height,
+                   const float* pixels) const
+    {
+        const std::string path = pathOf(key);
+#ifdef _WIN32
+        const unsigned long process = (unsigned long)_getpid();
+#else
+        const unsigned long process = (unsigned long)getpid();
+#endif
+        const size_t thread = std::hash<std::thread::id>()(std::this_thread::get_id());
+        char suffix[48];
+        std::snprintf(suffix, sizeof(suffix), ".%lu.%zx.tmp", process, thread);
+        const std::string temporary = path + suffix;
+        std::FILE* file = std::fopen(temporary.c_str(), "wb");
+        if (file == nullptr) {
+            return;
+        }
+        const uint32_t size[2] = {width, height};
+        const size_t count = (size_t)width * height * 4;
+        const bool ok = std::fwrite(size, sizeof(size), 1, file) == 1 &&
+                        std::fwrite(pixels, sizeof(float), count, file) == count;
+        if (std::fclose(file) != 0 || !ok || std::rename(temporary.c_str(), path.c_str()) != 0) {
+            std::remove(temporary.c_str());
+        }
+    }
+};
+
+#endif
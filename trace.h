@@ -0,0 +1,164 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+// Opt-in timeline tracer. While enabled, trace::scope records a begin/end pair into a ring buffer
+// owned by the calling thread; nothing is locked on the hot path, only the first event of a
+// thread registers its buffer. writeJson() exports everything as Chrome trace-event JSON for
+// chrome://tracing or ui.perfetto.dev. Call it once the traced threads have finished.
+// Event names are not copied and must be string literals.
+namespace trace
+{
+struct event {
+    const char* name;
+    long long arg; // shown as args.index when >= 0 (row, tile, strip ...)
+    long long beginNanoseconds;
+    long long endNanoseconds;
+};
+
+struct threadBuffer {
+    unsigned int id;
+    std::string name;
+    std::vector<event> events; // ring of `capacity` events
+    size_t written;            // total events recorded, the ring keeps the latest
+};
+
+namespace detail
+{
+struct registry {
+    std::mutex mutex;
+    std::vector<std::unique_ptr<threadBuffer>> buffers;
+    std::chrono::steady_clock::time_point origin = std::chrono::steady_clock::now();
+    std::atomic_bool enabled{false};
+    size_t capacity = 1u << 14;
+};
+
+inline registry& instance()
+{
+    static registry r;
+    return r;
+}
+
+inline threadBuffer& currentBuffer()
+{
+    thread_local threadBuffer* buffer = nullptr;
+    if (buffer == nullptr) {
+        registry& r = instance();
+        std::lock_guard<std::mutex> lock(r.mutex);
+        r.buffers.push_back(std::unique_ptr<threadBuffer>(new threadBuffer{
+            (unsigned int)r.buffers.size() + 1, std::string(), std::vector<event>(r.capacity), 0}));
+        buffer = r.buffers.back().get();
+    }
+    return *buffer;
+}
+
+inline long long now()
+{
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() -
+                                                                 instance().origin)
+        .count();
+}
+} // namespace detail
+
+// `eventsPerThread` only applies to threads that record their first event afterwards.
+inline void enable(size_t eventsPerThread = 1u << 14)
+{
+    detail::instance().capacity = eventsPerThread;
+    detail::instance().enabled = true;
+}
+
+inline bool enabled() { return detail::instance().enabled.load(std::memory_order_relaxed); }
+
+// Label for the calling thread in the viewer.
+inline void setThreadName(const char* name)
+{
+    if (enabled()) {
+        detail::currentBuffer().name = name;
+    }
+}
+
+// For spans that do not match a C++ scope: complete(name, begin()) records [begin, now].
+inline long long begin() { return enabled() ? detail::now() : -1; }
+
+inline void complete(const char* name, long long begin, long long arg = -1)
+{
+    if (begin < 0) {
+        return;
+    }
+    threadBuffer& b = detail::currentBuffer();
+    b.events[b.written % b.events.size()] = event{name, arg, begin, detail::now()};
+    b.written++;
+}
+
+class scope
+{
+  public:
+    scope(const char* name, long long arg = -1) : name(name), arg(arg), start(begin()) {}
+    ~scope() { complete(name, start, arg); }
+    scope(const scope&) = delete;
+    scope& operator=(const scope&) = delete;
+
+  private:
+    const char* name;
+    long long arg;
+    long long start;
+};
+
+inline bool writeJson(const char* path)
+{
+    std::FILE* file = std::fopen(path, "wb");
+    if (file == nullptr) {
+        return false;
+    }
+    detail::registry& r = detail::instance();
+    std::lock_guard<std::mutex> lock(r.mutex);
+    std::fprintf(file, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n");
+    bool first = true;
+    for (const auto& b : r.buffers) {
+        std::string name = b->name.empty() ? "thread " + std::to_string(b->id) : b->name;
+        std::fprintf(file,
+                     "%s{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%u,"
+                     "\"args\":{\"name\":\"%s\"}}",
+                     first ? "" : ",\n", b->id, name.c_str());
+        first = false;
+        const size_t count = std::min(b->written, b->events.size());
+        for (size_t i = b->written - count; i < b->written; ++i) {
+            const event& e = b->events[i % b->events.size()];
+            std::fprintf(file,
+                         ",\n{\"name\":\"%s\",\"ph\":\"X\",\"pid\":1,\"tid\":%u,\"ts\":%.3f,"
+                         "\"dur\":%.3f",
+                         e.name, b->id, e.beginNanoseconds / 1000.0,
+                         (e.endNanoseconds - e.beginNanoseconds) / 1000.0);
+            if (e.arg >= 0) {
+                std::fprintf(file, ",\"args\":{\"index\":%lld}", e.arg);
+            }
+            std::fprintf(file, "}");
+        }
+    }
+    std::fprintf(file, "\n]}\n");
+    return std::fclose(file) == 0;
+}
+
+// Events recorded and events lost to ring wrap-around, over all threads.
+inline void counts(size_t& recorded, size_t& dropped)
+{
+    detail::registry& r = detail::instance();
+    std::lock_guard<std::mutex> lock(r.mutex);
+    recorded = 0;
+    dropped = 0;
+    for (const auto& b : r.buffers) {
+        recorded += b->written;
+        dropped += b->written > b->events.size() ? b->written - b->events.size() : 0;
+    }
+}
+} // namespace trace
+
+#endif
@@ -10,7 +10,8 @@ class vec2
   public:
     vec2() : e{0.f, 0.f} {}
     vec2(float x, float y) : e{x, y} {}
-    vec2(const vec2& v) : e{v.x(), v.y()} {}
+    vec2(const vec2&) = default;
+    vec2& operator=(const vec2&) = default;
 
     inline float x() const { return e[0]; }
     inline float y() const { return e[1]; }
@@ -32,26 +33,26 @@ class vec2
 
     inline vec2& operator+=(const vec2& v)
     {
-        e[0] += v.x;
-        e[1] += v.y;
+        e[0] += v.x();
+        e[1] += v.y();
         return *this;
     }
     inline vec2& operator-=(const vec2& v)
     {
-        e[0] -= v.x;
-        e[1] -= v.y;
+        e[0] -= v.x();
+        e[1] -= v.y();
         return *this;
     }
     inline vec2& operator*=(const vec2& v)
     {
-        e[0] *= v.x;
-        e[1] *= v.y;
+        e[0] *= v.x();
+        e[1] *= v.y();
         return *this;
     }
     inline vec2& operator/=(const vec2& v)
     {
-        e[0] /= v.x;
-        e[1] /= v.y;
+        e[0] /= v.x();
+        e[1] /= v.y();
         return *this;
     }
     inline vec2& operator*=(const float& s)
@@ -73,7 +74,7 @@ class vec2
     friend inline vec2 operator*(const float s, const vec2& v) { return v * s; }
 
     friend inline std::istream& operator>>(std::istream& is, vec2& v) { return is >> v[0] >> v[1]; }
-    friend inline std::ostream& operator>>(std::ostream& os, vec2& v)
+    friend inline std::ostream& operator<<(std::ostream& os, const vec2& v)
     {
         return os << "(" << v.x() << ", " << v.y() << ")";
     }
@@ -94,9 +95,9 @@ class vec2
 
     static float angle(const vec2& from, const vec2& to)
     {
-        return acoshf(dot(from, to) / (from.length() * to.length())) * mathx::rad2deg;
+        return acosf(dot(from, to) / (from.length() * to.length())) * mathx::rad2deg;
     }
-    static float cross(const vec2& v1, const vec2& v2) { return v1.x() * v2.y - v1.y() * v2.x(); }
+    static float cross(const vec2& v1, const vec2& v2) { return v1.x() * v2.y() - v1.y() * v2.x(); }
     static float distance(const vec2& v1, const vec2& v2) { return (v1 - v2).length(); }
     static float dot(const vec2& v1, const vec2& v2) { return v1.x() * v2.x() + v1.y() * v2.y(); }
 
@@ -5,12 +5,18 @@
 #include <cmath>
 #include <iostream>
 
+// Scalar vec3. Building with RT_VEC3_SIMD defined swaps in the 4-lane version from vec3Simd.h,
+// which has the same interface; both are trivially copyable.
+#ifdef RT_VEC3_SIMD
+#include "vec3Simd.h"
+#else
 class vec3
 {
   public:
     vec3() : e{0.f, 0.f, 0.f} {}
     vec3(float x, float y, float z) : e{x, y, z} {}
-    vec3(const vec3& v) : e{v.x(), v.y(), v.z()} {}
+
+    static inline const char* backend() { return "scalar"; }
 
     inline float x() const { return e[0]; }
     inline float y() const { return e[1]; }
@@ -95,7 +101,7 @@ class vec3
     {
         return is >> v[0] >> v[1] >> v[2];
     }
-    friend inline std::ostream& operator>>(std::ostream& os, vec3& v)
+    friend inline std::ostream& operator<<(std::ostream& os, const vec3& v)
     {
         return os << "(" << v.x() << ", " << v.y() << ", " << v.z() << ")";
     }
@@ -117,7 +123,9 @@ class vec3
 
     static inline float angle(const vec3& from, const vec3& to)
     {
-        return acoshf(dot(from, to) / (from.length() * to.length())) * mathx::rad2deg;
+        // Clamped, rounding can take the cosine of (anti)parallel vectors just past +-1.
+        const float cosine = dot(from, to) / (from.length() * to.length());
+        return acosf(mathx::min(1.f, mathx::max(-1.f, cosine))) * mathx::rad2deg;
     }
     static inline vec3 cross(const vec3& v1, const vec3& v2)
     {
@@ -133,15 +141,15 @@ class vec3
 
     float e[3];
 };
+#endif
 
+// The direction is stored as given, not normalized: intersection and scattering work with any
+// length, and the few places that need a unit vector normalize themselves.
 class ray
 {
   public:
     ray() : origin(), direction() {}
-    ray(const vec3& origin, const vec3& direction)
-        : origin(origin), direction(direction.normalized())
-    {
-    }
+    ray(const vec3& origin, const vec3& direction) : origin(origin), direction(direction) {}
     inline vec3 getPoint(float distance) const { return origin + direction * distance; }
     vec3 origin, direction;
 };
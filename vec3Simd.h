@@ -0,0 +1,176 @@
+#ifndef VEC3SIMD_H
+#define VEC3SIMD_H
+
+// 4-lane vec3 used when RT_VEC3_SIMD is defined (see vec3.h). x, y, z live in the low three
+// lanes of a 16-byte aligned register; the fourth lane is padding whose value is unspecified, so
+// dot products and lengths only ever sum the first three.
+
+#include "mathx.h"
+#include <cmath>
+#include <iostream>
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define VEC3SIMD_SSE
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+#include <arm_neon.h>
+#define VEC3SIMD_NEON
+#else
+#error "RT_VEC3_SIMD needs SSE2 or AArch64 NEON"
+#endif
+
+namespace simd4
+{
+#ifdef VEC3SIMD_SSE
+typedef __m128 lanes;
+inline lanes set(float x, float y, float z) { return _mm_set_ps(0.f, z, y, x); }
+inline lanes splat(float s) { return _mm_set1_ps(s); }
+inline lanes add(lanes a, lanes b) { return _mm_add_ps(a, b); }
+inline lanes sub(lanes a, lanes b) { return _mm_sub_ps(a, b); }
+inline lanes mul(lanes a, lanes b) { return _mm_mul_ps(a, b); }
+inline lanes div(lanes a, lanes b) { return _mm_div_ps(a, b); }
+inline lanes negate(lanes a) { return _mm_xor_ps(a, _mm_set1_ps(-0.f)); }
+inline float sum3(lanes a)
+{
+    __m128 y = _mm_shuffle_ps(a, a, _MM_SHUFFLE(1, 1, 1, 1));
+    __m128 z = _mm_shuffle_ps(a, a, _MM_SHUFFLE(2, 2, 2, 2));
+    return _mm_cvtss_f32(_mm_add_ss(_mm_add_ss(a, y), z));
+}
+// (y, z, x, w)
+inline lanes rotate(lanes a) { return _mm_shuffle_ps(a, a, _MM_SHUFFLE(3, 0, 2, 1)); }
+#else
+typedef float32x4_t lanes;
+inline lanes set(float x, float y, float z)
+{
+    const float values[4] = {x, y, z, 0.f};
+    return vld1q_f32(values);
+}
+inline lanes splat(float s) { return vdupq_n_f32(s); }
+inline lanes add(lanes a, lanes b) { return vaddq_f32(a, b); }
+inline lanes sub(lanes a, lanes b) { return vsubq_f32(a, b); }
+inline lanes mul(lanes a, lanes b) { return vmulq_f32(a, b); }
+inline lanes div(lanes a, lanes b) { return vdivq_f32(a, b); }
+inline lanes negate(lanes a) { return vnegq_f32(a); }
+inline float sum3(lanes a)
+{
+    return vgetq_lane_f32(a, 0) + vgetq_lane_f32(a, 1) + vgetq_lane_f32(a, 2);
+}
+// (y, z, x, w)
+inline lanes rotate(lanes a)
+{
+    lanes yzwx = vextq_f32(a, a, 1);
+    return vsetq_lane_f32(vgetq_lane_f32(a, 0), yzwx, 2);
+}
+#endif
+} // namespace simd4
+
+class vec3
+{
+  public:
+    vec3() : v(simd4::splat(0.f)) {}
+    vec3(float x, float y, float z) : v(simd4::set(x, y, z)) {}
+    explicit vec3(simd4::lanes v) : v(v) {}
+
+    static inline const char* backend()
+    {
+#ifdef VEC3SIMD_SSE
+        return "sse";
+#else
+        return "neon";
+#endif
+    }
+
+    inline float x() const { return e[0]; }
+    inline float y() const { return e[1]; }
+    inline float z() const { return e[2]; }
+
+    inline const vec3& operator+() const { return *this; }
+    inline const vec3 operator-() const { return vec3(simd4::negate(v)); }
+
+    inline float operator[](int i) const { return e[i]; }
+    inline float& operator[](int i) { return e[i]; };
+
+    inline vec3 operator+(const vec3& o) const { return vec3(simd4::add(v, o.v)); }
+    inline vec3 operator-(const vec3& o) const { return vec3(simd4::sub(v, o.v)); }
+    inline vec3 operator*(const vec3& o) const { return vec3(simd4::mul(v, o.v)); }
+    inline vec3 operator/(const vec3& o) const { return vec3(simd4::div(v, o.v)); }
+    inline vec3 operator+(const float s) const { return vec3(simd4::add(v, simd4::splat(s))); }
+    inline vec3 operator-(const float s) const { return vec3(simd4::sub(v, simd4::splat(s))); }
+    inline vec3 operator*(const float s) const { return vec3(simd4::mul(v, simd4::splat(s))); }
+    inline vec3 operator/(const float s) const { return vec3(simd4::div(v, simd4::splat(s))); }
+
+    inline vec3& operator+=(const vec3& o)
+    {
+        v = simd4::add(v, o.v);
+        return *this;
+    }
+    inline vec3& operator-=(const vec3& o)
+    {
+        v = simd4::sub(v, o.v);
+        return *this;
+    }
+    inline vec3& operator*=(const vec3& o)
+    {
+        v = simd4::mul(v, o.v);
+        return *this;
+    }
+    inline vec3& operator/=(const vec3& o)
+    {
+        v = simd4::div(v, o.v);
+        return *this;
+    }
+    inline vec3& operator*=(const float& s)
+    {
+        v = simd4::mul(v, simd4::splat(s));
+        return *this;
+    }
+    inline vec3& operator/=(const float& s)
+    {
+        v = simd4::mul(v, simd4::splat(1.0f / s));
+        return *this;
+    }
+
+    friend inline vec3 operator+(const float s, const vec3& v) { return v + s; }
+    friend inline vec3 operator-(const float s, const vec3& v) { return v - s; }
+    friend inline vec3 operator*(const float s, const vec3& v) { return v * s; }
+
+    friend inline std::istream& operator>>(std::istream& is, vec3& v)
+    {
+        return is >> v[0] >> v[1] >> v[2];
+    }
+    friend inline std::ostream& operator<<(std::ostream& os, const vec3& v)
+    {
+        return os << "(" << v.x() << ", " << v.y() << ", " << v.z() << ")";
+    }
+
+    inline float length() const { return sqrtf(squaredLength()); }
+    inline float squaredLength() const { return simd4::sum3(simd4::mul(v, v)); }
+    inline vec3 normalized() const { return vec3(simd4::mul(v, simd4::splat(1.0f / length()))); }
+    inline void normalize() { v = simd4::mul(v, simd4::splat(1.0f / length())); }
+
+    static inline float angle(const vec3& from, const vec3& to)
+    {
+        // Clamped, rounding can take the cosine of (anti)parallel vectors just past +-1.
+        const float cosine = dot(from, to) / (from.length() * to.length());
+        return acosf(mathx::min(1.f, mathx::max(-1.f, cosine))) * mathx::rad2deg;
+    }
+    static inline vec3 cross(const vec3& v1, const vec3& v2)
+    {
+        // v1 * v2.yzx - v1.yzx * v2 is the cross product rotated by one lane.
+        simd4::lanes c = simd4::sub(simd4::mul(v1.v, simd4::rotate(v2.v)),
+                                    simd4::mul(simd4::rotate(v1.v), v2.v));
+        return vec3(simd4::rotate(c));
+    }
+    static inline float distance(const vec3& v1, const vec3& v2) { return (v1 - v2).length(); }
+    static inline float dot(const vec3& v1, const vec3& v2)
+    {
+        return simd4::sum3(simd4::mul(v1.v, v2.v));
+    }
+
+    union {
+        simd4::lanes v;
+        float e[4];
+    };
+};
+
+#endif
@@ -0,0 +1,140 @@
+#ifndef WAVEFRONT_H
+#define WAVEFRONT_H
+
+#include "lbvh.h"
+#include "render.h"
+#include <algorithm>
+#include <cfloat>
+#include <chrono>
+#include <cstdint>
+#include <vector>
+
+// Breadth-first path tracing: all paths of a batch are advanced one bounce at a time instead of
+// recursing per sample. After the first bounce off diffuse and glossy surfaces directions are
+// random, so neighbouring rays walk unrelated parts of the BVH; with `sortSecondary` every wave
+// of secondary rays is reordered by direction octant and the Morton code of its origin before it
+// is traced, so consecutive rays tend to visit the same nodes and primitives.
+namespace wavefront
+{
+struct pathState {
+    ray r;
+    vec3 throughput;
+    unsigned int pixel; // index into the region being rendered
+    rayCone cone;       // texture footprint, see texture.h
+};
+
+struct traceStats {
+    unsigned long long rays;
+    double sortMilliseconds;
+    double traceMilliseconds;
+};
+
+// Direction octant in the top 3 bits, Morton code of the origin (normalized to the wave's
+// bounds) in the lower 29.
+inline uint32_t rayKey(const ray& r, const vec3& originMin, const vec3& inverseExtent)
+{
+    uint32_t octant = (r.direction.x() < 0.f ? 4u : 0u) | (r.direction.y() < 0.f ? 2u : 0u) |
+                      (r.direction.z() < 0.f ? 1u : 0u);
+    return (octant << 29) | (lbvh::morton3D((r.origin - originMin) * inverseExtent) >> 1);
+}
+
+// Reorders `paths` by rayKey; `scratch` keeps its capacity between waves.
+inline void sortPaths(std::vector<pathState>& paths, std::vector<pathState>& scratch)
+{
+    const aabb empty(vec3(FLT_MAX, FLT_MAX, FLT_MAX), vec3(-FLT_MAX, -FLT_MAX, -FLT_MAX));
+    aabb bounds = empty;
+    for (const pathState& p : paths) {
+        bounds.expandToInclude(p.r.origin);
+    }
+    vec3 extent = bounds.extent();
+    vec3 inverseExtent(extent.x() > 0 ? 1 / extent.x() : 0, extent.y() > 0 ? 1 / extent.y() : 0,
+                       extent.z() > 0 ? 1 / extent.z() : 0);
+    std::vector<uint32_t> keys(paths.size()), order(paths.size());
+    for (size_t i = 0; i < paths.size(); ++i) {
+        keys[i] = rayKey(paths[i].r, bounds.min(), inverseExtent);
+        order[i] = (uint32_t)i;
+    }
+    lbvh::radixSort(keys, order, 1);
+    scratch.resize(paths.size());
+    for (size_t i = 0; i < paths.size(); ++i) {
+        scratch[i] = paths[order[i]];
+    }
+    paths.swap(scratch);
+}
+
+// Same output as raycastWorld (linear rgba floats), traced `batchSize` paths at a time.
+inline void raycast(const raycastWorldParameters& params, const hitable* world,
+                    const camera& cam, float* out, bool sortSecondary, unsigned int batchSize,
+                    traceStats& stats)
+{
+    trace::scope span("wavefront raycast", params.startHeight);
+    const unsigned int regionWidth = params.endWidth - params.startWidth;
+    const unsigned int pixelCount = regionWidth * (params.endHeight - params.startHeight);
+    const size_t sampleCount = (size_t)pixelCount * params.sampling;
+    std::vector<vec3> sums(pixelCount, vec3(0.f, 0.f, 0.f));
+    std::vector<pathState> paths, next, scratch;
+    paths.reserve(batchSize);
+    next.reserve(batchSize);
+
+    for (size_t first = 0; first < sampleCount; first += batchSize) {
+        const size_t last = std::min(sampleCount, first + batchSize);
+        paths.clear();
+        for (size_t s = first; s < last; ++s) {
+            const unsigned int pixel = (unsigned int)(s / params.sampling);
+            const unsigned int i = params.startWidth + pixel % regionWidth;
+            const unsigned int j = params.startHeight + pixel / regionWidth;
+            float u = float(i + myRandom::next()) / float(params.width);
+            float v = float(j + myRandom::next()) / float(params.height);
+            paths.push_back(pathState{cam.getRay(u, v), vec3(1.f, 1.f, 1.f), pixel,
+                                      rayCone{0.f, texture::pixelSpread}});
+        }
+        for (unsigned int depth = 0; !paths.empty(); ++depth) {
+            if (sortSecondary && depth > 0) {
+                trace::scope sortSpan("sort rays", depth);
+                auto t1 = std::chrono::high_resolution_clock::now();
+                sortPaths(paths, scratch);
+                auto t2 = std::chrono::high_resolution_clock::now();
+                stats.sortMilliseconds +=
+                    std::chrono::duration_cast<std::chrono::microseconds>(t2 - t1).count() /
+                    1000.0;
+            }
+            auto t1 = std::chrono::high_resolution_clock::now();
+            next.clear();
+            for (const pathState& p : paths) {
+                hitRecord rec;
+                ++tracedRays;
+                if (!world->hit(p.r, params.minDistance, params.maxDistance, rec)) {
+                    sums[p.pixel] += p.throughput * backgroundColor(p.r);
+                    continue;
+                }
+                textureCone = p.cone;
+                textureCone.width += textureCone.spread * rec.distance * p.r.direction.length();
+                ray scattered;
+                vec3 attenuation;
+                if (depth < params.maxDepth && rec.mat->scatter(p.r, rec, attenuation, scattered)) {
+                    next.push_back(
+                        pathState{scattered, p.throughput * attenuation, p.pixel, textureCone});
+                }
+            }
+            auto t2 = std::chrono::high_resolution_clock::now();
+            stats.rays += paths.size();
+            stats.traceMilliseconds +=
+                std::chrono::duration_cast<std::chrono::microseconds>(t2 - t1).count() / 1000.0;
+            paths.swap(next);
+        }
+    }
+
+    for (unsigned int pixel = 0; pixel < pixelCount; ++pixel) {
+        const unsigned int i = params.startWidth + pixel % regionWidth;
+        const unsigned int j = params.startHeight + pixel / regionWidth;
+        vec3 col = sums[pixel] / params.sampling;
+        int index = (((j - params.outStartHeight) * params.width) + i) * params.channels;
+        out[index + 0] = col.x();
+        out[index + 1] = col.y();
+        out[index + 2] = col.z();
+        out[index + 3] = 1.f;
+    }
+}
+} // namespace wavefront
+
+#endif